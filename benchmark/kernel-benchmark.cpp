@@ -0,0 +1,501 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <cstdio>
+#include <cmath>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <algorithm>
+#include <stdexcept>
+#include "../common/tile-scheduler.h"
+#include "../common/raw-image.h"
+#include "../common/bit-plane.h"
+#include "../common/tone-levels.h"
+#include "../digital-half-toning/dithering/dithering.h"
+#include "../digital-half-toning/dithering/blue-noise.h"
+#include "../digital-half-toning/error-diffusion/error-diffusion.h"
+#include "../color-half-toning-with-error-diffusion/separable-error-diffusion/separable-error-diffusion.h"
+#include "../color-half-toning-with-error-diffusion/mbvq-based-error-diffusion/mbvq-based-error-diffusion.h"
+#include "../edge-detection/sober-edge-detector/sober-edge-detector.h"
+#include "../edge-detection/canny-edge-detector/canny-edge-detector.h"
+#include "../halftone-edge/edge-guided-diffusion.h"
+#ifdef HAVE_OPENCV
+#include <opencv2/opencv.hpp>
+#include <opencv2/ximgproc.hpp>
+#include "../edge-detection/structured-edge/structured-edge.h"
+#endif
+
+using namespace std;
+
+// Throughput of every edge and halftone kernel on synthetic images of 0.25 to
+// 64 megapixels at 1 to N threads, each point timed over several runs after a
+// warm-up and reported as mean Mpix/s with its standard deviation. Before
+// timing, the kernels are run on the committed sample images and compared
+// byte for byte with the committed outputs.
+
+#ifndef SOURCE_DIR
+#define SOURCE_DIR ".."
+#endif
+
+const uint64_t SYNTHETIC_SEED = 0x5EED;
+
+struct SyntheticImage {
+    int width = 0;
+    int height = 0;
+    vector<uint8_t> gray;
+    vector<uint8_t> rgb;
+};
+
+inline uint8_t clampByte(float value) {
+    return static_cast<uint8_t>(min(255.0f, max(0.0f, value)));
+}
+
+// A 3:2 image of smooth shading (what the halftones see in photographs), a
+// checkerboard of hard edges every 64 pixels (what the edge detectors look
+// for) and a little noise. The content depends only on the size.
+SyntheticImage syntheticImage(double megapixels) {
+    SyntheticImage image;
+    image.width = max(16, static_cast<int>(lround(sqrt(megapixels * 1e6 * 1.5))));
+    image.height = max(16, static_cast<int>(lround(image.width / 1.5)));
+    int width = image.width;
+    int height = image.height;
+    image.gray.resize(static_cast<size_t>(width) * height);
+    image.rgb.resize(static_cast<size_t>(width) * height * 3);
+
+    vector<float> waveX(width), waveY(height);
+    for (int x = 0; x < width; ++x) waveX[x] = sin(x * 0.013f);
+    for (int y = 0; y < height; ++y) waveY[y] = cos(y * 0.009f);
+    forEachTile(width, height, 0, [&](const Tile& tile) {
+        for (int y = tile.y0; y < tile.y1; ++y) {
+            size_t row = static_cast<size_t>(y) * width;
+            CounterRng rng(SYNTHETIC_SEED, row + tile.x0);
+            for (int x = tile.x0; x < tile.x1; ++x) {
+                float edge = ((x >> 6) ^ (y >> 6)) & 1 ? 30.0f : -30.0f;
+                float noise = static_cast<float>(rng.next() >> 28) - 7.5f;
+                float base = 128.0f + 70.0f * waveX[x] * waveY[y] + edge + noise;
+                image.gray[row + x] = clampByte(base);
+                image.rgb[(row + x) * 3] = clampByte(base + 40.0f * waveX[x]);
+                image.rgb[(row + x) * 3 + 1] = clampByte(base - 40.0f * waveY[y]);
+                image.rgb[(row + x) * 3 + 2] = clampByte(255.0f - base);
+            }
+        }
+    });
+    return image;
+}
+
+ImageView<const unsigned char> rgbView(const SyntheticImage& image) {
+    return ImageView<const unsigned char>::interleaved(image.rgb.data(), image.width, image.height, 3);
+}
+
+// A benchmark prepares its output buffers for one image and returns the
+// timed body, which takes the thread count. Serial kernels run only at 1.
+struct Benchmark {
+    string name;
+    bool threaded;
+    function<function<void(int)>(const SyntheticImage&)> prepare;
+};
+
+template <typename Kernel, bool Serpentine>
+Benchmark errorDiffusionBenchmark(const string& name) {
+    return {name, true, [](const SyntheticImage& image) {
+        auto output = make_shared<vector<uint8_t>>(image.gray.size());
+        return [&image, output](int threads) {
+            applyErrorDiffusion<Kernel, Serpentine>(image.gray.data(), output->data(), image.width, image.height, threads);
+        };
+    }};
+}
+
+Benchmark ditherBenchmark(int N) {
+    return {"dither-I" + to_string(N), true, [N](const SyntheticImage& image) {
+        auto output = make_shared<vector<uint8_t>>(image.gray.size());
+        return [&image, output, N](int) {
+            ditherMatrix(image.gray.data(), output->data(), image.width, image.height, N);
+        };
+    }};
+}
+
+// The array is generated, or read from the cache, before timing starts.
+Benchmark blueNoiseBenchmark(int size) {
+    return {"blue-noise-" + to_string(size), true, [size](const SyntheticImage& image) {
+        auto output = make_shared<vector<uint8_t>>(image.gray.size());
+        const BlueNoise& noise = blueNoise(size);
+        return [&image, output, &noise](int) {
+            ditherBlueNoise(image.gray.data(), output->data(), image.width, image.height, noise);
+        };
+    }};
+}
+
+// 4-level output packed at 2 bits per pixel (see tone-levels.h).
+Benchmark fsLevelsBenchmark() {
+    return {"fs-serpentine-L4", true, [](const SyntheticImage& image) {
+        auto levels = make_shared<ToneLevels>(makeToneLevels(4));
+        auto output = make_shared<vector<uint8_t>>(packedLevelSize(image.width, image.height, *levels));
+        return [&image, levels, output](int threads) {
+            applyErrorDiffusion<FloydSteinbergKernel, true>(
+                image.gray.data(), packedLevelPlane(output->data(), image.width, image.height, *levels), image.width,
+                image.height, threads);
+        };
+    }};
+}
+
+Benchmark mbvqLevelsBenchmark() {
+    return {"mbvq-L4", false, [](const SyntheticImage& image) {
+        auto levels = make_shared<ToneLevels>(makeToneLevels(4));
+        auto output = make_shared<vector<uint8_t>>(packedLevelSize(image.width, image.height, *levels, 3));
+        return [&image, levels, output](int) {
+            mbvqErrorDiffusion(rgbView(image), packedLevelPlanes(output->data(), image.width, image.height, *levels));
+        };
+    }};
+}
+
+template <typename Diffuse>
+Benchmark colorBenchmark(const string& name, Diffuse diffuse) {
+    return {name, false, [diffuse](const SyntheticImage& image) {
+        auto output = make_shared<vector<uint8_t>>(image.rgb.size());
+        return [&image, output, diffuse](int) {
+            diffuse(rgbView(image), interleavedPlanes(output->data(), image.width));
+        };
+    }};
+}
+
+vector<Benchmark> allBenchmarks(const string& seModel) {
+    vector<Benchmark> benchmarks;
+    benchmarks.push_back({"sobel", true, [](const SyntheticImage& image) {
+        return [&image](int) {
+            applySobelFused(rgbView(image), {5, 15, 30});
+        };
+    }});
+    benchmarks.push_back({"sobel-deferred", true, [](const SyntheticImage& image) {
+        return [&image](int) {
+            applySobelFused(rgbView(image), {5, 15, 30}, false, SobelRescale::Deferred);
+        };
+    }});
+    benchmarks.push_back({"sobel-int16", true, [](const SyntheticImage& image) {
+        return [&image](int) {
+            applySobelInt16(convertToGray8(rgbView(image)), image.width, image.height, {5, 15, 30});
+        };
+    }});
+    for (int N : {2, 8, 32}) {
+        benchmarks.push_back(ditherBenchmark(N));
+    }
+    for (int size : {64, 256}) {
+        benchmarks.push_back(blueNoiseBenchmark(size));
+    }
+    benchmarks.push_back(errorDiffusionBenchmark<FloydSteinbergKernel, true>("fs-serpentine"));
+    benchmarks.push_back(errorDiffusionBenchmark<JarvisJudiceNinkeKernel, false>("jjn"));
+    benchmarks.push_back(errorDiffusionBenchmark<StuckiKernel, false>("stucki"));
+    benchmarks.push_back(fsLevelsBenchmark());
+    benchmarks.push_back({"fs-serpentine-banded", true, [](const SyntheticImage& image) {
+        auto output = make_shared<vector<uint8_t>>(image.gray.size());
+        return [&image, output](int) {
+            applyErrorDiffusionBanded<FloydSteinbergKernel, true>(image.gray.data(), output->data(), image.width,
+                                                                  image.height);
+        };
+    }});
+    // One thread runs the Sobel and diffusion stages in turn, more pipeline them.
+    benchmarks.push_back({"edge-guided-fs", true, [](const SyntheticImage& image) {
+        auto output = make_shared<vector<uint8_t>>(image.gray.size());
+        return [&image, output](int threads) {
+            edgeGuidedDiffusion<FloydSteinbergKernel, true>(image.gray.data(), output->data(), image.width,
+                                                            image.height, DEFAULT_EDGE_GAIN, threads > 1);
+        };
+    }});
+    benchmarks.push_back(colorBenchmark("separable-cmy", [](ImageView<const unsigned char> rgb, const array<BytePlane, 3>& out) {
+        separableErrorDiffusion(rgb, out);
+    }));
+    benchmarks.push_back(colorBenchmark("separable-cmy-fused", [](ImageView<const unsigned char> rgb, const array<BytePlane, 3>& out) {
+        separableErrorDiffusionFused(rgb, out);
+    }));
+    benchmarks.push_back(colorBenchmark("mbvq", [](ImageView<const unsigned char> rgb, const array<BytePlane, 3>& out) {
+        mbvqErrorDiffusion(rgb, out);
+    }));
+    benchmarks.push_back({"mbvq-banded", true, [](const SyntheticImage& image) {
+        auto output = make_shared<vector<uint8_t>>(image.rgb.size());
+        return [&image, output](int) {
+            mbvqErrorDiffusionBanded(rgbView(image), output->data());
+        };
+    }});
+    benchmarks.push_back(mbvqLevelsBenchmark());
+    benchmarks.push_back(colorBenchmark("mbvq-fixed", [](ImageView<const unsigned char> rgb, const array<BytePlane, 3>& out) {
+        mbvqErrorDiffusionFixed(rgb, out);
+    }));
+    benchmarks.push_back({"canny-sweep", true, [](const SyntheticImage& image) {
+        // Eight pairs at the 1:3 ratio of the tool's defaults.
+        vector<pair<double, double>> thresholds;
+        for (int k = 1; k <= 8; ++k) {
+            thresholds.push_back({15.0 * k, 45.0 * k});
+        }
+        return [&image, thresholds](int) {
+            cannyHysteresis(cannyCandidates(image.gray.data(), image.width, image.height, image.width), thresholds);
+        };
+    }});
+#ifdef HAVE_OPENCV
+    if (ifstream(seModel).good()) {
+        shared_ptr<const cv::ximgproc::StructuredEdgeDetection> detector =
+            cv::ximgproc::createStructuredEdgeDetection(seModel);
+        benchmarks.push_back({"structured-edge", true, [detector](const SyntheticImage& image) {
+            cv::Mat rgb(image.height, image.width, CV_8UC3, const_cast<uint8_t*>(image.rgb.data()));
+            return [detector, rgb](int threads) {
+                cv::setNumThreads(threads);
+                detectStructuredEdges(*detector, rgb);
+            };
+        }});
+    } else {
+        cerr << "structured-edge: no model at " << seModel << ", skipped" << endl;
+    }
+#else
+    (void)seModel;
+#endif
+    return benchmarks;
+}
+
+struct Measurement {
+    double mean = 0.0;
+    double stddev = 0.0;
+    double min = 0.0;
+    double max = 0.0;
+};
+
+Measurement measure(int runs, uint64_t pixels, const function<void(int)>& body, int threads) {
+    body(threads);  // warm-up: first-touch page faults, pool start-up
+    vector<double> rates;
+    for (int r = 0; r < runs; ++r) {
+        auto start = chrono::steady_clock::now();
+        body(threads);
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        rates.push_back(pixels / seconds / 1e6);
+    }
+    Measurement m;
+    for (double rate : rates) m.mean += rate;
+    m.mean /= runs;
+    for (double rate : rates) m.stddev += (rate - m.mean) * (rate - m.mean);
+    m.stddev = runs > 1 ? sqrt(m.stddev / (runs - 1)) : 0.0;
+    m.min = *min_element(rates.begin(), rates.end());
+    m.max = *max_element(rates.begin(), rates.end());
+    return m;
+}
+
+// Golden checks: each kernel runs on a committed sample image and must
+// reproduce the committed output exactly.
+class GoldenChecker {
+public:
+    explicit GoldenChecker(string root) : root(move(root)) {}
+
+    void check(const string& name, const string& input, int width, int height, int inputChannels,
+               const string& golden, int goldenChannels, const function<void(const uint8_t*, uint8_t*)>& kernel) {
+        try {
+            MappedFile inputImage = mapRawImage(root + "/" + input, width, height, inputChannels);
+            MappedFile goldenImage = mapRawImage(root + "/" + golden, width, height, goldenChannels);
+            vector<uint8_t> output(goldenImage.size());
+            kernel(inputImage.data(), output.data());
+            compare(name, golden, output.data(), goldenImage.data(), output.size());
+        } catch (const exception& e) {
+            printf("  FAIL  %-22s %s\n", name.c_str(), e.what());
+            ++failures;
+        }
+    }
+
+    void compare(const string& name, const string& reference, const uint8_t* output, const uint8_t* expected,
+                 size_t size) {
+        size_t differ = 0;
+        for (size_t i = 0; i < size; ++i) {
+            differ += output[i] != expected[i];
+        }
+        if (differ == 0) {
+            printf("  ok    %-22s %s\n", name.c_str(), reference.c_str());
+        } else {
+            printf("  FAIL  %-22s %s: %zu of %zu bytes differ\n", name.c_str(), reference.c_str(), differ, size);
+            ++failures;
+        }
+    }
+
+    void skip(const string& name, const string& reason) {
+        printf("  skip  %-22s %s\n", name.c_str(), reason.c_str());
+    }
+
+    int failures = 0;
+
+private:
+    string root;
+};
+
+template <typename Kernel, bool Serpentine>
+void checkErrorDiffusion(GoldenChecker& checker, const string& name, const string& golden) {
+#ifdef FMA_CONTRACTION
+    checker.check(name, "digital-half-toning/error-diffusion/Reflection.raw", 1280, 852, 1,
+                  "digital-half-toning/error-diffusion/" + golden, 1, [](const uint8_t* in, uint8_t* out) {
+        applyErrorDiffusion<Kernel, Serpentine>(in, out, 1280, 852, 1);
+    });
+#else
+    // The float goldens were produced with fused multiply-adds, which change
+    // the rounding of the diffused error.
+    (void)golden;
+    checker.skip(name, "needs FMA contraction (configure with -DFMA_CONTRACTION=ON)");
+#endif
+}
+
+int checkGoldens(const string& root) {
+    printf("goldens (%s):\n", root.c_str());
+    GoldenChecker checker(root);
+    for (int N : {2, 8, 32}) {
+        checker.check("dither-I" + to_string(N), "digital-half-toning/dithering/Reflection.raw", 1280, 852, 1,
+                      "digital-half-toning/dithering/3_dither_I" + to_string(N) + ".raw", 1,
+                      [N](const uint8_t* in, uint8_t* out) { ditherMatrix(in, out, 1280, 852, N); });
+    }
+    checkErrorDiffusion<FloydSteinbergKernel, true>(checker, "fs-serpentine", "4_error_diffusion_FS_serpentine.raw");
+    checkErrorDiffusion<JarvisJudiceNinkeKernel, false>(checker, "jjn", "5_error_diffusion_JJN.raw");
+    checkErrorDiffusion<StuckiKernel, false>(checker, "stucki", "6_error_diffusion_Stucki.raw");
+
+    auto flowers = [](const uint8_t* in) {
+        return ImageView<const unsigned char>::interleaved(in, 1280, 853, 3);
+    };
+    checker.check("separable-cmy", "color-half-toning-with-error-diffusion/separable-error-diffusion/Flowers.raw",
+                  1280, 853, 3, "color-half-toning-with-error-diffusion/separable-error-diffusion/Flowers_halftone.raw", 3,
+                  [&](const uint8_t* in, uint8_t* out) { separableErrorDiffusion(flowers(in), out); });
+    checker.check("mbvq", "color-half-toning-with-error-diffusion/mbvq-based-error-diffusion/Flowers.raw",
+                  1280, 853, 3, "color-half-toning-with-error-diffusion/mbvq-based-error-diffusion/Flowers_MBVQ.raw", 3,
+                  [&](const uint8_t* in, uint8_t* out) { mbvqErrorDiffusion(flowers(in), out); });
+
+    // The committed Sobel outputs come from the double path (which the fused
+    // path reproduces); the edge map is the one at 15%.
+    for (string name : {"Bird", "Deer"}) {
+        string dir = "edge-detection/sober-edge-detector/";
+        for (string map : {"GradX", "GradY", "Magnitude", "EdgeMap"}) {
+            checker.check("sobel " + map, dir + name + ".raw", 481, 321, 3, dir + name + "_" + map + ".raw", 1,
+                          [&](const uint8_t* in, uint8_t* out) {
+                SobelMaps maps = applySobelFused(ImageView<const unsigned char>::interleaved(in, 481, 321, 3), {15});
+                const ScratchBuffer<unsigned char>& result = map == "GradX" ? maps.gradX
+                                                          : map == "GradY" ? maps.gradY
+                                                          : map == "Magnitude" ? maps.magnitude
+                                                          : maps.edgeMaps[0];
+                copy(result.begin(), result.end(), out);
+            });
+        }
+    }
+#ifdef HAVE_OPENCV
+    // The committed Canny maps are JPEGs, so the engine is held to cv::Canny
+    // on the sample images instead.
+    for (string name : {"Bird", "Deer"}) {
+        try {
+            MappedFile input = mapRawImage(root + "/edge-detection/structured-edge/" + name + ".raw", 481, 321, 3);
+            cv::Mat rgb(321, 481, CV_8UC3, input.data()), gray, edges;
+            cv::cvtColor(rgb, gray, cv::COLOR_RGB2GRAY);
+            CannyCandidates candidates = cannyCandidates(gray.data, 481, 321, gray.step);
+            vector<vector<uint8_t>> maps = cannyHysteresis(candidates, {{60.0, 180.0}});
+            cv::Canny(gray, edges, 60.0, 180.0);
+            checker.compare("canny " + name, "cv::Canny(60, 180)", maps[0].data(), edges.data, maps[0].size());
+        } catch (const exception& e) {
+            checker.skip("canny " + name, e.what());
+        }
+    }
+#endif
+    return checker.failures;
+}
+
+vector<string> splitList(const string& text) {
+    vector<string> items;
+    stringstream stream(text);
+    string item;
+    while (getline(stream, item, ',')) {
+        if (!item.empty()) items.push_back(item);
+    }
+    return items;
+}
+
+int main(int argc, char* argv[]) {
+    int maxThreads = max(1u, thread::hardware_concurrency());
+    vector<double> sizes = {0.25, 1, 4, 16, 64};
+    vector<int> threadCounts;
+    for (int t = 1; t < maxThreads; t *= 2) threadCounts.push_back(t);
+    threadCounts.push_back(maxThreads);
+    int runs = 5;
+    vector<string> only;
+    string sourceDir = SOURCE_DIR;
+    string csvPath;
+    string seModel;
+    bool goldens = true, timings = true;
+
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        auto value = [&]() -> string {
+            if (i + 1 >= argc) throw invalid_argument(arg + " needs a value");
+            return argv[++i];
+        };
+        try {
+            if (arg == "--sizes") {
+                sizes.clear();
+                for (const string& s : splitList(value())) sizes.push_back(stod(s));
+            } else if (arg == "--threads") {
+                threadCounts.clear();
+                for (const string& s : splitList(value())) threadCounts.push_back(max(1, stoi(s)));
+            } else if (arg == "--runs") {
+                runs = max(1, stoi(value()));
+            } else if (arg == "--only") {
+                only = splitList(value());
+            } else if (arg == "--source") {
+                sourceDir = value();
+            } else if (arg == "--csv") {
+                csvPath = value();
+            } else if (arg == "--se-model") {
+                seModel = value();
+            } else if (arg == "--goldens-only") {
+                timings = false;
+            } else if (arg == "--no-goldens") {
+                goldens = false;
+            } else {
+                throw invalid_argument("unknown option " + arg);
+            }
+        } catch (const exception& e) {
+            cerr << e.what() << endl;
+            cerr << "usage: kernel-benchmark [--sizes MP,..] [--threads N,..] [--runs N] [--only name,..]"
+                    " [--source dir] [--csv file] [--se-model model.yml.gz] [--goldens-only | --no-goldens]" << endl;
+            return -1;
+        }
+    }
+    if (seModel.empty()) seModel = sourceDir + "/edge-detection/structured-edge/model.yml.gz";
+
+    int failures = goldens ? checkGoldens(sourceDir) : 0;
+    if (!timings) return failures ? -1 : 0;
+
+    vector<Benchmark> benchmarks;
+    for (Benchmark& benchmark : allBenchmarks(seModel)) {
+        if (only.empty() || find(only.begin(), only.end(), benchmark.name) != only.end()) {
+            benchmarks.push_back(move(benchmark));
+        }
+    }
+
+    ofstream csv;
+    if (!csvPath.empty()) {
+        csv.open(csvPath);
+        csv << "algorithm,megapixels,width,height,threads,runs,mean_mpix_s,stddev_mpix_s,min_mpix_s,max_mpix_s\n";
+    }
+    printf("\n%-20s %6s %11s %7s %10s %9s %10s %10s\n", "algorithm", "MP", "size", "threads",
+           "Mpix/s", "stddev", "min", "max");
+    for (double megapixels : sizes) {
+        resizeSharedPool(maxThreads);
+        SyntheticImage image = syntheticImage(megapixels);
+        uint64_t pixels = static_cast<uint64_t>(image.width) * image.height;
+        string size = to_string(image.width) + "x" + to_string(image.height);
+        for (const Benchmark& benchmark : benchmarks) {
+            function<void(int)> body = benchmark.prepare(image);
+            for (int threads : benchmark.threaded ? threadCounts : vector<int>{1}) {
+                resizeSharedPool(threads);
+                Measurement m = measure(runs, pixels, body, threads);
+                printf("%-20s %6.2f %11s %7d %10.2f %9.2f %10.2f %10.2f\n", benchmark.name.c_str(), megapixels,
+                       size.c_str(), threads, m.mean, m.stddev, m.min, m.max);
+                fflush(stdout);
+                if (csv.is_open()) {
+                    csv << benchmark.name << "," << megapixels << "," << image.width << "," << image.height << ","
+                        << threads << "," << runs << "," << m.mean << "," << m.stddev << "," << m.min << ","
+                        << m.max << "\n";
+                }
+            }
+        }
+    }
+    return failures ? -1 : 0;
+}
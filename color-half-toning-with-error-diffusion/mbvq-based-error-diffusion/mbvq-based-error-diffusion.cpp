@@ -1,134 +1,147 @@
 #include <iostream>
 #include <fstream>
 #include <vector>
-#include <cmath>
+#include <cstdint>
 #include <string>
-#include <algorithm>
+#include "mbvq-based-error-diffusion.h"
+#include "../../common/raw-image.h"
+#include "../../common/bit-plane.h"
+#include "../../common/tone-levels.h"
+#include "../../common/instrumentation.h"
 
 using namespace std;
 
-struct ColorFloat {
-    float r, g, b;
-};
-const ColorFloat W = {255, 255, 255};
-const ColorFloat K = {0, 0, 0};
-const ColorFloat C = {0, 255, 255};
-const ColorFloat M = {255, 0, 255};
-const ColorFloat Y = {255, 255, 0};
-const ColorFloat R = {255, 0, 0};
-const ColorFloat G = {0, 255, 0};
-const ColorFloat B = {0, 0, 255};
+// Streaming mode: keeps the current row's pyramid classes and two error rows,
+// writing each row once it is final.
+// mbvq-based-error-diffusion stream <width> <height> [input|-] [output|-]
+int runStream(int argc, char* argv[]) {
+    if (argc < 4) {
+        cerr << "usage: " << argv[0] << " stream <width> <height> [input|-] [output|-]" << endl;
+        return -1;
+    }
+    int width = stoi(argv[2]);
+    int height = stoi(argv[3]);
+    string inputName = argc > 4 ? argv[4] : "-";
+    string outputName = argc > 5 ? argv[5] : "-";
 
-float colorDistSq(const ColorFloat& c1, const ColorFloat& c2) {
-    return pow(c1.r - c2.r, 2) + pow(c1.g - c2.g, 2) + pow(c1.b - c2.b, 2);
-}
+    ifstream inputFile;
+    ofstream outputFile;
+    if (inputName != "-") inputFile.open(inputName, ios::binary);
+    if (outputName != "-") outputFile.open(outputName, ios::binary);
+    istream& in = inputName == "-" ? cin : inputFile;
+    ostream& out = outputName == "-" ? cout : outputFile;
 
-ColorFloat getClosestVertex(const ColorFloat& pixel, const ColorFloat& v1, const ColorFloat& v2, const ColorFloat& v3, const ColorFloat& v4) {
-    ColorFloat vertices[4] = {v1, v2, v3, v4};
-    ColorFloat closest = v1;
-    float minDist = colorDistSq(pixel, v1);
-    
-    for (int i = 1; i < 4; ++i) {
-        float dist = colorDistSq(pixel, vertices[i]);
-        if (dist < minDist) {
-            minDist = dist;
-            closest = vertices[i];
+    STAGE_TIMER("stream", static_cast<uint64_t>(width) * height);
+    int rowSize = width * 3;
+    vector<unsigned char> rowIn(rowSize), rowOut(rowSize);
+    vector<uint8_t> pyramids(2 * width);
+    vector<float> planes(2 * 3 * width);
+    auto ringRow = [&](int y) {
+        float* base = &planes[(y % 2) * 3 * width];
+        return ErrorRow{base, base + width, base + 2 * width};
+    };
+    auto readRow = [&](int y) {
+        if (!in.read(reinterpret_cast<char*>(rowIn.data()), rowSize)) {
+            cerr << "input ended before row " << y << endl;
+            return false;
         }
-    }
-    return closest;
-}
+        loadRow(rowIn.data(), ringRow(y), &pyramids[(y % 2) * width], width);
+        return true;
+    };
 
-ColorFloat getMBVQVertex(const ColorFloat& origPixel, const ColorFloat& errPixel) {
-    float r = origPixel.r;
-    float g = origPixel.g;
-    float b = origPixel.b;
-    if ((r + g) > 255) {
-        if ((g + b) > 255) {
-            if ((r + g + b) > 510) {
-                return getClosestVertex(errPixel, C, M, Y, W);
-            } else {
-                return getClosestVertex(errPixel, M, Y, G, C);
-            }
-        } else {
-            return getClosestVertex(errPixel, R, G, M, Y);
-        }
-    } else {
-        if (!((g + b) > 255)) {
-            if ((r + g + b) <= 255) {
-                return getClosestVertex(errPixel, K, R, G, B);
-            } else {
-                return getClosestVertex(errPixel, R, G, B, M);
-            }
-        } else {
-            return getClosestVertex(errPixel, C, M, G, B);
+    if (height > 0 && !readRow(0)) return -1;
+    for (int y = 0; y < height; ++y) {
+        if (y + 1 < height && !readRow(y + 1)) return -1;
+        ErrorRow next = y + 1 < height ? ringRow(y + 1) : ErrorRow{nullptr, nullptr, nullptr};
+        diffuseRow(&pyramids[(y % 2) * width], ringRow(y), next, width);
+        rowToRgb(ringRow(y), rowOut.data(), width);
+        if (!out.write(reinterpret_cast<const char*>(rowOut.data()), rowSize)) {
+            cerr << "failed to write row " << y << endl;
+            return -1;
         }
     }
+    out.flush();
+    return 0;
 }
 
-int main() {
+int main(int argc, char* argv[]) {
+    INSTRUMENT_RUN("mbvq-based-error-diffusion");
+    if (argc > 1 && string(argv[1]) == "stream") {
+        return runStream(argc, argv);
+    }
+
     const int width = 1280;
     const int height = 853;
     const int channels = 3;
-    const int imageSize = width * height * channels;
 
+    // "fixed" selects the fixed-point path and "banded" the band-parallel
+    // one; "pbm" writes the C, M and Y bitplanes as a three-image PBM.
+    // "seams" prints the banded mode's seam sweep instead. "L<N>" quantizes
+    // to N levels per channel (see tone-levels.h), written as RGB tones, or
+    // with "packed" as the headerless packed C, M and Y planes; the
+    // fixed-point path is binary only.
+    string variant;
+    bool pbm = false, seams = false, packed = false;
+    int levelCount = 0;
     string inputFilename = "Flowers.raw";
-    string outputFilename = "Flowers_MBVQ.raw";
 
-    vector<unsigned char> rgbImage(imageSize);
-    ifstream inputFile(inputFilename, ios::binary);
-    inputFile.read(reinterpret_cast<char*>(rgbImage.data()), imageSize);
-    inputFile.close();
-    vector<ColorFloat> origImage(width * height);
-    vector<ColorFloat> errImage(width * height);
-    
-    for (int i = 0; i < width * height; ++i) {
-        float r = static_cast<float>(rgbImage[i * 3]);
-        float g = static_cast<float>(rgbImage[i * 3 + 1]);
-        float b = static_cast<float>(rgbImage[i * 3 + 2]);
-        origImage[i] = {r, g, b};
-        errImage[i] = {r, g, b};
-    }
-
-    for (int y = 0; y < height; ++y) {
-        for (int x = 0; x < width; ++x) {
-            int idx = y * width + x;
-            ColorFloat origPixel = origImage[idx];
-            ColorFloat currentPixel = errImage[idx];
-            ColorFloat newPixel = getMBVQVertex(origPixel, currentPixel);
-            
-            errImage[idx] = newPixel;
-
-            ColorFloat error = {
-                currentPixel.r - newPixel.r,
-                currentPixel.g - newPixel.g,
-                currentPixel.b - newPixel.b
-            };
-            auto diffuseError = [&](int dx, int dy, float weight) {
-                int nx = x + dx;
-                int ny = y + dy;
-                if (nx >= 0 && nx < width && ny < height) {
-                    int nIdx = ny * width + nx;
-                    errImage[nIdx].r += error.r * weight;
-                    errImage[nIdx].g += error.g * weight;
-                    errImage[nIdx].b += error.b * weight;
-                }
-            };
+    try {
+        for (int i = 1; i < argc; ++i) {
+            string arg = argv[i];
+            if (arg == "fixed" || arg == "banded") variant = arg;
+            if (levelsArg(arg)) levelCount = levelsArg(arg);
+            pbm = pbm || arg == "pbm";
+            seams = seams || arg == "seams";
+            packed = packed || arg == "packed";
+        }
+        if (levelCount && variant == "fixed") throw invalid_argument("the fixed path has no multi-level mode");
+        string outputFilename = "Flowers_MBVQ" + (variant.empty() ? "" : "_" + variant);
+        if (levelCount) outputFilename += "_L" + to_string(levelCount) + (packed ? "_packed.raw" : ".raw");
+        else outputFilename += pbm ? ".pbm" : ".raw";
 
-            diffuseError(1, 0, 7.0f / 16.0f);
-            diffuseError(-1, 1, 3.0f / 16.0f);
-            diffuseError(0, 1, 5.0f / 16.0f);
-            diffuseError(1, 1, 1.0f / 16.0f);
+        MappedFile rgbImage;
+        {
+            STAGE_TIMER("read", width * height);
+            rgbImage = mapRawImage(inputFilename, width, height, channels);
         }
+        ImageView<const unsigned char> rgbView =
+            ImageView<const unsigned char>::interleaved(rgbImage.data(), width, height, channels);
+        if (seams) {
+            printSeamSweep("MBVQ", width, height, channels,
+                           [&](uint8_t* output) { mbvqErrorDiffusion(rgbView, output); },
+                           [&](uint8_t* output, int bandHeight, int primingRows) {
+                               mbvqErrorDiffusionBanded(rgbView, output, bandHeight, primingRows);
+                           });
+            return 0;
+        }
+        auto diffuse = [&](const auto& planes) {
+            STAGE_TIMER("diffuse", width * height);
+            if (variant == "fixed") mbvqErrorDiffusionFixed(rgbView, planes);
+            else if (variant == "banded") mbvqErrorDiffusionBanded(rgbView, planes);
+            else mbvqErrorDiffusion(rgbView, planes);
+        };
+        ToneLevels levels = makeToneLevels(levelCount ? levelCount : 2);
+        auto diffuseLevels = [&](const array<LevelPlane, 3>& planes) {
+            STAGE_TIMER("diffuse", width * height);
+            if (variant == "banded") mbvqErrorDiffusionBanded(rgbView, planes);
+            else mbvqErrorDiffusion(rgbView, planes);
+        };
+        if (levelCount && packed) {
+            MappedFile output = createPackedLevelImage(outputFilename, width, height, levels, channels);
+            diffuseLevels(packedLevelPlanes(output.data(), width, height, levels));
+        } else if (levelCount) {
+            MappedFile output = createRawImage(outputFilename, width, height, channels);
+            diffuseLevels(interleavedLevelPlanes(output.data(), width, levels));
+        } else if (pbm) {
+            MappedFile output = createPbmImage(outputFilename, width, height, channels);
+            diffuse(pbmPlanes(output.data(), width, height));
+        } else {
+            MappedFile output = createRawImage(outputFilename, width, height, channels);
+            diffuse(interleavedPlanes(output.data(), width));
+        }
+    } catch (const exception& e) {
+        cerr << e.what() << endl;
+        return -1;
     }
-    vector<unsigned char> outputImage(imageSize);
-    for (int i = 0; i < width * height; ++i) {
-        outputImage[i * 3] = static_cast<unsigned char>(clamp(errImage[i].r, 0.0f, 255.0f));
-        outputImage[i * 3 + 1] = static_cast<unsigned char>(clamp(errImage[i].g, 0.0f, 255.0f));
-        outputImage[i * 3 + 2] = static_cast<unsigned char>(clamp(errImage[i].b, 0.0f, 255.0f));
-    }
-
-    ofstream outputFile(outputFilename, ios::binary);
-    outputFile.write(reinterpret_cast<const char*>(outputImage.data()), imageSize);
-    outputFile.close();
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,389 @@
+#ifndef MBVQ_BASED_ERROR_DIFFUSION_H
+#define MBVQ_BASED_ERROR_DIFFUSION_H
+
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+#include <cstddef>
+#include <array>
+#include "../../common/raw-image.h"
+#include "../../common/bit-plane.h"
+#include "../../common/tone-levels.h"
+#include "../../common/banded-diffusion.h"
+#include "../../common/buffer-pool.h"
+
+using namespace std;
+
+struct ColorFloat {
+    float r, g, b;
+};
+const ColorFloat W = {255, 255, 255};
+const ColorFloat K = {0, 0, 0};
+const ColorFloat C = {0, 255, 255};
+const ColorFloat M = {255, 0, 255};
+const ColorFloat Y = {255, 255, 0};
+const ColorFloat R = {255, 0, 0};
+const ColorFloat G = {0, 255, 0};
+const ColorFloat B = {0, 0, 255};
+
+// The six MBVQ pyramids, indexed by classifyPyramid(). Vertex order matters:
+// on equal distances the first vertex wins. The low bit is only set when
+// r+g and g+b fall on the same side of 255, so slots 3 and 5 are unreachable
+// and only pad the table.
+const ColorFloat PYRAMIDS[8][4] = {
+    {R, G, B, M},   // 000: r+g <= 255, g+b <= 255, r+g+b > 255
+    {K, R, G, B},   // 001: r+g <= 255, g+b <= 255, r+g+b <= 255
+    {C, M, G, B},   // 010: r+g <= 255, g+b > 255
+    {C, M, G, B},   // 011: unreachable, padding
+    {R, G, M, Y},   // 100: r+g > 255, g+b <= 255
+    {R, G, M, Y},   // 101: unreachable, padding
+    {M, Y, G, C},   // 110: r+g > 255, g+b > 255, r+g+b <= 510
+    {C, M, Y, W}    // 111: r+g > 255, g+b > 255, r+g+b > 510
+};
+
+// Branch-free form of the MBVQ decision tree on the original pixel.
+inline int classifyPyramid(int r, int g, int b) {
+    int rg = (r + g) > 255;
+    int gb = (g + b) > 255;
+    int sum = r + g + b;
+    int low = (rg & gb & (sum > 510)) | (!rg & !gb & (sum <= 255));
+    return (rg << 2) | (gb << 1) | low;
+}
+
+// Squares are taken in double on the float differences, which is exactly
+// what pow(x, 2) produced, so vertex choices (and ties) are unchanged.
+inline float colorDistSq(float r, float g, float b, const ColorFloat& v) {
+    double dr = r - v.r;
+    double dg = g - v.g;
+    double db = b - v.b;
+    return dr * dr + dg * dg + db * db;
+}
+
+inline const ColorFloat& closestVertex(float r, float g, float b, const ColorFloat* vertices) {
+    int closest = 0;
+    float minDist = colorDistSq(r, g, b, vertices[0]);
+    for (int i = 1; i < 4; ++i) {
+        float dist = colorDistSq(r, g, b, vertices[i]);
+        if (dist < minDist) {
+            minDist = dist;
+            closest = i;
+        }
+    }
+    return vertices[closest];
+}
+
+// One row of the error image, stored as separate channel planes. The load
+// functions take strides so the input may be packed RGB or planar.
+struct ErrorRow {
+    float* r;
+    float* g;
+    float* b;
+};
+
+inline void loadRow(const unsigned char* rgbRow, ErrorRow row, uint8_t* pyramid, int width,
+                    ptrdiff_t pixelStride = 3, ptrdiff_t channelStride = 1) {
+    for (int x = 0; x < width; ++x) {
+        const unsigned char* pixel = rgbRow + x * pixelStride;
+        int r = pixel[0];
+        int g = pixel[channelStride];
+        int b = pixel[2 * channelStride];
+        row.r[x] = static_cast<float>(r);
+        row.g[x] = static_cast<float>(g);
+        row.b[x] = static_cast<float>(b);
+        pyramid[x] = classifyPyramid(r, g, b);
+    }
+}
+
+// Diffuses one row, replacing each pixel by vertexAt(x, r, g, b); next is the
+// row below, with next.r == nullptr on the last row.
+template <typename VertexAt>
+inline void diffuseRowWith(ErrorRow current, ErrorRow next, int width, VertexAt vertexAt) {
+    const float right = 7.0f / 16.0f;
+    const float downLeft = 3.0f / 16.0f;
+    const float down = 5.0f / 16.0f;
+    const float downRight = 1.0f / 16.0f;
+    bool hasNext = next.r != nullptr;
+
+    for (int x = 0; x < width; ++x) {
+        float r = current.r[x];
+        float g = current.g[x];
+        float b = current.b[x];
+        ColorFloat vertex = vertexAt(x, r, g, b);
+        current.r[x] = vertex.r;
+        current.g[x] = vertex.g;
+        current.b[x] = vertex.b;
+
+        float errR = r - vertex.r;
+        float errG = g - vertex.g;
+        float errB = b - vertex.b;
+        if (x + 1 < width) {
+            current.r[x + 1] += errR * right;
+            current.g[x + 1] += errG * right;
+            current.b[x + 1] += errB * right;
+        }
+        if (hasNext) {
+            if (x > 0) {
+                next.r[x - 1] += errR * downLeft;
+                next.g[x - 1] += errG * downLeft;
+                next.b[x - 1] += errB * downLeft;
+            }
+            next.r[x] += errR * down;
+            next.g[x] += errG * down;
+            next.b[x] += errB * down;
+            if (x + 1 < width) {
+                next.r[x + 1] += errR * downRight;
+                next.g[x + 1] += errG * downRight;
+                next.b[x + 1] += errB * downRight;
+            }
+        }
+    }
+}
+
+// pyramid holds the classes of the original pixels.
+inline void diffuseRow(const uint8_t* pyramid, ErrorRow current, ErrorRow next, int width) {
+    diffuseRowWith(current, next, width, [&](int x, float r, float g, float b) {
+        return closestVertex(r, g, b, PYRAMIDS[pyramid[x]]);
+    });
+}
+
+// N-level mode (see tone-levels.h): the levels split the RGB cube into
+// (N - 1)^3 cells, and MBVQ runs within the cell holding the original pixel,
+// scaled to 0..255: the pyramid is classified from the pixel's position in
+// the cell and the error-modified pixel is mapped into the cell to choose a
+// vertex. With two levels the cell is the cube and nothing changes. cells
+// holds three cell indices per pixel and pyramid the classes.
+inline void loadCells(const unsigned char* rgbRow, uint8_t* cells, uint8_t* pyramid, int width,
+                      const ToneLevels& levels, ptrdiff_t pixelStride = 3, ptrdiff_t channelStride = 1) {
+    for (int x = 0; x < width; ++x) {
+        const unsigned char* pixel = rgbRow + x * pixelStride;
+        int r = pixel[0];
+        int g = pixel[channelStride];
+        int b = pixel[2 * channelStride];
+        cells[3 * x] = levels.cell[r];
+        cells[3 * x + 1] = levels.cell[g];
+        cells[3 * x + 2] = levels.cell[b];
+        pyramid[x] = classifyPyramid(levels.position[r], levels.position[g], levels.position[b]);
+    }
+}
+
+inline void diffuseRowLevels(const uint8_t* pyramid, const uint8_t* cells, ErrorRow current, ErrorRow next,
+                             int width, const ToneLevels& levels) {
+    diffuseRowWith(current, next, width, [&](int x, float r, float g, float b) {
+        const uint8_t* cell = &cells[3 * x];
+        float low[3], scale[3], unit[3];
+        for (int c = 0; c < 3; ++c) {
+            low[c] = levels.tone[cell[c]];
+            scale[c] = levels.cellScale[cell[c]];
+            unit[c] = levels.cellUnit[cell[c]];
+        }
+        const ColorFloat& v = closestVertex((r - low[0]) * scale[0], (g - low[1]) * scale[1], (b - low[2]) * scale[2],
+                                            PYRAMIDS[pyramid[x]]);
+        // Vertex channels are 0 or 255, which map back to exact tones.
+        return ColorFloat{low[0] + v.r * unit[0], low[1] + v.g * unit[1], low[2] + v.b * unit[2]};
+    });
+}
+
+// After diffusion every value is a vertex channel, a level's tone. Output
+// goes to row y of the R, G and B planes (see bit-plane.h and tone-levels.h)
+// or to a packed RGB row.
+template <typename Plane>
+void rowToRgb(ErrorRow row, const array<Plane, 3>& out, int y, int width) {
+    for (int x = 0; x < width; ++x) {
+        setTone(out[0], x, y, row.r[x]);
+        setTone(out[1], x, y, row.g[x]);
+        setTone(out[2], x, y, row.b[x]);
+    }
+}
+
+inline void rowToRgb(ErrorRow row, unsigned char* out, int width) {
+    rowToRgb(row, interleavedPlanes(out, width), 0, width);
+}
+
+// Fixed-point mode: error planes are int16 in 1/16 units and vertex distances
+// are exact int32 sums. The FS shares are rounding shifts by 4, with the 1/16
+// share taking the remainder so each pixel passes on exactly its error.
+const int MBVQ_FIXED_SHIFT = 4;
+
+struct FixedErrorRow {
+    int16_t* r;
+    int16_t* g;
+    int16_t* b;
+};
+
+inline void loadRowFixed(const unsigned char* rgbRow, FixedErrorRow row, uint8_t* pyramid, int width,
+                         ptrdiff_t pixelStride = 3, ptrdiff_t channelStride = 1) {
+    for (int x = 0; x < width; ++x) {
+        const unsigned char* pixel = rgbRow + x * pixelStride;
+        int r = pixel[0];
+        int g = pixel[channelStride];
+        int b = pixel[2 * channelStride];
+        row.r[x] = r << MBVQ_FIXED_SHIFT;
+        row.g[x] = g << MBVQ_FIXED_SHIFT;
+        row.b[x] = b << MBVQ_FIXED_SHIFT;
+        pyramid[x] = classifyPyramid(r, g, b);
+    }
+}
+
+inline int fixedDistSq(int r, int g, int b, const ColorFloat& v) {
+    int dr = r - (static_cast<int>(v.r) << MBVQ_FIXED_SHIFT);
+    int dg = g - (static_cast<int>(v.g) << MBVQ_FIXED_SHIFT);
+    int db = b - (static_cast<int>(v.b) << MBVQ_FIXED_SHIFT);
+    return dr * dr + dg * dg + db * db;
+}
+
+template <typename Plane>
+void diffuseRowFixed(const uint8_t* pyramid, FixedErrorRow current, FixedErrorRow next,
+                     const array<Plane, 3>& out, int y, int width) {
+    bool hasNext = next.r != nullptr;
+    int16_t* currentPlanes[3] = {current.r, current.g, current.b};
+    int16_t* nextPlanes[3] = {next.r, next.g, next.b};
+
+    for (int x = 0; x < width; ++x) {
+        int r = current.r[x];
+        int g = current.g[x];
+        int b = current.b[x];
+        const ColorFloat* vertices = PYRAMIDS[pyramid[x]];
+        int closest = 0;
+        int minDist = fixedDistSq(r, g, b, vertices[0]);
+        for (int i = 1; i < 4; ++i) {
+            int dist = fixedDistSq(r, g, b, vertices[i]);
+            if (dist < minDist) {
+                minDist = dist;
+                closest = i;
+            }
+        }
+        const ColorFloat& vertex = vertices[closest];
+        out[0].set(x, y, vertex.r != 0.0f);
+        out[1].set(x, y, vertex.g != 0.0f);
+        out[2].set(x, y, vertex.b != 0.0f);
+
+        int errors[3] = {
+            r - (static_cast<int>(vertex.r) << MBVQ_FIXED_SHIFT),
+            g - (static_cast<int>(vertex.g) << MBVQ_FIXED_SHIFT),
+            b - (static_cast<int>(vertex.b) << MBVQ_FIXED_SHIFT)
+        };
+        for (int c = 0; c < 3; ++c) {
+            int error = errors[c];
+            int right = (error * 7 + 8) >> MBVQ_FIXED_SHIFT;
+            int downLeft = (error * 3 + 8) >> MBVQ_FIXED_SHIFT;
+            int down = (error * 5 + 8) >> MBVQ_FIXED_SHIFT;
+            int downRight = error - right - downLeft - down;
+            if (x + 1 < width) {
+                currentPlanes[c][x + 1] += right;
+            }
+            if (hasNext) {
+                if (x > 0) nextPlanes[c][x - 1] += downLeft;
+                nextPlanes[c][x] += down;
+                if (x + 1 < width) nextPlanes[c][x + 1] += downRight;
+            }
+        }
+    }
+}
+
+inline void diffuseRowFixed(const uint8_t* pyramid, FixedErrorRow current, FixedErrorRow next, unsigned char* out, int width) {
+    diffuseRowFixed(pyramid, current, next, interleavedPlanes(out, width), 0, width);
+}
+
+// Whole-image float path. The input may use any layout; the output goes to
+// the R, G and B planes, or to packed RGB of the same size.
+template <typename Plane>
+void mbvqErrorDiffusion(ImageView<const unsigned char> rgbImage, const array<Plane, 3>& output) {
+    int width = rgbImage.width;
+    int height = rgbImage.height;
+    ScratchBuffer<float> errR(width * height), errG(width * height), errB(width * height);
+    ScratchBuffer<uint8_t> pyramids(width * height);
+    const ToneLevels* levels = planeLevels(output[0]);
+    ScratchBuffer<uint8_t> cells(levels ? 3 * width * height : 0);
+    auto imageRow = [&](int y) {
+        return ErrorRow{&errR[y * width], &errG[y * width], &errB[y * width]};
+    };
+
+    for (int y = 0; y < height; ++y) {
+        loadRow(rgbImage.row(y), imageRow(y), &pyramids[y * width], width, rgbImage.pixelStride, rgbImage.channelStride);
+        if (levels) {
+            loadCells(rgbImage.row(y), &cells[3 * y * width], &pyramids[y * width], width, *levels,
+                      rgbImage.pixelStride, rgbImage.channelStride);
+        }
+    }
+
+    for (int y = 0; y < height; ++y) {
+        ErrorRow next = y + 1 < height ? imageRow(y + 1) : ErrorRow{nullptr, nullptr, nullptr};
+        if (levels) diffuseRowLevels(&pyramids[y * width], &cells[3 * y * width], imageRow(y), next, width, *levels);
+        else diffuseRow(&pyramids[y * width], imageRow(y), next, width);
+    }
+    for (int y = 0; y < height; ++y) {
+        rowToRgb(imageRow(y), output, y, width);
+    }
+}
+
+inline void mbvqErrorDiffusion(ImageView<const unsigned char> rgbImage, unsigned char* outputImage) {
+    mbvqErrorDiffusion(rgbImage, interleavedPlanes(outputImage, rgbImage.width));
+}
+
+// Band-parallel mode (see banded-diffusion.h); not bit-identical to the
+// serial scan. Each band keeps two error rows, as the streaming mode does.
+template <typename Plane>
+void mbvqErrorDiffusionBanded(ImageView<const unsigned char> rgbImage, const array<Plane, 3>& output,
+                              int bandHeight = DEFAULT_BAND_HEIGHT, int primingRows = DEFAULT_PRIMING_ROWS) {
+    int width = rgbImage.width;
+    const ToneLevels* levels = planeLevels(output[0]);
+    forEachBand(rgbImage.height, bandHeight, primingRows, [&](const Band& band) {
+        vector<uint8_t> pyramids(2 * width);
+        vector<uint8_t> cells(levels ? 2 * 3 * width : 0);
+        vector<float> planes(2 * 3 * width);
+        auto ringRow = [&](int y) {
+            float* base = &planes[(y % 2) * 3 * width];
+            return ErrorRow{base, base + width, base + 2 * width};
+        };
+        auto load = [&](int y) {
+            loadRow(rgbImage.row(y), ringRow(y), &pyramids[(y % 2) * width], width,
+                    rgbImage.pixelStride, rgbImage.channelStride);
+            if (levels) {
+                loadCells(rgbImage.row(y), &cells[(y % 2) * 3 * width], &pyramids[(y % 2) * width], width, *levels,
+                          rgbImage.pixelStride, rgbImage.channelStride);
+            }
+        };
+
+        load(band.start);
+        for (int y = band.start; y < band.y1; ++y) {
+            if (y + 1 < band.y1) load(y + 1);
+            ErrorRow next = y + 1 < band.y1 ? ringRow(y + 1) : ErrorRow{nullptr, nullptr, nullptr};
+            const uint8_t* pyramid = &pyramids[(y % 2) * width];
+            if (levels) diffuseRowLevels(pyramid, &cells[(y % 2) * 3 * width], ringRow(y), next, width, *levels);
+            else diffuseRow(pyramid, ringRow(y), next, width);
+            if (y >= band.y0) rowToRgb(ringRow(y), output, y, width);
+        }
+    });
+}
+
+inline void mbvqErrorDiffusionBanded(ImageView<const unsigned char> rgbImage, unsigned char* outputImage,
+                                     int bandHeight = DEFAULT_BAND_HEIGHT, int primingRows = DEFAULT_PRIMING_ROWS) {
+    mbvqErrorDiffusionBanded(rgbImage, interleavedPlanes(outputImage, rgbImage.width), bandHeight, primingRows);
+}
+
+template <typename Plane>
+void mbvqErrorDiffusionFixed(ImageView<const unsigned char> rgbImage, const array<Plane, 3>& output) {
+    int width = rgbImage.width;
+    int height = rgbImage.height;
+    ScratchBuffer<int16_t> planes(3 * width * height);
+    ScratchBuffer<uint8_t> pyramids(width * height);
+    auto fixedRow = [&](int y) {
+        int16_t* base = &planes[3 * y * width];
+        return FixedErrorRow{base, base + width, base + 2 * width};
+    };
+    for (int y = 0; y < height; ++y) {
+        loadRowFixed(rgbImage.row(y), fixedRow(y), &pyramids[y * width], width,
+                     rgbImage.pixelStride, rgbImage.channelStride);
+    }
+    for (int y = 0; y < height; ++y) {
+        FixedErrorRow next = y + 1 < height ? fixedRow(y + 1) : FixedErrorRow{nullptr, nullptr, nullptr};
+        diffuseRowFixed(&pyramids[y * width], fixedRow(y), next, output, y, width);
+    }
+}
+
+inline void mbvqErrorDiffusionFixed(ImageView<const unsigned char> rgbImage, unsigned char* outputImage) {
+    mbvqErrorDiffusionFixed(rgbImage, interleavedPlanes(outputImage, rgbImage.width));
+}
+
+#endif
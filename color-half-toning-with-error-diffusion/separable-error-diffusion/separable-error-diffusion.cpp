@@ -1,62 +1,152 @@
 #include <iostream>
 #include <fstream>
 #include <vector>
+#include <string>
+#include <cstdint>
+#include "separable-error-diffusion.h"
+#include "../../common/raw-image.h"
+#include "../../common/bit-plane.h"
+#include "../../common/tone-levels.h"
+#include "../../common/instrumentation.h"
 
 using namespace std;
 
-int main() {
-    const int width = 1280;
-    const int height = 853;
-    const int channels = 3;
-    const int imageSize = width * height * channels;
-    const char* inputFilename = "Flowers.raw";
-    const char* outputFilename = "Flowers_halftone.raw";
-
-    vector<unsigned char> rgbImage(imageSize);
-    ifstream inputFile(inputFilename, ios::binary);
-    inputFile.read(reinterpret_cast<char*>(rgbImage.data()), imageSize);
-    inputFile.close();
-    vector<float> cmyImage(imageSize);
-    for (int i = 0; i < imageSize; ++i) {
-        cmyImage[i] = 255.0f - static_cast<float>(rgbImage[i]);
+// Streaming mode: keeps two CMY float rows (or, fused, two int16 error rows)
+// and writes each row once it is final.
+// separable-error-diffusion <stream|stream-fused> <width> <height> [input|-] [output|-]
+int runStream(int argc, char* argv[], bool fused) {
+    if (argc < 4) {
+        cerr << "usage: " << argv[0] << " <stream|stream-fused> <width> <height> [input|-] [output|-]" << endl;
+        return -1;
     }
+    int width = stoi(argv[2]);
+    int height = stoi(argv[3]);
+    string inputName = argc > 4 ? argv[4] : "-";
+    string outputName = argc > 5 ? argv[5] : "-";
 
-    for (int y = 0; y < height; ++y) {
-        for (int x = 0; x < width; ++x) {
-            for (int c = 0; c < channels; ++c) {
-                int index = (y * width + x) * channels + c;
-                float oldVal = cmyImage[index];
-                float newVal = (oldVal >= 128.0f) ? 255.0f : 0.0f;
-                cmyImage[index] = newVal;
-                
-                float error = oldVal - newVal;
-                if (x + 1 < width) {
-                    cmyImage[(y * width + (x + 1)) * channels + c] += error * (7.0f / 16.0f);
-                }
-                if (x - 1 >= 0 && y + 1 < height) {
-                    cmyImage[((y + 1) * width + (x - 1)) * channels + c] += error * (3.0f / 16.0f);
-                }
-                if (y + 1 < height) {
-                    cmyImage[((y + 1) * width + x) * channels + c] += error * (5.0f / 16.0f);
-                }
-                if (x + 1 < width && y + 1 < height) {
-                    cmyImage[((y + 1) * width + (x + 1)) * channels + c] += error * (1.0f / 16.0f);
-                }
+    ifstream inputFile;
+    ofstream outputFile;
+    if (inputName != "-") inputFile.open(inputName, ios::binary);
+    if (outputName != "-") outputFile.open(outputName, ios::binary);
+    istream& in = inputName == "-" ? cin : inputFile;
+    ostream& out = outputName == "-" ? cout : outputFile;
+
+    STAGE_TIMER("stream", static_cast<uint64_t>(width) * height);
+    int rowSize = width * CMY_CHANNELS;
+    vector<unsigned char> rowIn(rowSize), rowOut(rowSize);
+    if (fused) {
+        vector<ErrorLanes> errRows(2 * width, ErrorLanes{0, 0, 0, 0});
+        for (int y = 0; y < height; ++y) {
+            if (!in.read(reinterpret_cast<char*>(rowIn.data()), rowSize)) {
+                cerr << "input ended before row " << y << endl;
+                return -1;
+            }
+            ErrorLanes* next = y + 1 < height ? &errRows[((y + 1) % 2) * width] : nullptr;
+            fusedRow(rowIn.data(), rowOut.data(), &errRows[(y % 2) * width], next, width);
+            if (!out.write(reinterpret_cast<const char*>(rowOut.data()), rowSize)) {
+                cerr << "failed to write row " << y << endl;
+                return -1;
             }
         }
+        out.flush();
+        return 0;
     }
 
-    vector<unsigned char> outputRgbImage(imageSize);
-    for (int i = 0; i < imageSize; ++i) {
-        float rgbVal = 255.0f - cmyImage[i];
-        if (rgbVal > 255.0f) rgbVal = 255.0f;
-        if (rgbVal < 0.0f) rgbVal = 0.0f;
-        
-        outputRgbImage[i] = static_cast<unsigned char>(rgbVal);
+    vector<float> ring(2 * rowSize);
+    auto loadRow = [&](int y) {
+        if (!in.read(reinterpret_cast<char*>(rowIn.data()), rowSize)) {
+            cerr << "input ended before row " << y << endl;
+            return false;
+        }
+        float* dst = &ring[(y % 2) * rowSize];
+        for (int i = 0; i < rowSize; ++i) {
+            dst[i] = 255.0f - static_cast<float>(rowIn[i]);
+        }
+        return true;
+    };
+
+    if (height > 0 && !loadRow(0)) return -1;
+    for (int y = 0; y < height; ++y) {
+        if (y + 1 < height && !loadRow(y + 1)) return -1;
+        float* current = &ring[(y % 2) * rowSize];
+        float* next = y + 1 < height ? &ring[((y + 1) % 2) * rowSize] : nullptr;
+        diffuseRow(current, next, width);
+        for (int i = 0; i < rowSize; ++i) {
+            rowOut[i] = cmyToRgb(current[i]);
+        }
+        if (!out.write(reinterpret_cast<const char*>(rowOut.data()), rowSize)) {
+            cerr << "failed to write row " << y << endl;
+            return -1;
+        }
     }
+    out.flush();
+    return 0;
+}
 
-    ofstream outputFile(outputFilename, ios::binary);
-    outputFile.write(reinterpret_cast<const char*>(outputRgbImage.data()), imageSize);
-    outputFile.close();
+int main(int argc, char* argv[]) {
+    INSTRUMENT_RUN("separable-error-diffusion");
+    string mode = argc > 1 ? argv[1] : "";
+    if (mode == "stream" || mode == "stream-fused") {
+        return runStream(argc, argv, mode == "stream-fused");
+    }
+
+    const int width = 1280;
+    const int height = 853;
+    const char* inputFilename = "Flowers.raw";
+
+    // "fused" (or "fixed", the same fixed-point pipeline) selects the fused
+    // path; "pbm" writes the C, M and Y bitplanes as a three-image PBM.
+    // "L<N>" quantizes each channel to N levels (see tone-levels.h), written
+    // as RGB tones, or with "packed" as the headerless packed C, M and Y
+    // planes; the fused path is binary only.
+    string variant;
+    bool pbm = false, packed = false;
+    int levelCount = 0;
+    try {
+        for (int i = 1; i < argc; ++i) {
+            string arg = argv[i];
+            if (arg == "fused" || arg == "fixed") variant = arg;
+            if (levelsArg(arg)) levelCount = levelsArg(arg);
+            pbm = pbm || arg == "pbm";
+            packed = packed || arg == "packed";
+        }
+        if (levelCount && !variant.empty()) throw invalid_argument("the " + variant + " path has no multi-level mode");
+        string outputFilename = "Flowers_halftone" + (variant.empty() ? "" : "_" + variant);
+        if (levelCount) outputFilename += "_L" + to_string(levelCount) + (packed ? "_packed.raw" : ".raw");
+        else outputFilename += pbm ? ".pbm" : ".raw";
+
+        MappedFile rgbImage;
+        {
+            STAGE_TIMER("read", width * height);
+            rgbImage = mapRawImage(inputFilename, width, height, CMY_CHANNELS);
+        }
+        ImageView<const unsigned char> rgbView =
+            ImageView<const unsigned char>::interleaved(rgbImage.data(), width, height, CMY_CHANNELS);
+        auto diffuse = [&](const auto& planes) {
+            STAGE_TIMER("diffuse", width * height);
+            if (variant.empty()) separableErrorDiffusion(rgbView, planes);
+            else separableErrorDiffusionFused(rgbView, planes);
+        };
+        ToneLevels levels = makeToneLevels(levelCount ? levelCount : 2);
+        if (levelCount) {
+            STAGE_TIMER("diffuse", width * height);
+            if (packed) {
+                MappedFile output = createPackedLevelImage(outputFilename, width, height, levels, CMY_CHANNELS);
+                separableErrorDiffusion(rgbView, packedLevelPlanes(output.data(), width, height, levels));
+            } else {
+                MappedFile output = createRawImage(outputFilename, width, height, CMY_CHANNELS);
+                separableErrorDiffusion(rgbView, interleavedLevelPlanes(output.data(), width, levels));
+            }
+        } else if (pbm) {
+            MappedFile output = createPbmImage(outputFilename, width, height, CMY_CHANNELS);
+            diffuse(pbmPlanes(output.data(), width, height));
+        } else {
+            MappedFile output = createRawImage(outputFilename, width, height, CMY_CHANNELS);
+            diffuse(interleavedPlanes(output.data(), width));
+        }
+    } catch (const exception& e) {
+        cerr << e.what() << endl;
+        return -1;
+    }
     return 0;
 }
\ No newline at end of file
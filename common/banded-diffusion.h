@@ -0,0 +1,148 @@
+#ifndef BANDED_DIFFUSION_H
+#define BANDED_DIFFUSION_H
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <string>
+#include <vector>
+#include "tile-scheduler.h"
+
+// Band-parallel error diffusion for rasters too large for one core, where the
+// result need not match the serial scan bit for bit. The image is cut into
+// horizontal bands that are diffused independently on the shared pool. A band
+// never receives the error its predecessor would have pushed across the seam,
+// so it first diffuses the primingRows rows above it, discarding their output,
+// to build up an error state like the serial scan's. Without priming every
+// band starts from zero error and light or dark areas print late, which shows
+// as a line along the seam.
+
+const int DEFAULT_BAND_HEIGHT = 256;
+const int DEFAULT_PRIMING_ROWS = 32;
+
+// Band rows [y0, y1) are output; diffusion starts at row start <= y0.
+struct Band {
+    int y0, y1, start;
+};
+
+inline void forEachBand(int height, int bandHeight, int primingRows, const std::function<void(const Band&)>& fn,
+                        WorkStealingPool& pool = sharedPool()) {
+    bandHeight = std::max(1, bandHeight);
+    int numBands = (height + bandHeight - 1) / bandHeight;
+    pool.run(numBands, [&](int b) {
+        Band band;
+        band.y0 = b * bandHeight;
+        band.y1 = std::min(height, band.y0 + bandHeight);
+        band.start = std::max(0, band.y0 - std::max(0, primingRows));
+        fn(band);
+    });
+}
+
+// How far a banded halftone strays from the serial one near the seams. Two
+// halftones from different error states differ pixel by pixel even where they
+// look alike, so both are compared as tone: the local mean over a window of
+// (2 * TONE_RADIUS + 1)^2 pixels, in levels of 0..255. The mean absolute tone
+// difference is taken over the seam rows (the first SEAM_ROWS rows of a band)
+// and, as the baseline, over the other rows; the first band equals the serial
+// result and is left out of both. A seam that is no worse than the interior
+// gives a ratio near 1.
+const int TONE_RADIUS = 4;
+const int SEAM_ROWS = 8;
+
+struct SeamQuality {
+    double seamError = 0.0;
+    double interiorError = 0.0;
+    double changedPixels = 0.0;  // fraction of samples that differ at all
+
+    double ratio() const { return interiorError > 0.0 ? seamError / interiorError : 0.0; }
+};
+
+inline SeamQuality seamQuality(const uint8_t* serial, const uint8_t* banded, int width, int height, int channels,
+                               int bandHeight) {
+    SeamQuality quality;
+    double seamSum = 0.0, interiorSum = 0.0;
+    uint64_t seamCount = 0, interiorCount = 0, changed = 0;
+    // Summed-area table of banded - serial for one channel at a time; tone
+    // is linear, so the window sum of the difference is the tone difference.
+    int tableWidth = width + 1;
+    std::vector<int64_t> table(static_cast<size_t>(tableWidth) * (height + 1), 0);
+    for (int c = 0; c < channels; ++c) {
+        for (int y = 0; y < height; ++y) {
+            int64_t rowSum = 0;
+            for (int x = 0; x < width; ++x) {
+                size_t i = (static_cast<size_t>(y) * width + x) * channels + c;
+                int diff = banded[i] - serial[i];
+                changed += diff != 0;
+                rowSum += diff;
+                table[(y + 1) * static_cast<size_t>(tableWidth) + x + 1] =
+                    table[y * static_cast<size_t>(tableWidth) + x + 1] + rowSum;
+            }
+        }
+        for (int y = std::max(1, bandHeight); y < height; ++y) {
+            int y0 = std::max(0, y - TONE_RADIUS), y1 = std::min(height, y + TONE_RADIUS + 1);
+            bool seam = y % bandHeight < SEAM_ROWS;
+            const int64_t* top = &table[y0 * static_cast<size_t>(tableWidth)];
+            const int64_t* bottom = &table[y1 * static_cast<size_t>(tableWidth)];
+            for (int x = 0; x < width; ++x) {
+                int x0 = std::max(0, x - TONE_RADIUS), x1 = std::min(width, x + TONE_RADIUS + 1);
+                int64_t sum = bottom[x1] - bottom[x0] - top[x1] + top[x0];
+                double tone = std::fabs(static_cast<double>(sum)) / ((y1 - y0) * (x1 - x0));
+                if (seam) {
+                    seamSum += tone;
+                    ++seamCount;
+                } else {
+                    interiorSum += tone;
+                    ++interiorCount;
+                }
+            }
+        }
+    }
+    quality.seamError = seamCount ? seamSum / seamCount : 0.0;
+    quality.interiorError = interiorCount ? interiorSum / interiorCount : 0.0;
+    quality.changedPixels = static_cast<double>(changed) / (static_cast<double>(width) * height * channels);
+    return quality;
+}
+
+// Times the serial and the banded path (best of SWEEP_RUNS) and prints the
+// banded throughput and seam quality for a grid of band heights and priming
+// depths, to choose them for a kind of raster.
+const int SWEEP_RUNS = 3;
+const int SWEEP_BAND_HEIGHTS[] = {32, 64, 128, 256};
+const int SWEEP_PRIMING_ROWS[] = {0, 8, 32};
+
+inline void printSeamSweep(const std::string& name, int width, int height, int channels,
+                           const std::function<void(uint8_t*)>& serial,
+                           const std::function<void(uint8_t*, int bandHeight, int primingRows)>& banded) {
+    size_t size = static_cast<size_t>(width) * height * channels;
+    std::vector<uint8_t> serialOutput(size), bandedOutput(size);
+    auto bestSeconds = [](const std::function<void()>& fn) {
+        double best = 1e30;
+        for (int r = 0; r < SWEEP_RUNS; ++r) {
+            auto start = std::chrono::steady_clock::now();
+            fn();
+            best = std::min(best, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+        }
+        return best;
+    };
+    double mpix = static_cast<double>(width) * height / 1e6;
+    double serialSeconds = bestSeconds([&] { serial(serialOutput.data()); });
+    printf("%s: serial %.1f Mpix/s\n", name.c_str(), mpix / serialSeconds);
+    printf("%6s %8s %9s %8s %9s %9s %7s %8s\n", "band", "priming", "Mpix/s", "speedup", "seam", "interior",
+           "ratio", "changed");
+    for (int bandHeight : SWEEP_BAND_HEIGHTS) {
+        for (int primingRows : SWEEP_PRIMING_ROWS) {
+            double seconds = bestSeconds([&] { banded(bandedOutput.data(), bandHeight, primingRows); });
+            SeamQuality quality = seamQuality(serialOutput.data(), bandedOutput.data(), width, height, channels,
+                                              bandHeight);
+            printf("%6d %8d %9.1f %7.2fx %9.3f %9.3f %7.2f %7.1f%%\n", bandHeight, primingRows, mpix / seconds,
+                   serialSeconds / seconds, quality.seamError, quality.interiorError, quality.ratio(),
+                   100.0 * quality.changedPixels);
+        }
+    }
+}
+
+#endif
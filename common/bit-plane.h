@@ -0,0 +1,114 @@
+#ifndef BIT_PLANE_H
+#define BIT_PLANE_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "raw-image.h"
+
+// Destinations for binary images, whose every pixel is 0 or 255. Kernels that
+// produce them are templated on the plane type and call set(x, y, on), so the
+// same loop fills either a byte image or a 1-bit plane with no packing pass.
+//
+// Bit planes use the raw PBM (P4) layout: rows padded to whole bytes, the
+// leftmost pixel in the most significant bit and 1 = black, i.e. a set bit is
+// a pixel whose byte value would be 0. Colour halftones are stored as three
+// PBM images in one file (a multi-image PBM): the C, M and Y planes, where
+// ink is set wherever the R, G or B channel is 0.
+//
+// Writers in different threads must not share a byte of a bit plane: rows
+// never do, and columns split at multiples of 8 (such as tile edges) do not.
+
+struct BytePlane {
+    uint8_t* data;
+    ptrdiff_t rowStride;
+    ptrdiff_t pixelStride = 1;
+
+    void set(int x, int y, bool on) const { data[y * rowStride + x * pixelStride] = on ? 255 : 0; }
+};
+
+struct BitPlane {
+    uint8_t* data;
+    ptrdiff_t rowStride;
+
+    void set(int x, int y, bool on) const {
+        uint8_t& byte = data[y * rowStride + (x >> 3)];
+        uint8_t mask = 0x80 >> (x & 7);
+        byte = on ? (byte & ~mask) : (byte | mask);
+    }
+
+    // Stores pixels x .. x + 7 (x a multiple of 8) at once; bit k of on is
+    // pixel x + k, as _mm_movemask_epi8 produces it.
+    void setEight(int x, int y, uint8_t on) const {
+        on = ((on & 0xF0) >> 4) | ((on & 0x0F) << 4);
+        on = ((on & 0xCC) >> 2) | ((on & 0x33) << 2);
+        on = ((on & 0xAA) >> 1) | ((on & 0x55) << 1);
+        data[y * rowStride + (x >> 3)] = static_cast<uint8_t>(~on);
+    }
+};
+
+// The same plane starting at row `rows`, for a kernel run on a band of the image.
+template <typename Plane>
+Plane shiftRows(const Plane& plane, int rows) {
+    Plane shifted = plane;
+    shifted.data += rows * plane.rowStride;
+    return shifted;
+}
+
+inline size_t pbmRowBytes(int width) {
+    return (static_cast<size_t>(width) + 7) / 8;
+}
+
+inline std::string pbmHeader(int width, int height) {
+    return "P4\n" + std::to_string(width) + " " + std::to_string(height) + "\n";
+}
+
+// Size of a file holding `planes` consecutive PBM images of width x height.
+inline size_t pbmImageSize(int width, int height, int planes = 1) {
+    return planes * (pbmHeader(width, height).size() + pbmRowBytes(width) * height);
+}
+
+inline void writePbmHeaders(uint8_t* file, int width, int height, int planes) {
+    std::string header = pbmHeader(width, height);
+    size_t planeSize = header.size() + pbmRowBytes(width) * height;
+    for (int p = 0; p < planes; ++p) {
+        memcpy(file + p * planeSize, header.data(), header.size());
+    }
+}
+
+// The bits of image `plane` in a buffer laid out by pbmImageSize().
+inline BitPlane pbmPlane(uint8_t* file, int width, int height, int plane = 0) {
+    std::string header = pbmHeader(width, height);
+    size_t planeSize = header.size() + pbmRowBytes(width) * height;
+    return BitPlane{file + plane * planeSize + header.size(), static_cast<ptrdiff_t>(pbmRowBytes(width))};
+}
+
+inline std::vector<uint8_t> pbmBuffer(int width, int height, int planes = 1) {
+    std::vector<uint8_t> file(pbmImageSize(width, height, planes), 0);
+    writePbmHeaders(file.data(), width, height, planes);
+    return file;
+}
+
+// Creates path as a mapped PBM with its headers written; kernels then fill
+// the bits in place through pbmPlane().
+inline MappedFile createPbmImage(const std::string& path, int width, int height, int planes = 1) {
+    MappedFile file = MappedFile::create(path, pbmImageSize(width, height, planes));
+    writePbmHeaders(file.data(), width, height, planes);
+    return file;
+}
+
+// The R, G and B channels of a packed RGB byte image.
+inline std::array<BytePlane, 3> interleavedPlanes(uint8_t* data, int width) {
+    ptrdiff_t rowStride = static_cast<ptrdiff_t>(width) * 3;
+    return {BytePlane{data, rowStride, 3}, BytePlane{data + 1, rowStride, 3}, BytePlane{data + 2, rowStride, 3}};
+}
+
+// The C, M and Y planes of a three-image PBM, in the order of R, G and B.
+inline std::array<BitPlane, 3> pbmPlanes(uint8_t* file, int width, int height) {
+    return {pbmPlane(file, width, height, 0), pbmPlane(file, width, height, 1), pbmPlane(file, width, height, 2)};
+}
+
+#endif
@@ -0,0 +1,174 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <map>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <vector>
+#include <sys/mman.h>
+
+// Scratch frames for the whole-image kernels. A kernel borrows its working
+// buffers (error planes, gradients, gray copies) from the process-wide pool
+// and hands them back when it returns, so the next image of a batch or the
+// next frame of a stream reuses memory that is already mapped instead of
+// faulting in fresh pages. Blocks are page-aligned anonymous mappings,
+// outside the malloc heap, rounded up to size classes a quarter of a power of
+// two apart, so frames of nearly the same size share blocks. Returned blocks
+// are kept up to a limit, $BUFFER_POOL_MB (default 1024; 0 frees every block
+// on return), which bounds peak RSS by the high-water mark of borrowed bytes
+// plus that limit.
+//
+// Borrowed buffers are not cleared; kernels that need zeros fill them.
+
+const size_t BUFFER_POOL_MIN_BLOCK = 4096;
+const size_t BUFFER_POOL_DEFAULT_MB = 1024;
+
+struct BufferPoolStats {
+    uint64_t borrows = 0;
+    uint64_t reuses = 0;       // borrows served by a returned block
+    size_t borrowed = 0;       // bytes lent out now
+    size_t peakBorrowed = 0;   // high-water mark of borrowed
+    size_t retained = 0;       // bytes returned and kept for reuse
+    size_t peakReserved = 0;   // high-water mark of borrowed + retained
+};
+
+class BufferPool {
+public:
+    explicit BufferPool(size_t retainLimit = defaultRetainLimit()) : retainLimit(retainLimit) {}
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+    ~BufferPool() { trim(); }
+
+    static size_t defaultRetainLimit() {
+        const char* mb = getenv("BUFFER_POOL_MB");
+        return (mb && *mb ? strtoull(mb, nullptr, 10) : BUFFER_POOL_DEFAULT_MB) << 20;
+    }
+
+    // The size class of a request: 4 KiB, or bytes rounded up to a quarter
+    // of the largest power of two not above it.
+    static size_t blockSize(size_t bytes) {
+        if (bytes <= BUFFER_POOL_MIN_BLOCK) return BUFFER_POOL_MIN_BLOCK;
+        size_t step = (size_t(1) << (63 - __builtin_clzll(bytes))) / 4;
+        return (bytes + step - 1) / step * step;
+    }
+
+    // A block of blockSize(bytes) bytes, to be handed back with give().
+    void* take(size_t bytes) {
+        size_t size = blockSize(bytes);
+        std::lock_guard<std::mutex> guard(lock);
+        ++counters.borrows;
+        counters.borrowed += size;
+        counters.peakBorrowed = std::max(counters.peakBorrowed, counters.borrowed);
+        auto found = free.find(size);
+        if (found != free.end() && !found->second.empty()) {
+            void* block = found->second.back();
+            found->second.pop_back();
+            ++counters.reuses;
+            counters.retained -= size;
+            return block;
+        }
+        counters.peakReserved = std::max(counters.peakReserved, counters.borrowed + counters.retained);
+        void* block = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (block == MAP_FAILED) {
+            --counters.borrows;
+            counters.borrowed -= size;
+            throw std::bad_alloc();
+        }
+        return block;
+    }
+
+    void give(void* block, size_t bytes) {
+        size_t size = blockSize(bytes);
+        std::lock_guard<std::mutex> guard(lock);
+        counters.borrowed -= size;
+        if (counters.retained + size > retainLimit) {
+            munmap(block, size);
+            return;
+        }
+        free[size].push_back(block);
+        counters.retained += size;
+    }
+
+    // Frees every retained block.
+    void trim() {
+        std::lock_guard<std::mutex> guard(lock);
+        for (auto& entry : free) {
+            for (void* block : entry.second) {
+                munmap(block, entry.first);
+            }
+        }
+        free.clear();
+        counters.retained = 0;
+    }
+
+    BufferPoolStats stats() const {
+        std::lock_guard<std::mutex> guard(lock);
+        return counters;
+    }
+
+private:
+    size_t retainLimit;
+    mutable std::mutex lock;
+    std::map<size_t, std::vector<void*>> free;  // returned blocks by size class
+    BufferPoolStats counters;
+};
+
+// Process-wide pool shared by every kernel and thread.
+inline BufferPool& scratchPool() {
+    static BufferPool pool;
+    return pool;
+}
+
+// A borrowed array of count elements, handed back when it goes out of scope.
+// Enough like a vector (data, size, indexing, iteration) for the kernels.
+template <typename T>
+class ScratchBuffer {
+    static_assert(std::is_trivially_copyable<T>::value && std::is_trivially_destructible<T>::value,
+                  "scratch buffers hold plain values");
+
+public:
+    typedef T value_type;
+
+    ScratchBuffer() = default;
+    explicit ScratchBuffer(size_t count, BufferPool& pool = scratchPool())
+        : pool(&pool), elements(count ? static_cast<T*>(pool.take(count * sizeof(T))) : nullptr), count(count) {}
+    ScratchBuffer(size_t count, T value, BufferPool& pool = scratchPool()) : ScratchBuffer(count, pool) {
+        std::fill(begin(), end(), value);
+    }
+    ScratchBuffer(ScratchBuffer&& other) noexcept { swap(other); }
+    ScratchBuffer& operator=(ScratchBuffer&& other) noexcept {
+        ScratchBuffer(std::move(other)).swap(*this);
+        return *this;
+    }
+    ~ScratchBuffer() {
+        if (elements) pool->give(elements, count * sizeof(T));
+    }
+
+    T* data() { return elements; }
+    const T* data() const { return elements; }
+    size_t size() const { return count; }
+    T& operator[](size_t i) { return elements[i]; }
+    const T& operator[](size_t i) const { return elements[i]; }
+    T* begin() { return elements; }
+    T* end() { return elements + count; }
+    const T* begin() const { return elements; }
+    const T* end() const { return elements + count; }
+
+private:
+    void swap(ScratchBuffer& other) {
+        std::swap(pool, other.pool);
+        std::swap(elements, other.elements);
+        std::swap(count, other.count);
+    }
+
+    BufferPool* pool = nullptr;
+    T* elements = nullptr;
+    size_t count = 0;
+};
+
+#endif
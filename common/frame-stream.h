@@ -0,0 +1,259 @@
+#ifndef FRAME_STREAM_H
+#define FRAME_STREAM_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <istream>
+#include <ostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include "bit-plane.h"
+#include "bounded-queue.h"
+#include "instrumentation.h"
+#include "raw-image.h"
+
+// Frame-sequence mode for the halftoning tools. One process halftones a whole
+// sequence, so the shared pool, the tables and every buffer stay warm from
+// frame to frame. Frames come either from a YUV4MPEG2 stream, of which the Y
+// plane is halftoned and the chroma skipped, or as concatenated 8-bit gray
+// frames of a given size. A reader thread reads frame N + 1 and compares it
+// with frame N while frame N is processed, and a writer thread writes frame
+// N - 1 meanwhile. Output is a mono YUV4MPEG2 stream for a y4m input,
+// concatenated raw frames otherwise, or concatenated PBMs when packed.
+
+struct FrameFormat {
+    int width = 0;
+    int height = 0;
+    bool y4m = false;
+    size_t chromaBytes = 0;  // bytes of U and V following each Y plane
+    std::string tags;        // stream header tags other than W, H and C
+};
+
+// "WxH" for raw gray frames, or "y4m" to take the size from the stream header.
+inline FrameFormat parseFrameFormat(const std::string& spec) {
+    FrameFormat format;
+    if (spec == "y4m") {
+        format.y4m = true;
+        return format;
+    }
+    size_t x = spec.find('x');
+    if (x != std::string::npos) {
+        format.width = std::atoi(spec.substr(0, x).c_str());
+        format.height = std::atoi(spec.substr(x + 1).c_str());
+    }
+    if (format.width <= 0 || format.height <= 0) {
+        throw std::invalid_argument("frame format must be WxH or y4m, got " + spec);
+    }
+    return format;
+}
+
+// Reads the stream header; only 8-bit streams are supported.
+inline void readY4mHeader(std::istream& in, FrameFormat& format) {
+    std::string line;
+    if (!std::getline(in, line) || line.compare(0, 10, "YUV4MPEG2 ") != 0) {
+        throw std::runtime_error("input is not a YUV4MPEG2 stream");
+    }
+    std::istringstream tokens(line.substr(10));
+    std::string tag, chroma = "420jpeg";
+    while (tokens >> tag) {
+        if (tag[0] == 'W') format.width = std::atoi(tag.c_str() + 1);
+        else if (tag[0] == 'H') format.height = std::atoi(tag.c_str() + 1);
+        else if (tag[0] == 'C') chroma = tag.substr(1);
+        else format.tags += " " + tag;
+    }
+    if (format.width <= 0 || format.height <= 0) throw std::runtime_error("YUV4MPEG2 header has no frame size");
+    size_t halfWidth = (format.width + 1) / 2, halfHeight = (format.height + 1) / 2;
+    size_t lumaSize = rawImageSize(format.width, format.height, 1);
+    if (chroma == "420jpeg" || chroma == "420paldv" || chroma == "420mpeg2" || chroma == "420") {
+        format.chromaBytes = 2 * halfWidth * halfHeight;
+    } else if (chroma == "422") {
+        format.chromaBytes = 2 * halfWidth * format.height;
+    } else if (chroma == "444") {
+        format.chromaBytes = 2 * lumaSize;
+    } else if (chroma == "444alpha") {
+        format.chromaBytes = 3 * lumaSize;
+    } else if (chroma == "mono") {
+        format.chromaBytes = 0;
+    } else {
+        throw std::runtime_error("unsupported YUV4MPEG2 colour space C" + chroma);
+    }
+}
+
+// Reads the gray pixels of the next frame; false at the end of the stream.
+inline bool readFrame(std::istream& in, const FrameFormat& format, uint8_t* pixels, int index) {
+    if (format.y4m) {
+        std::string header;
+        if (!std::getline(in, header)) return false;
+        if (header.compare(0, 5, "FRAME") != 0) {
+            throw std::runtime_error("expected FRAME before frame " + std::to_string(index));
+        }
+    } else if (in.peek() == std::char_traits<char>::eof()) {
+        return false;
+    }
+    std::streamsize size = rawImageSize(format.width, format.height, 1);
+    if (!in.read(reinterpret_cast<char*>(pixels), size) ||
+        !in.ignore(format.chromaBytes) || in.gcount() != static_cast<std::streamsize>(format.chromaBytes)) {
+        throw std::runtime_error("input ended inside frame " + std::to_string(index));
+    }
+    return true;
+}
+
+struct Frame {
+    std::vector<uint8_t> pixels;
+    int index = 0;
+    int width = 0;
+    int height = 0;
+    // changedAbove[y]: rows above y that differ from the previous frame. Every
+    // row counts as changed in the first frame and when reuse is off.
+    std::vector<int> changedAbove;
+
+    bool changed(int y0, int y1) const { return changedAbove[y1] > changedAbove[y0]; }
+    int changedRows() const { return changedAbove[height]; }
+
+    // Calls fn(y0, y1) for each run of blocks of blockRows rows that hold a
+    // changed row; blocks start at multiples of blockRows.
+    template <typename Fn>
+    void forEachChangedSpan(int blockRows, Fn fn) const {
+        int y = 0;
+        while (y < height) {
+            int y0 = y;
+            while (y < height && changed(y, std::min(height, y + blockRows))) {
+                y = std::min(height, y + blockRows);
+            }
+            if (y > y0) fn(y0, y);
+            else y = std::min(height, y + blockRows);
+        }
+    }
+};
+
+// Frames in flight on either side of processing.
+const int FRAME_SLOTS = 4;
+
+// Halftones every frame of in to out and prints a summary on stderr.
+// process(frame, output) renders one frame into output, a BytePlane or, when
+// packed, the BitPlane of a PBM, and returns the number of rows it rendered.
+// output still holds the previous frame's result, so rows whose input did not
+// change may be left as they are. Throws std::runtime_error on bad input or
+// a failed write.
+template <typename Process>
+int streamFrames(std::istream& in, std::ostream& out, FrameFormat format, bool packed, bool reuse, Process process) {
+    if (format.y4m) readY4mHeader(in, format);
+    int width = format.width, height = format.height;
+    size_t frameSize = rawImageSize(width, height, 1);
+    size_t outputSize = packed ? pbmImageSize(width, height) : frameSize;
+    bool y4mOutput = format.y4m && !packed;
+    if (y4mOutput) {
+        std::string range = format.tags.find("XCOLORRANGE") == std::string::npos ? " XCOLORRANGE=FULL" : "";
+        out << "YUV4MPEG2 W" << width << " H" << height << format.tags << range << " Cmono\n";
+    }
+
+    std::vector<Frame> inputs(FRAME_SLOTS);
+    std::vector<std::vector<uint8_t>> outputs(FRAME_SLOTS, std::vector<uint8_t>(outputSize));
+    BoundedQueue<Frame*> freeInputs(FRAME_SLOTS), toProcess(FRAME_SLOTS);
+    BoundedQueue<std::vector<uint8_t>*> freeOutputs(FRAME_SLOTS), toWrite(FRAME_SLOTS);
+    for (int i = 0; i < FRAME_SLOTS; ++i) {
+        inputs[i].pixels.resize(frameSize);
+        inputs[i].width = width;
+        inputs[i].height = height;
+        inputs[i].changedAbove.assign(height + 1, 0);
+        freeInputs.push(&inputs[i]);
+        freeOutputs.push(&outputs[i]);
+    }
+    auto stop = [&] {
+        freeInputs.close();
+        toProcess.close();
+        freeOutputs.close();
+        toWrite.close();
+    };
+
+    // A frame goes back to freeInputs only after its successor is processed,
+    // so the reader can still compare against it.
+    std::string readError, writeError;
+    std::thread reader([&] {
+        const Frame* previous = nullptr;
+        Frame* frame;
+        try {
+            for (int index = 0; freeInputs.pop(frame); ++index) {
+                {
+                    STAGE_TIMER("read", frameSize);
+                    if (!readFrame(in, format, frame->pixels.data(), index)) break;
+                }
+                frame->index = index;
+                for (int y = 0; y < height; ++y) {
+                    size_t offset = static_cast<size_t>(y) * width;
+                    bool changed = !reuse || !previous ||
+                                   memcmp(&frame->pixels[offset], &previous->pixels[offset], width) != 0;
+                    frame->changedAbove[y + 1] = frame->changedAbove[y] + changed;
+                }
+                previous = frame;
+                if (!toProcess.push(frame)) break;
+            }
+        } catch (const std::exception& e) {
+            readError = e.what();
+        }
+        toProcess.close();
+    });
+    std::thread writer([&] {
+        std::vector<uint8_t>* output;
+        while (toWrite.pop(output)) {
+            STAGE_TIMER("write", frameSize);
+            if (y4mOutput) out << "FRAME\n";
+            if (!out.write(reinterpret_cast<const char*>(output->data()), output->size())) {
+                writeError = "failed to write frame";
+                stop();
+                break;
+            }
+            freeOutputs.push(output);
+        }
+    });
+
+    // The frames are rendered into held, which keeps the last result for reuse.
+    std::vector<uint8_t> held = packed ? pbmBuffer(width, height) : std::vector<uint8_t>(frameSize, 0);
+    int frames = 0;
+    uint64_t renderedRows = 0;
+    auto start = std::chrono::steady_clock::now();
+    try {
+        Frame* frame;
+        Frame* previous = nullptr;
+        std::vector<uint8_t>* output;
+        while (toProcess.pop(frame)) {
+            {
+                STAGE_TIMER("frame", frameSize);
+                if (packed) renderedRows += process(*frame, pbmPlane(held.data(), width, height));
+                else renderedRows += process(*frame, BytePlane{held.data(), width});
+            }
+            if (!freeOutputs.pop(output)) break;
+            memcpy(output->data(), held.data(), outputSize);
+            toWrite.push(output);
+            if (previous) freeInputs.push(previous);
+            previous = frame;
+            ++frames;
+        }
+    } catch (...) {
+        stop();
+        reader.join();
+        writer.join();
+        throw;
+    }
+    toWrite.close();
+    writer.join();
+    stop();
+    reader.join();
+    if (!readError.empty()) throw std::runtime_error(readError);
+    if (!writeError.empty() || !out.flush()) throw std::runtime_error("failed to write frame");
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    fprintf(stderr, "%d frames of %dx%d, %.1f fps, %.1f%% of rows rendered\n", frames, width, height,
+            seconds > 0.0 ? frames / seconds : 0.0,
+            frames ? 100.0 * renderedRows / (static_cast<double>(frames) * height) : 0.0);
+    return frames;
+}
+
+#endif
@@ -0,0 +1,173 @@
+#ifndef INSTRUMENTATION_H
+#define INSTRUMENTATION_H
+
+// Opt-in per-stage instrumentation. Built with -DENABLE_INSTRUMENTATION, every
+// STAGE_TIMER(name, pixels) scope adds its wall time and pixel count to the
+// totals for that stage name and samples the process peak RSS on exit, and
+// INSTRUMENT_RUN(tool) at the top of main prints one JSON object with all
+// stages on stderr when main returns (and appends it as a line to the file
+// named by $INSTRUMENTATION_OUTPUT, if set). The report also carries the
+// process minor page faults and the high-water marks of the scratch buffer
+// pool (see buffer-pool.h). Stages may be timed from several threads at
+// once. Without the define both macros expand to an empty statement, so
+// neither the timers nor their arguments cost anything.
+
+#ifdef ENABLE_INSTRUMENTATION
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+#include <sys/resource.h>
+#include "buffer-pool.h"
+
+struct StageStats {
+    std::string name;
+    uint64_t calls = 0;
+    double seconds = 0.0;
+    double maxSeconds = 0.0;
+    uint64_t pixels = 0;
+    long peakRssKb = 0;
+    long rssGrowthKb = 0;  // how far the process peak rose during this stage
+};
+
+class Instrumentation {
+public:
+    static Instrumentation& instance() {
+        static Instrumentation registry;
+        return registry;
+    }
+
+    // ru_maxrss is in kilobytes on Linux.
+    static long peakRssKb() {
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        return usage.ru_maxrss;
+    }
+
+    static long minorFaults() {
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        return usage.ru_minflt;
+    }
+
+    void record(const std::string& name, double seconds, uint64_t pixels, long rssBefore, long rssAfter) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto found = std::find_if(stages.begin(), stages.end(), [&](const StageStats& s) { return s.name == name; });
+        if (found == stages.end()) {
+            stages.emplace_back();
+            stages.back().name = name;
+            found = stages.end() - 1;
+        }
+        found->calls += 1;
+        found->seconds += seconds;
+        found->maxSeconds = std::max(found->maxSeconds, seconds);
+        found->pixels += pixels;
+        found->peakRssKb = std::max(found->peakRssKb, rssAfter);
+        found->rssGrowthKb += rssAfter - rssBefore;
+    }
+
+    std::string json(const std::string& tool, double wallSeconds) {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::string out = "{\"tool\":\"" + escape(tool) + "\",\"wall_seconds\":" + number(wallSeconds) +
+                          ",\"peak_rss_kb\":" + std::to_string(peakRssKb()) +
+                          ",\"minor_faults\":" + std::to_string(minorFaults());
+        BufferPoolStats pool = scratchPool().stats();
+        out += ",\"buffer_pool\":{\"borrows\":" + std::to_string(pool.borrows) +
+               ",\"reuses\":" + std::to_string(pool.reuses) +
+               ",\"peak_borrowed_kb\":" + std::to_string(pool.peakBorrowed >> 10) +
+               ",\"peak_reserved_kb\":" + std::to_string(pool.peakReserved >> 10) + "},\"stages\":[";
+        for (size_t i = 0; i < stages.size(); ++i) {
+            const StageStats& s = stages[i];
+            double mpixPerSecond = s.seconds > 0.0 ? s.pixels / s.seconds / 1e6 : 0.0;
+            out += (i ? ",{" : "{");
+            out += "\"name\":\"" + escape(s.name) + "\",\"calls\":" + std::to_string(s.calls) +
+                   ",\"seconds\":" + number(s.seconds) + ",\"max_seconds\":" + number(s.maxSeconds) +
+                   ",\"pixels\":" + std::to_string(s.pixels) + ",\"mpix_per_second\":" + number(mpixPerSecond) +
+                   ",\"peak_rss_kb\":" + std::to_string(s.peakRssKb) +
+                   ",\"rss_growth_kb\":" + std::to_string(s.rssGrowthKb) + "}";
+        }
+        return out + "]}";
+    }
+
+private:
+    static std::string number(double value) {
+        char text[32];
+        snprintf(text, sizeof(text), "%.6g", value);
+        return text;
+    }
+
+    static std::string escape(const std::string& text) {
+        std::string out;
+        for (char c : text) {
+            if (c == '"' || c == '\\') out += '\\';
+            out += c;
+        }
+        return out;
+    }
+
+    std::mutex mutex;
+    std::vector<StageStats> stages;  // in order of first use
+};
+
+class ScopedStage {
+public:
+    ScopedStage(std::string name, uint64_t pixels)
+        : name(std::move(name)), pixels(pixels), rssBefore(Instrumentation::peakRssKb()),
+          start(std::chrono::steady_clock::now()) {}
+    ScopedStage(const ScopedStage&) = delete;
+    ScopedStage& operator=(const ScopedStage&) = delete;
+
+    ~ScopedStage() {
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        Instrumentation::instance().record(name, seconds, pixels, rssBefore, Instrumentation::peakRssKb());
+    }
+
+private:
+    std::string name;
+    uint64_t pixels;
+    long rssBefore;
+    std::chrono::steady_clock::time_point start;
+};
+
+class RunReport {
+public:
+    explicit RunReport(std::string tool) : tool(std::move(tool)), start(std::chrono::steady_clock::now()) {}
+    RunReport(const RunReport&) = delete;
+    RunReport& operator=(const RunReport&) = delete;
+
+    ~RunReport() {
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::string report = Instrumentation::instance().json(tool, seconds);
+        fprintf(stderr, "%s\n", report.c_str());
+        if (const char* path = getenv("INSTRUMENTATION_OUTPUT")) {
+            if (FILE* file = fopen(path, "a")) {
+                fprintf(file, "%s\n", report.c_str());
+                fclose(file);
+            }
+        }
+    }
+
+private:
+    std::string tool;
+    std::chrono::steady_clock::time_point start;
+};
+
+#define INSTRUMENT_CONCAT_(a, b) a##b
+#define INSTRUMENT_CONCAT(a, b) INSTRUMENT_CONCAT_(a, b)
+#define STAGE_TIMER(name, pixels) ScopedStage INSTRUMENT_CONCAT(stageTimer, __LINE__)((name), (pixels))
+#define INSTRUMENT_RUN(tool) RunReport instrumentRunReport(tool)
+
+#else
+
+#define STAGE_TIMER(name, pixels) do {} while (0)
+#define INSTRUMENT_RUN(tool) do {} while (0)
+
+#endif
+
+#endif
@@ -0,0 +1,147 @@
+#ifndef RAW_IMAGE_H
+#define RAW_IMAGE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Memory-mapped .raw I/O. Inputs are mapped read-only and checked against
+// the declared geometry; outputs are created at their final size and mapped
+// writable, so kernels read from and write into the page cache directly.
+// Failures throw std::runtime_error naming the file.
+
+class MappedFile {
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    MappedFile(MappedFile&& other) noexcept { swap(other); }
+    MappedFile& operator=(MappedFile&& other) noexcept {
+        MappedFile moved(std::move(other));
+        swap(moved);
+        return *this;
+    }
+    ~MappedFile() {
+        if (address) munmap(address, length);
+    }
+
+    static MappedFile openRead(const std::string& path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) throw std::runtime_error("cannot open " + path);
+        struct stat info;
+        if (fstat(fd, &info) != 0) {
+            close(fd);
+            throw std::runtime_error("cannot stat " + path);
+        }
+        MappedFile file;
+        file.length = info.st_size;
+        file.map(fd, PROT_READ, path);
+        if (file.address) madvise(file.address, file.length, MADV_SEQUENTIAL);
+        return file;
+    }
+
+    // Creates (or truncates) path and sizes it to size bytes.
+    static MappedFile create(const std::string& path, size_t size) {
+        int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) throw std::runtime_error("cannot create " + path);
+        if (ftruncate(fd, size) != 0) {
+            close(fd);
+            throw std::runtime_error("cannot resize " + path);
+        }
+        MappedFile file;
+        file.length = size;
+        file.map(fd, PROT_READ | PROT_WRITE, path);
+        return file;
+    }
+
+    uint8_t* data() { return static_cast<uint8_t*>(address); }
+    const uint8_t* data() const { return static_cast<const uint8_t*>(address); }
+    size_t size() const { return length; }
+
+private:
+    void map(int fd, int protection, const std::string& path) {
+        // mmap rejects empty mappings; an empty file simply has no data.
+        if (length > 0) {
+            address = mmap(nullptr, length, protection, MAP_SHARED, fd, 0);
+            if (address == MAP_FAILED) {
+                address = nullptr;
+                close(fd);
+                throw std::runtime_error("cannot map " + path);
+            }
+        }
+        close(fd);
+    }
+
+    void swap(MappedFile& other) {
+        std::swap(address, other.address);
+        std::swap(length, other.length);
+    }
+
+    void* address = nullptr;
+    size_t length = 0;
+};
+
+// Strided view of a width x height image with any number of channels.
+// Interleaved and planar layouts differ only in their strides, so kernels
+// written against at()/row() accept either without a copy.
+template <typename T>
+struct ImageView {
+    T* data = nullptr;
+    int width = 0;
+    int height = 0;
+    int channels = 1;
+    ptrdiff_t pixelStride = 1;
+    ptrdiff_t rowStride = 0;
+    ptrdiff_t channelStride = 1;
+
+    static ImageView interleaved(T* data, int width, int height, int channels) {
+        return ImageView{data, width, height, channels, channels, static_cast<ptrdiff_t>(width) * channels, 1};
+    }
+
+    static ImageView planar(T* data, int width, int height, int channels) {
+        return ImageView{data, width, height, channels, 1, width, static_cast<ptrdiff_t>(width) * height};
+    }
+
+    T* row(int y) const { return data + y * rowStride; }
+    T& at(int x, int y, int c = 0) const { return data[y * rowStride + x * pixelStride + c * channelStride]; }
+
+    // True when the pixels are packed RGBRGB... rows with no padding.
+    bool isPackedInterleaved() const {
+        return pixelStride == channels && channelStride == 1 && rowStride == static_cast<ptrdiff_t>(width) * channels;
+    }
+
+    template <typename U = T, typename = typename std::enable_if<!std::is_const<U>::value>::type>
+    operator ImageView<const U>() const {
+        return ImageView<const U>{data, width, height, channels, pixelStride, rowStride, channelStride};
+    }
+};
+
+inline size_t rawImageSize(int width, int height, int channels) {
+    return static_cast<size_t>(width) * height * channels;
+}
+
+// Maps path read-only and checks it holds exactly width * height * channels bytes.
+inline MappedFile mapRawImage(const std::string& path, int width, int height, int channels) {
+    MappedFile file = MappedFile::openRead(path);
+    size_t expected = rawImageSize(width, height, channels);
+    if (file.size() != expected) {
+        throw std::runtime_error(path + " holds " + std::to_string(file.size()) + " bytes, expected " +
+                                 std::to_string(expected) + " for " + std::to_string(width) + "x" +
+                                 std::to_string(height) + "x" + std::to_string(channels));
+    }
+    return file;
+}
+
+// Creates path at the size of a width x height x channels raw image.
+inline MappedFile createRawImage(const std::string& path, int width, int height, int channels) {
+    return MappedFile::create(path, rawImageSize(width, height, channels));
+}
+
+#endif
@@ -0,0 +1,227 @@
+#ifndef TILE_SCHEDULER_H
+#define TILE_SCHEDULER_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Shared tiling and scheduling layer for the per-pixel operators. Images are
+// cut into cache-sized tiles which a persistent work-stealing pool executes;
+// each worker drains its own block of tiles front to back and steals from the
+// back of the others' queues once it runs dry.
+
+const int TILE_WIDTH = 256;
+const int TILE_HEIGHT = 32;
+
+struct Tile {
+    int index;
+    int x0, y0, x1, y1;
+};
+
+class WorkStealingPool {
+public:
+    explicit WorkStealingPool(int numThreads = std::max(1u, std::thread::hardware_concurrency())) {
+        numThreads = std::max(1, numThreads);
+        for (int i = 0; i < numThreads; ++i) {
+            queues.emplace_back(new Queue);
+        }
+        for (int i = 1; i < numThreads; ++i) {
+            workers.emplace_back(&WorkStealingPool::workerLoop, this, i);
+        }
+    }
+
+    ~WorkStealingPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (std::thread& worker : workers) {
+            worker.join();
+        }
+    }
+
+    int size() const { return queues.size(); }
+
+    // Runs task(0) .. task(numTasks - 1) and returns once all have finished.
+    // The calling thread works as well; tasks must not call run() themselves.
+    // While another thread's run() is in flight the caller runs its tasks
+    // inline, so independent jobs sharing the pool do not queue behind it.
+    void run(int numTasks, const std::function<void(int)>& task) {
+        if (numTasks <= 0) return;
+        std::unique_lock<std::mutex> runLock(runMutex, std::try_to_lock);
+        if (!runLock.owns_lock()) {
+            for (int t = 0; t < numTasks; ++t) {
+                task(t);
+            }
+            return;
+        }
+        int numQueues = queues.size();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (int q = 0; q < numQueues; ++q) {
+                std::lock_guard<std::mutex> queueLock(queues[q]->mutex);
+                int begin = static_cast<int64_t>(numTasks) * q / numQueues;
+                int end = static_cast<int64_t>(numTasks) * (q + 1) / numQueues;
+                for (int t = begin; t < end; ++t) {
+                    queues[q]->tasks.push_back(t);
+                }
+            }
+            current = &task;
+            remaining = numTasks;
+            ++generation;
+        }
+        wake.notify_all();
+
+        int next;
+        while (popOrSteal(0, next)) {
+            task(next);
+            finishTask();
+        }
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [&] { return remaining == 0 && active == 0; });
+        current = nullptr;
+    }
+
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<int> tasks;
+    };
+
+    bool popOrSteal(int self, int& task) {
+        {
+            Queue& own = *queues[self];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if (!own.tasks.empty()) {
+                task = own.tasks.front();
+                own.tasks.pop_front();
+                return true;
+            }
+        }
+        int numQueues = queues.size();
+        for (int i = 1; i < numQueues; ++i) {
+            Queue& victim = *queues[(self + i) % numQueues];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.tasks.empty()) {
+                task = victim.tasks.back();
+                victim.tasks.pop_back();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void finishTask() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (--remaining == 0) done.notify_all();
+    }
+
+    void workerLoop(int self) {
+        uint64_t seen = 0;
+        while (true) {
+            const std::function<void(int)>* task;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [&] { return stopping || generation != seen; });
+                if (stopping) return;
+                seen = generation;
+                task = current;
+                // A wakeup that arrives after its run() has returned finds no
+                // task, and the queues may already hold the next run's tasks.
+                // Only workers counted in active may pop, and run() keeps
+                // current valid until active drops back to zero.
+                if (!task) continue;
+                ++active;
+            }
+            int next;
+            while (popOrSteal(self, next)) {
+                (*task)(next);
+                finishTask();
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--active == 0 && remaining == 0) done.notify_all();
+        }
+    }
+
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> workers;
+    std::mutex mutex, runMutex;
+    std::condition_variable wake, done;
+    const std::function<void(int)>* current = nullptr;
+    uint64_t generation = 0;
+    int remaining = 0;
+    int active = 0;
+    bool stopping = false;
+};
+
+inline std::unique_ptr<WorkStealingPool>& sharedPoolSlot() {
+    static std::unique_ptr<WorkStealingPool> pool(new WorkStealingPool);
+    return pool;
+}
+
+// Process-wide pool sized to the machine, shared by every operator.
+inline WorkStealingPool& sharedPool() {
+    return *sharedPoolSlot();
+}
+
+// Replaces the shared pool with one of numThreads workers (the benchmark's
+// thread sweep). No operator may be running while it is called.
+inline void resizeSharedPool(int numThreads) {
+    if (sharedPool().size() != std::max(1, numThreads)) {
+        sharedPoolSlot().reset(new WorkStealingPool(numThreads));
+    }
+}
+
+// Runs fn over tiles covering [halo, width - halo) x [halo, height - halo).
+// A stencil of radius halo can then read its neighbours from any tile
+// without bounds checks; pass halo = 0 to cover the whole image.
+inline void forEachTile(int width, int height, int halo, const std::function<void(const Tile&)>& fn,
+                        WorkStealingPool& pool = sharedPool(),
+                        int tileWidth = TILE_WIDTH, int tileHeight = TILE_HEIGHT) {
+    int x0 = halo, y0 = halo;
+    int x1 = width - halo, y1 = height - halo;
+    if (x1 <= x0 || y1 <= y0) return;
+    int tilesX = (x1 - x0 + tileWidth - 1) / tileWidth;
+    int tilesY = (y1 - y0 + tileHeight - 1) / tileHeight;
+    pool.run(tilesX * tilesY, [&](int index) {
+        int tx = index % tilesX;
+        int ty = index / tilesX;
+        Tile tile;
+        tile.index = index;
+        tile.x0 = x0 + tx * tileWidth;
+        tile.y0 = y0 + ty * tileHeight;
+        tile.x1 = std::min(x1, tile.x0 + tileWidth);
+        tile.y1 = std::min(y1, tile.y0 + tileHeight);
+        fn(tile);
+    });
+}
+
+// Counter-based generator: the n-th value of a stream is a pure function of
+// (seed, n), so a tile seeds its stream at the index of its first pixel and
+// the output does not depend on tiling or thread count.
+class CounterRng {
+public:
+    CounterRng(uint64_t seed, uint64_t counter) : key(seed), counter(counter) {}
+
+    uint32_t next() {
+        // splitmix64 finalizer applied to key + counter * golden ratio.
+        uint64_t z = key + (counter++ + 1) * 0x9E3779B97F4A7C15ULL;
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return static_cast<uint32_t>((z ^ (z >> 31)) >> 32);
+    }
+
+private:
+    uint64_t key;
+    uint64_t counter;
+};
+
+#endif
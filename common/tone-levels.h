@@ -0,0 +1,197 @@
+#ifndef TONE_LEVELS_H
+#define TONE_LEVELS_H
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include "bit-plane.h"
+
+// N-level quantization for the error-diffusion engines, for devices with more
+// than one ink level per dot. Level i has tone round(i * 255 / (N - 1)), and
+// an accumulated value goes to the nearest level, ties upward as at the binary
+// 128 threshold, so N = 2 reproduces the binary output exactly. All of it is
+// table lookups on the integer part of the value.
+//
+// LevelPlane is the matching destination (compare bit-plane.h): one byte per
+// pixel holding the tone of its level, or packed rows of ToneLevels::bits bits
+// per pixel holding the ink amount N - 1 - i (0 = white), the leftmost pixel
+// in the most significant bits and rows padded to whole bytes. Two levels pack
+// exactly like PBM bits. Colour rasters are stored as their C, M and Y planes
+// one after another, as in a three-image PBM without the headers. Writers in
+// different threads must not share a byte of a packed row; columns split at
+// multiples of 8 never do.
+
+struct ToneLevels {
+    int count = 2;
+    int bits = 1;                       // packed bits per pixel: 1, 2, 4 or 8
+    std::array<uint8_t, 256> tone{};    // tone of each level
+    std::array<uint8_t, 256> nearest{}; // nearest level of each integer value
+    std::array<float, 256> nearestTone{};  // and its tone, a single lookup on the error path
+    // The same for ink amounts 255 - tone, which the separable CMY engine
+    // diffuses; ties again go upward, now towards more ink.
+    std::array<float, 256> nearestInk{};
+    // For the colour engines: the original value lies between levels cell[v]
+    // and cell[v] + 1, at position[v] on a 0..255 scale between the two.
+    std::array<uint8_t, 256> cell{};
+    std::array<uint8_t, 256> position{};
+    std::array<float, 256> cellScale{};  // 255 / the width of each cell
+    std::array<float, 256> cellUnit{};   // and its inverse; 255 * cellUnit is the exact width
+
+    // Clamped rather than branched on, as accumulated values often overshoot.
+    static int index(float value) { return static_cast<int>(std::min(std::max(value, 0.0f), 255.0f)); }
+    int levelOf(float value) const { return nearest[index(value)]; }
+};
+
+inline ToneLevels makeToneLevels(int count) {
+    if (count < 2 || count > 256) throw std::invalid_argument("levels must be 2 to 256, got " + std::to_string(count));
+    ToneLevels levels;
+    levels.count = count;
+    levels.bits = count <= 2 ? 1 : count <= 4 ? 2 : count <= 16 ? 4 : 8;
+    int steps = count - 1;
+    for (int i = 0; i < count; ++i) {
+        levels.tone[i] = (2 * 255 * i + steps) / (2 * steps);
+    }
+    for (int i = 0; i < steps; ++i) {
+        levels.cellScale[i] = 255.0f / (levels.tone[i + 1] - levels.tone[i]);
+        levels.cellUnit[i] = (levels.tone[i + 1] - levels.tone[i]) / 255.0f;
+    }
+    auto ink = [&](int i) { return 255 - levels.tone[steps - i]; };
+    int level = 0, inkLevel = 0, cell = 0;
+    for (int v = 0; v < 256; ++v) {
+        while (level < steps && v >= (levels.tone[level] + levels.tone[level + 1] + 1) / 2) ++level;
+        while (inkLevel < steps && v >= (ink(inkLevel) + ink(inkLevel + 1) + 1) / 2) ++inkLevel;
+        levels.nearestInk[v] = ink(inkLevel);
+        while (cell + 1 < steps && v >= levels.tone[cell + 1]) ++cell;
+        int low = levels.tone[cell], span = levels.tone[cell + 1] - low;
+        levels.nearest[v] = level;
+        levels.nearestTone[v] = levels.tone[level];
+        levels.cell[v] = cell;
+        levels.position[v] = (2 * 255 * (v - low) + span) / (2 * span);
+    }
+    return levels;
+}
+
+// The N of a command-line token "L<N>", or 0 for any other token.
+inline int levelsArg(const std::string& arg) {
+    if (arg.size() < 2 || arg[0] != 'L' || arg.find_first_not_of("0123456789", 1) != std::string::npos) return 0;
+    if (arg.size() > 4 || std::stoi(arg.substr(1)) < 2 || std::stoi(arg.substr(1)) > 256) {
+        throw std::invalid_argument("levels must be L2 to L256, got " + arg);
+    }
+    return std::stoi(arg.substr(1));
+}
+
+struct LevelPlane {
+    uint8_t* data;
+    ptrdiff_t rowStride;
+    const ToneLevels* levels;
+    bool packed = false;
+    ptrdiff_t pixelStride = 1;  // byte planes only
+
+    void set(int x, int y, int level) const {
+        if (!packed) {
+            data[y * rowStride + x * pixelStride] = levels->tone[level];
+            return;
+        }
+        int bits = levels->bits;
+        int shift = 8 - bits - ((x * bits) & 7);
+        uint8_t mask = ((1 << bits) - 1) << shift;
+        uint8_t& byte = data[y * rowStride + ((x * bits) >> 3)];
+        byte = (byte & ~mask) | ((levels->count - 1 - level) << shift);
+    }
+    // Binary kernels cannot write a level plane by mistake.
+    void set(int x, int y, bool on) const = delete;
+};
+
+inline size_t levelRowBytes(int width, const ToneLevels& levels) {
+    return (static_cast<size_t>(width) * levels.bits + 7) / 8;
+}
+
+// Size of `planes` consecutive packed planes of width x height.
+inline size_t packedLevelSize(int width, int height, const ToneLevels& levels, int planes = 1) {
+    return planes * levelRowBytes(width, levels) * height;
+}
+
+inline LevelPlane packedLevelPlane(uint8_t* data, int width, int height, const ToneLevels& levels, int plane = 0) {
+    ptrdiff_t rowBytes = levelRowBytes(width, levels);
+    return LevelPlane{data + plane * rowBytes * height, rowBytes, &levels, true};
+}
+
+// Creates path as a mapped packed raster of `planes` planes, headerless.
+inline MappedFile createPackedLevelImage(const std::string& path, int width, int height, const ToneLevels& levels,
+                                         int planes = 1) {
+    return MappedFile::create(path, packedLevelSize(width, height, levels, planes));
+}
+
+// The C, M and Y planes of a packed colour raster, in the order of R, G and B.
+inline std::array<LevelPlane, 3> packedLevelPlanes(uint8_t* data, int width, int height, const ToneLevels& levels) {
+    return {packedLevelPlane(data, width, height, levels, 0), packedLevelPlane(data, width, height, levels, 1),
+            packedLevelPlane(data, width, height, levels, 2)};
+}
+
+// The R, G and B channels of a packed RGB byte image.
+inline std::array<LevelPlane, 3> interleavedLevelPlanes(uint8_t* data, int width, const ToneLevels& levels) {
+    ptrdiff_t rowStride = static_cast<ptrdiff_t>(width) * 3;
+    return {LevelPlane{data, rowStride, &levels, false, 3}, LevelPlane{data + 1, rowStride, &levels, false, 3},
+            LevelPlane{data + 2, rowStride, &levels, false, 3}};
+}
+
+// The engines quantize through these, so a binary plane keeps the 128
+// threshold and a LevelPlane uses its levels. quantizeTo stores pixel (x, y)
+// and returns the tone it is printed at; quantizeInk returns the ink amount
+// printed for an ink value, and setTone stores a value that is already a tone.
+template <typename Plane>
+inline float quantizeTo(const Plane& plane, int x, int y, float value) {
+    bool on = value >= 128.0f;
+    plane.set(x, y, on);
+    return on ? 255.0f : 0.0f;
+}
+
+inline float quantizeTo(const LevelPlane& plane, int x, int y, float value) {
+    int index = ToneLevels::index(value);
+    plane.set(x, y, plane.levels->nearest[index]);
+    return plane.levels->nearestTone[index];
+}
+
+template <typename Plane>
+inline float quantizeInk(const Plane&, float value) {
+    return value < 128.0f ? 0.0f : 255.0f;
+}
+
+inline float quantizeInk(const LevelPlane& plane, float value) {
+    return plane.levels->nearestInk[ToneLevels::index(value)];
+}
+
+template <typename Plane>
+inline void setTone(const Plane& plane, int x, int y, float tone) {
+    plane.set(x, y, tone >= 128.0f);
+}
+
+inline void setTone(const LevelPlane& plane, int x, int y, float tone) {
+    plane.set(x, y, plane.levels->levelOf(tone));
+}
+
+// The levels behind a plane, or nullptr for a binary one.
+template <typename Plane>
+inline const ToneLevels* planeLevels(const Plane&) {
+    return nullptr;
+}
+
+inline const ToneLevels* planeLevels(const LevelPlane& plane) {
+    return plane.levels;
+}
+
+// A one-row byte plane at row that quantizes like plane, for output that is
+// thrown away, such as the priming rows of a band.
+template <typename Plane>
+inline BytePlane scratchPlane(const Plane&, uint8_t* row) {
+    return BytePlane{row, 0};
+}
+
+inline LevelPlane scratchPlane(const LevelPlane& plane, uint8_t* row) {
+    return LevelPlane{row, 0, plane.levels};
+}
+
+#endif
@@ -0,0 +1,279 @@
+#ifndef BLUE_NOISE_H
+#define BLUE_NOISE_H
+
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include "dithering.h"
+
+using namespace std;
+
+// Blue-noise threshold arrays built by void-and-cluster (Ulichney 1993). Each
+// gray level switches on the pixels that are as far as possible from those
+// already on, so a flat area dithers to an even, isotropic grain like error
+// diffusion's, without the cross-hatch of a Bayer matrix. Each pixel still
+// depends only on its own value, so the array is applied on the same tiled
+// SIMD path as ditherMatrix. Arrays are square, a power of two from 16 to 256
+// wide, and tile the image with no visible seam.
+//
+// Generating the larger arrays costs far more than dithering an image with
+// them, so arrays are cached as 16-bit PGMs of the ranks,
+// blue-noise-<size>.pgm, in $BLUE_NOISE_CACHE or else the current
+// directory. A missing or damaged file is generated again.
+
+const int BLUE_NOISE_MIN_SIZE = 16;
+const int BLUE_NOISE_MAX_SIZE = 256;
+const double BLUE_NOISE_SIGMA = 1.5;
+const int BLUE_NOISE_RADIUS = 6;          // the Gaussian is below 3e-4 of its peak beyond this
+const int BLUE_NOISE_WEIGHT_SCALE = 1 << 20;  // integer energies are exact and platform independent
+const uint64_t BLUE_NOISE_SEED = 1;
+
+struct BlueNoise {
+    int size = 0;
+    vector<uint16_t> ranks;  // size x size, each of 0 .. size^2 - 1 once
+    vector<uint8_t> levels;  // a pixel is on iff its value >= level, as in BayerLevels
+};
+
+inline bool isBlueNoiseSize(int size) {
+    return size >= BLUE_NOISE_MIN_SIZE && size <= BLUE_NOISE_MAX_SIZE && (size & (size - 1)) == 0;
+}
+
+// Binary pattern on a size x size torus with the energy of every pixel: the
+// sum of a Gaussian centred on each "on" pixel. The most crowded "on" pixel
+// (the tightest cluster) and the emptiest "off" pixel (the largest void) are
+// found from a per-row cache, so a flip rescans only the rows it touched.
+class VoidAndCluster {
+public:
+    explicit VoidAndCluster(int size)
+        : size(size), pattern(size * size, 0), energy(size * size, 0), rowCluster(size, -1), rowVoid(size, 0) {
+        for (int dy = -BLUE_NOISE_RADIUS; dy <= BLUE_NOISE_RADIUS; ++dy) {
+            for (int dx = -BLUE_NOISE_RADIUS; dx <= BLUE_NOISE_RADIUS; ++dx) {
+                double w = exp(-(dx * dx + dy * dy) / (2.0 * BLUE_NOISE_SIGMA * BLUE_NOISE_SIGMA));
+                weights.push_back(static_cast<int>(lround(w * BLUE_NOISE_WEIGHT_SCALE)));
+            }
+        }
+        for (int y = 0; y < size; ++y) {
+            rowVoid[y] = y * size;
+        }
+    }
+
+    bool isOn(int p) const { return pattern[p] != 0; }
+
+    void flip(int p) {
+        int sign = pattern[p] ? -1 : 1;
+        pattern[p] ^= 1;
+        int px = p % size, py = p / size, mask = size - 1;
+        const int* w = weights.data();
+        for (int dy = -BLUE_NOISE_RADIUS; dy <= BLUE_NOISE_RADIUS; ++dy) {
+            int* row = &energy[((py + dy) & mask) * size];
+            for (int dx = -BLUE_NOISE_RADIUS; dx <= BLUE_NOISE_RADIUS; ++dx) {
+                row[(px + dx) & mask] += sign * *w++;
+            }
+        }
+        for (int dy = -BLUE_NOISE_RADIUS; dy <= BLUE_NOISE_RADIUS; ++dy) {
+            rescanRow((py + dy) & mask);
+        }
+    }
+
+    // Ties go to the first pixel in raster order; -1 if no pixel qualifies.
+    int tightestCluster() const {
+        int best = -1;
+        for (int p : rowCluster) {
+            if (p >= 0 && (best < 0 || energy[p] > energy[best])) best = p;
+        }
+        return best;
+    }
+
+    int largestVoid() const {
+        int best = -1;
+        for (int p : rowVoid) {
+            if (p >= 0 && (best < 0 || energy[p] < energy[best])) best = p;
+        }
+        return best;
+    }
+
+private:
+    void rescanRow(int y) {
+        int cluster = -1, hole = -1;
+        for (int p = y * size; p < (y + 1) * size; ++p) {
+            if (pattern[p]) {
+                if (cluster < 0 || energy[p] > energy[cluster]) cluster = p;
+            } else if (hole < 0 || energy[p] < energy[hole]) {
+                hole = p;
+            }
+        }
+        rowCluster[y] = cluster;
+        rowVoid[y] = hole;
+    }
+
+    int size;
+    vector<uint8_t> pattern;
+    vector<int> energy;
+    vector<int> weights;
+    vector<int> rowCluster, rowVoid;
+};
+
+inline void setBlueNoiseLevels(BlueNoise& noise) {
+    double n = static_cast<double>(noise.size) * noise.size;
+    noise.levels.resize(noise.ranks.size());
+    for (size_t i = 0; i < noise.ranks.size(); ++i) {
+        double threshold = (noise.ranks[i] + 0.5) / n * 255.0;
+        noise.levels[i] = static_cast<uint8_t>(static_cast<int>(threshold) + 1);
+    }
+}
+
+inline BlueNoise generateBlueNoise(int size, uint64_t seed = BLUE_NOISE_SEED) {
+    if (!isBlueNoiseSize(size)) throw invalid_argument("blue-noise size must be a power of two from 16 to 256");
+    int n = size * size;
+    VoidAndCluster field(size);
+
+    // Initial pattern: a tenth of the pixels on at random, then the tightest
+    // cluster moved into the largest void until that would undo the move.
+    int ones = n / 10;
+    CounterRng rng(seed, 0);
+    for (int placed = 0; placed < ones;) {
+        int p = rng.next() % n;
+        if (!field.isOn(p)) {
+            field.flip(p);
+            ++placed;
+        }
+    }
+    for (int moves = 0; moves < n; ++moves) {
+        int cluster = field.tightestCluster();
+        field.flip(cluster);
+        int hole = field.largestVoid();
+        if (hole == cluster) {
+            field.flip(cluster);
+            break;
+        }
+        field.flip(hole);
+    }
+
+    BlueNoise noise;
+    noise.size = size;
+    noise.ranks.resize(n);
+    // Phase 1 ranks the initial pixels by removing tightest clusters; phase 2
+    // ranks the rest by filling largest voids. Ulichney's phase 3 takes the
+    // tightest cluster of "off" pixels past half fill, which is the same pixel
+    // as the largest void: on a torus the two energies sum to a constant.
+    VoidAndCluster removing = field;
+    for (int rank = ones - 1; rank >= 0; --rank) {
+        int cluster = removing.tightestCluster();
+        removing.flip(cluster);
+        noise.ranks[cluster] = rank;
+    }
+    for (int rank = ones; rank < n; ++rank) {
+        int hole = field.largestVoid();
+        field.flip(hole);
+        noise.ranks[hole] = rank;
+    }
+    setBlueNoiseLevels(noise);
+    return noise;
+}
+
+inline string blueNoiseCacheDir() {
+    const char* dir = getenv("BLUE_NOISE_CACHE");
+    return dir && *dir ? dir : ".";
+}
+
+inline string blueNoisePath(const string& dir, int size) {
+    return dir + "/blue-noise-" + to_string(size) + ".pgm";
+}
+
+inline string blueNoiseHeader(int size) {
+    return "P5\n" + to_string(size) + " " + to_string(size) + "\n65535\n";
+}
+
+// False if the file is missing, of another size, or not a permutation.
+inline bool readBlueNoise(const string& path, int size, BlueNoise& noise) {
+    ifstream file(path, ios::binary);
+    string header = blueNoiseHeader(size);
+    size_t n = static_cast<size_t>(size) * size;
+    vector<uint8_t> bytes(header.size() + 2 * n);
+    if (!file.read(reinterpret_cast<char*>(bytes.data()), bytes.size()) || file.peek() != char_traits<char>::eof() ||
+        header.compare(0, header.size(), reinterpret_cast<const char*>(bytes.data()), header.size()) != 0) {
+        return false;
+    }
+    noise.size = size;
+    noise.ranks.resize(n);
+    vector<bool> seen(n, false);
+    for (size_t i = 0; i < n; ++i) {
+        uint16_t rank = bytes[header.size() + 2 * i] << 8 | bytes[header.size() + 2 * i + 1];
+        if (rank >= n || seen[rank]) return false;
+        seen[rank] = true;
+        noise.ranks[i] = rank;
+    }
+    setBlueNoiseLevels(noise);
+    return true;
+}
+
+// Written to a temporary file and renamed, so concurrent processes never see
+// a partial array.
+inline bool writeBlueNoise(const string& path, const BlueNoise& noise) {
+    string header = blueNoiseHeader(noise.size);
+    vector<uint8_t> bytes(header.begin(), header.end());
+    for (uint16_t rank : noise.ranks) {
+        bytes.push_back(rank >> 8);
+        bytes.push_back(rank & 0xFF);
+    }
+    string temporary = path + ".tmp" + to_string(getpid());
+    {
+        ofstream file(temporary, ios::binary);
+        if (!file.write(reinterpret_cast<const char*>(bytes.data()), bytes.size())) return false;
+    }
+    if (rename(temporary.c_str(), path.c_str()) != 0) {
+        remove(temporary.c_str());
+        return false;
+    }
+    return true;
+}
+
+// The array of the given size, loaded or generated once per process and
+// shared by all threads.
+inline const BlueNoise& blueNoise(int size, const string& cacheDir = blueNoiseCacheDir()) {
+    static mutex lock;
+    static map<int, unique_ptr<BlueNoise>> arrays;
+    lock_guard<mutex> guard(lock);
+    unique_ptr<BlueNoise>& noise = arrays[size];
+    if (!noise) {
+        if (!isBlueNoiseSize(size)) throw invalid_argument("blue-noise size must be a power of two from 16 to 256");
+        noise.reset(new BlueNoise);
+        string path = blueNoisePath(cacheDir, size);
+        if (!readBlueNoise(path, size, *noise)) {
+            *noise = generateBlueNoise(size);
+            if (!writeBlueNoise(path, *noise)) cerr << "cannot cache blue-noise array in " << path << endl;
+        }
+    }
+    return *noise;
+}
+
+// For a band of a larger image, firstRow is the band's row in it, which keeps
+// the band in phase with the array.
+template <typename Plane>
+void ditherBlueNoise(const uint8_t* input, const Plane& output, int width, int height, const BlueNoise& noise,
+                     int firstRow = 0) {
+    int mask = noise.size - 1;
+    forEachTile(width, height, 0, [&](const Tile& tile) {
+        for (int i = tile.y0; i < tile.y1; ++i) {
+            const uint8_t* levels = &noise.levels[((firstRow + i) & mask) * noise.size];
+            ditherRow(&input[i * width], output, i, levels, tile.x0, tile.x1, mask);
+        }
+    });
+}
+
+inline void ditherBlueNoise(const uint8_t* input, uint8_t* output, int width, int height, const BlueNoise& noise,
+                            int firstRow = 0) {
+    ditherBlueNoise(input, BytePlane{output, width}, width, height, noise, firstRow);
+}
+
+#endif
@@ -1,112 +1,136 @@
 #include <iostream>
 #include <fstream>
+#include <string>
 #include <vector>
 #include <random>
 #include <cstdint>
-#include <string>
+#include "dithering.h"
+#include "blue-noise.h"
+#include "../../common/raw-image.h"
+#include "../../common/bit-plane.h"
+#include "../../common/instrumentation.h"
+#include "../../common/frame-stream.h"
 
 using namespace std;
 
 const int WIDTH = 1280;
 const int HEIGHT = 852;
-const int IMAGE_SIZE = WIDTH * HEIGHT;
 
-bool readRawImage(const string& filename, vector<uint8_t>& buffer) {
-    ifstream file(filename, ios::binary);
-    file.read(reinterpret_cast<char*>(buffer.data()), IMAGE_SIZE);
-    return true;
-}
+// Frame sequences (see frame-stream.h) are rendered in blocks of this many
+// rows; with "reuse" a block none of whose rows changed keeps last frame's
+// output. 64 is a multiple of every Bayer size, so blocks start in phase with
+// the matrix and the output does not depend on which blocks are rendered.
+const int FRAME_BLOCK_ROWS = 64;
 
-bool writeRawImage(const string& filename, const vector<uint8_t>& buffer) {
-    ofstream file(filename, ios::binary);
-    file.write(reinterpret_cast<const char*>(buffer.data()), IMAGE_SIZE);
-    return true;
-}
-
-void fixedThresholding(const vector<uint8_t>& input, vector<uint8_t>& output, int T = 128) {
-    for (int i = 0; i < IMAGE_SIZE; ++i) {
-        output[i] = (input[i] < T) ? 0 : 255;
+// dithering frames <fixed|random|bayerN|bluenoiseN> <WxH|y4m> [input|-] [output|-] [reuse] [pbm]
+// bayerN is a Bayer matrix of size N = 2, 4, ..., 64 and bluenoiseN a blue-noise
+// array of size N = 16, ..., 256 (see blue-noise.h). Random thresholds use one
+// seed for the whole sequence, so a still area keeps its pattern.
+int runFrames(int argc, char* argv[]) {
+    if (argc < 4) {
+        cerr << "usage: " << argv[0] << " frames <fixed|random|bayerN|bluenoiseN> <WxH|y4m> [input|-] [output|-] [reuse] [pbm]"
+             << endl;
+        return -1;
     }
-}
+    string method = argv[2];
+    bool bayer = method.compare(0, 5, "bayer") == 0, bluenoise = method.compare(0, 9, "bluenoise") == 0;
+    int N = bayer ? atoi(method.c_str() + 5) : bluenoise ? atoi(method.c_str() + 9) : 0;
+    if (method != "fixed" && method != "random" && !(bayer && N >= 2 && N <= FRAME_BLOCK_ROWS && (N & (N - 1)) == 0) &&
+        !(bluenoise && isBlueNoiseSize(N))) {
+        cerr << "unknown method " << method << endl;
+        return -1;
+    }
+    bool reuse = false, packed = false;
+    vector<string> files;
+    for (int i = 4; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "reuse") reuse = true;
+        else if (arg == "pbm") packed = true;
+        else files.push_back(arg);
+    }
+    string inputName = files.size() > 0 ? files[0] : "-";
+    string outputName = files.size() > 1 ? files[1] : "-";
+    uint64_t seed = random_device()();
 
-void randomThresholding(const vector<uint8_t>& input, vector<uint8_t>& output) {
-    random_device rd;
-    mt19937 gen(rd());
-    uniform_int_distribution<> dist(0, 255);
-    
-    for (int i = 0; i < IMAGE_SIZE; ++i) {
-        int rand_val = dist(gen);
-        output[i] = (input[i] < rand_val) ? 0 : 255;
+    try {
+        const BlueNoise* noise = bluenoise ? &blueNoise(N) : nullptr;
+        FrameFormat format = parseFrameFormat(argv[3]);
+        ifstream inputFile;
+        ofstream outputFile;
+        if (inputName != "-") inputFile.open(inputName, ios::binary);
+        if (outputName != "-") outputFile.open(outputName, ios::binary);
+        if (inputName != "-" && !inputFile) throw runtime_error("cannot open " + inputName);
+        if (outputName != "-" && !outputFile) throw runtime_error("cannot create " + outputName);
+        istream& in = inputName == "-" ? cin : inputFile;
+        ostream& out = outputName == "-" ? cout : outputFile;
+
+        streamFrames(in, out, format, packed, reuse, [&](const Frame& frame, const auto& output) {
+            int rendered = 0;
+            frame.forEachChangedSpan(FRAME_BLOCK_ROWS, [&](int y0, int y1) {
+                const uint8_t* input = &frame.pixels[static_cast<size_t>(y0) * frame.width];
+                auto band = shiftRows(output, y0);
+                if (method == "fixed") fixedThresholding(input, band, frame.width, y1 - y0, 128);
+                else if (method == "random") randomThresholding(input, band, frame.width, y1 - y0, seed, y0);
+                else if (bluenoise) ditherBlueNoise(input, band, frame.width, y1 - y0, *noise, y0);
+                else ditherMatrix(input, band, frame.width, y1 - y0, N);
+                rendered += y1 - y0;
+            });
+            return rendered;
+        });
+    } catch (const exception& e) {
+        cerr << e.what() << endl;
+        return -1;
     }
+    return 0;
 }
 
-vector<vector<int>> generateBayerMatrix(int N) {
-    if (N == 2) {
-        return {{1, 2}, {3, 0}};
+int main(int argc, char* argv[]) {
+    INSTRUMENT_RUN("dithering");
+    if (argc > 1 && string(argv[1]) == "frames") {
+        return runFrames(argc, argv);
     }
-    int half = N / 2;
-    vector<vector<int>> In = generateBayerMatrix(half);
-    vector<vector<int>> I2n(N, vector<int>(N));
-    
-    for (int i = 0; i < half; ++i) {
-        for (int j = 0; j < half; ++j) {
-            int val = In[i][j];
-            I2n[i][j] = 4 * val + 1;
-            I2n[i][j + half] = 4 * val + 2;
-            I2n[i + half][j]= 4 * val + 3;
-            I2n[i + half][j + half] = 4 * val;
+    // "pbm" writes each result as a 1-bit PBM instead of a byte-per-pixel .raw.
+    bool pbm = argc > 1 && string(argv[1]) == "pbm";
+    try {
+        MappedFile inputImage;
+        {
+            STAGE_TIMER("read", WIDTH * HEIGHT);
+            inputImage = mapRawImage("Reflection.raw", WIDTH, HEIGHT, 1);
         }
-    }
-    return I2n;
-}
+        const uint8_t* input = inputImage.data();
 
-vector<vector<float>> generateThresholdMatrix(int N) {
-    vector<vector<int>> In = generateBayerMatrix(N);
-    vector<vector<float>> T(N, vector<float>(N));
-    float N_squared = N * N;
-    
-    for (int i = 0; i < N; ++i) {
-        for (int j = 0; j < N; ++j) {
-            T[i][j] = ((In[i][j] + 0.5f) / N_squared) * 255.0f;
+        // Each stage covers creating, filling and unmapping one output.
+        auto writeOutput = [&](const string& name, auto kernel) {
+            STAGE_TIMER(name, WIDTH * HEIGHT);
+            if (pbm) {
+                MappedFile output = createPbmImage(name + ".pbm", WIDTH, HEIGHT);
+                kernel(pbmPlane(output.data(), WIDTH, HEIGHT));
+            } else {
+                MappedFile output = createRawImage(name + ".raw", WIDTH, HEIGHT, 1);
+                kernel(BytePlane{output.data(), WIDTH});
+            }
+        };
+
+        writeOutput("1_fixed_threshold", [&](const auto& output) {
+            fixedThresholding(input, output, WIDTH, HEIGHT, 128);
+        });
+        writeOutput("2_random_threshold", [&](const auto& output) {
+            randomThresholding(input, output, WIDTH, HEIGHT);
+        });
+        for (int N : {2, 8, 32}) {
+            writeOutput("3_dither_I" + to_string(N), [&](const auto& output) {
+                ditherMatrix(input, output, WIDTH, HEIGHT, N);
+            });
         }
-    }
-    return T;
-}
-void ditherMatrix(const vector<uint8_t>& input, vector<uint8_t>& output, int N) {
-    vector<vector<float>> T = generateThresholdMatrix(N);
-    
-    for (int i = 0; i < HEIGHT; ++i) {
-        for (int j = 0; j < WIDTH; ++j) {
-            uint8_t F = input[i * WIDTH + j];
-            float threshold_val = T[i % N][j % N];
-            
-            output[i * WIDTH + j] = (F <= threshold_val) ? 0 : 255;
+        for (int N : {64, 256}) {
+            const BlueNoise& noise = blueNoise(N);
+            writeOutput("3_dither_blue_noise_" + to_string(N), [&](const auto& output) {
+                ditherBlueNoise(input, output, WIDTH, HEIGHT, noise);
+            });
         }
-    }
-}
-
-int main() {
-    vector<uint8_t> inputImage(IMAGE_SIZE);
-    
-    if (!readRawImage("Reflection.raw", inputImage)) {
+    } catch (const exception& e) {
+        cerr << e.what() << endl;
         return -1;
     }
-
-    vector<uint8_t> outputImage(IMAGE_SIZE);
-
-    fixedThresholding(inputImage, outputImage, 128);
-    writeRawImage("1_fixed_threshold.raw", outputImage);
-
-    randomThresholding(inputImage, outputImage);
-    writeRawImage("2_random_threshold.raw", outputImage);
-
-    ditherMatrix(inputImage, outputImage, 2);
-    writeRawImage("3_dither_I2.raw", outputImage);
-    
-    ditherMatrix(inputImage, outputImage, 8);
-    writeRawImage("3_dither_I8.raw", outputImage);
-    
-    ditherMatrix(inputImage, outputImage, 32);
-    writeRawImage("3_dither_I32.raw", outputImage);
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,237 @@
+#ifndef DITHERING_H
+#define DITHERING_H
+
+#include <vector>
+#include <random>
+#include <cstdint>
+#include "../../common/tile-scheduler.h"
+#include "../../common/bit-plane.h"
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+using namespace std;
+
+// Every kernel writes through a plane (see bit-plane.h), so it fills a byte
+// image or a packed 1-bit image directly; the pointer overloads write bytes.
+template <typename Plane>
+void fixedThresholding(const uint8_t* input, const Plane& output, int width, int height, int T = 128) {
+    forEachTile(width, height, 0, [&](const Tile& tile) {
+        for (int i = tile.y0; i < tile.y1; ++i) {
+            for (int j = tile.x0; j < tile.x1; ++j) {
+                output.set(j, i, input[i * width + j] >= T);
+            }
+        }
+    });
+}
+
+inline void fixedThresholding(const uint8_t* input, uint8_t* output, int width, int height, int T = 128) {
+    fixedThresholding(input, BytePlane{output, width}, width, height, T);
+}
+
+// Each tile row draws from the counter stream at its first pixel index, so a
+// given seed reproduces the same output for any tiling or thread count. For a
+// band of a larger image, firstRow is the band's row in it and the band draws
+// the same numbers as the whole image would.
+template <typename Plane>
+void randomThresholding(const uint8_t* input, const Plane& output, int width, int height,
+                        uint64_t seed = random_device()(), int firstRow = 0) {
+    forEachTile(width, height, 0, [&](const Tile& tile) {
+        for (int i = tile.y0; i < tile.y1; ++i) {
+            CounterRng rng(seed, static_cast<uint64_t>(firstRow + i) * width + tile.x0);
+            for (int j = tile.x0; j < tile.x1; ++j) {
+                int rand_val = rng.next() >> 24;
+                output.set(j, i, input[i * width + j] >= rand_val);
+            }
+        }
+    });
+}
+
+inline void randomThresholding(const uint8_t* input, uint8_t* output, int width, int height,
+                               uint64_t seed = random_device()(), int firstRow = 0) {
+    randomThresholding(input, BytePlane{output, width}, width, height, seed, firstRow);
+}
+
+inline vector<vector<int>> generateBayerMatrix(int N) {
+    if (N == 2) {
+        return {{1, 2}, {3, 0}};
+    }
+    int half = N / 2;
+    vector<vector<int>> In = generateBayerMatrix(half);
+    vector<vector<int>> I2n(N, vector<int>(N));
+    
+    for (int i = 0; i < half; ++i) {
+        for (int j = 0; j < half; ++j) {
+            int val = In[i][j];
+            I2n[i][j] = 4 * val + 1;
+            I2n[i][j + half] = 4 * val + 2;
+            I2n[i + half][j]= 4 * val + 3;
+            I2n[i + half][j + half] = 4 * val;
+        }
+    }
+    return I2n;
+}
+
+inline vector<vector<float>> generateThresholdMatrix(int N) {
+    vector<vector<int>> In = generateBayerMatrix(N);
+    vector<vector<float>> T(N, vector<float>(N));
+    float N_squared = N * N;
+    
+    for (int i = 0; i < N; ++i) {
+        for (int j = 0; j < N; ++j) {
+            T[i][j] = ((In[i][j] + 0.5f) / N_squared) * 255.0f;
+        }
+    }
+    return T;
+}
+template <typename Plane>
+void ditherMatrixGeneric(const uint8_t* input, const Plane& output, int width, int height, int N) {
+    vector<vector<float>> T = generateThresholdMatrix(N);
+    
+    forEachTile(width, height, 0, [&](const Tile& tile) {
+        for (int i = tile.y0; i < tile.y1; ++i) {
+            for (int j = tile.x0; j < tile.x1; ++j) {
+                uint8_t F = input[i * width + j];
+                float threshold_val = T[i % N][j % N];
+
+                output.set(j, i, F > threshold_val);
+            }
+        }
+    });
+}
+
+// Bayer tables for N = 2 .. 64 built at compile time. Since F is an integer,
+// F <= T[i][j] is the same test as F < floor(T[i][j]) + 1, so each entry holds
+// that first "on" level as a uint8 and a pixel is 255 iff F >= level. Rows are
+// repeated out to 64 columns so any 16-pixel run starting at a multiple of 16
+// reads its levels contiguously, and both indices reduce with bit masks. The
+// row functions take the column mask, so any table whose rows are a power of
+// two of at least 16 wide (such as a blue-noise array) runs through them.
+const int BAYER_ROW = 64;
+
+template <int N>
+struct BayerLevels {
+    uint8_t level[N * BAYER_ROW];
+};
+
+template <int N>
+constexpr BayerLevels<N> makeBayerLevels() {
+    static_assert(N >= 2 && N <= BAYER_ROW && (N & (N - 1)) == 0, "N must be a power of two up to 64");
+    int index[BAYER_ROW * BAYER_ROW] = {};
+    int next[BAYER_ROW * BAYER_ROW] = {};
+    index[0] = 1; index[1] = 2;
+    index[N] = 3; index[N + 1] = 0;
+    for (int half = 2; half < N; half *= 2) {
+        for (int i = 0; i < half; ++i) {
+            for (int j = 0; j < half; ++j) {
+                int val = index[i * N + j];
+                next[i * N + j] = 4 * val + 1;
+                next[i * N + j + half] = 4 * val + 2;
+                next[(i + half) * N + j] = 4 * val + 3;
+                next[(i + half) * N + j + half] = 4 * val;
+            }
+        }
+        for (int k = 0; k < N * N; ++k) {
+            index[k] = next[k];
+        }
+    }
+
+    BayerLevels<N> table = {};
+    float N_squared = N * N;
+    for (int i = 0; i < N; ++i) {
+        for (int j = 0; j < BAYER_ROW; ++j) {
+            float threshold_val = ((index[i * N + (j & (N - 1))] + 0.5f) / N_squared) * 255.0f;
+            table.level[i * BAYER_ROW + j] = static_cast<uint8_t>(static_cast<int>(threshold_val) + 1);
+        }
+    }
+    return table;
+}
+
+template <int N>
+constexpr BayerLevels<N> BAYER_LEVELS = makeBayerLevels<N>();
+
+inline void ditherRow(const uint8_t* in, uint8_t* out, const uint8_t* levels, int x0, int x1,
+                      int columnMask = BAYER_ROW - 1) {
+    int j = x0;
+    for (; j < x1 && (j & 15) != 0; ++j) {
+        out[j] = (in[j] >= levels[j & columnMask]) ? 255 : 0;
+    }
+#if defined(__SSE2__)
+    for (; j + 16 <= x1; j += 16) {
+        __m128i F = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + j));
+        __m128i L = _mm_loadu_si128(reinterpret_cast<const __m128i*>(levels + (j & columnMask)));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + j), _mm_cmpeq_epi8(_mm_max_epu8(F, L), F));
+    }
+#elif defined(__ARM_NEON)
+    for (; j + 16 <= x1; j += 16) {
+        vst1q_u8(out + j, vcgeq_u8(vld1q_u8(in + j), vld1q_u8(levels + (j & columnMask))));
+    }
+#endif
+    for (; j < x1; ++j) {
+        out[j] = (in[j] >= levels[j & columnMask]) ? 255 : 0;
+    }
+}
+
+// Bit-plane version: whole 16-pixel runs become two output bytes through
+// the SSE2 sign mask, the edges of the span go pixel by pixel.
+inline void ditherRow(const uint8_t* in, const BitPlane& out, int y, const uint8_t* levels, int x0, int x1,
+                      int columnMask = BAYER_ROW - 1) {
+    int j = x0;
+    for (; j < x1 && (j & 15) != 0; ++j) {
+        out.set(j, y, in[j] >= levels[j & columnMask]);
+    }
+#if defined(__SSE2__)
+    for (; j + 16 <= x1; j += 16) {
+        __m128i F = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + j));
+        __m128i L = _mm_loadu_si128(reinterpret_cast<const __m128i*>(levels + (j & columnMask)));
+        int on = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(F, L), F));
+        out.setEight(j, y, on & 0xFF);
+        out.setEight(j + 8, y, on >> 8);
+    }
+#endif
+    for (; j < x1; ++j) {
+        out.set(j, y, in[j] >= levels[j & columnMask]);
+    }
+}
+
+inline void ditherRow(const uint8_t* in, const BytePlane& out, int y, const uint8_t* levels, int x0, int x1,
+                      int columnMask = BAYER_ROW - 1) {
+    if (out.pixelStride == 1) {
+        ditherRow(in, out.data + y * out.rowStride, levels, x0, x1, columnMask);
+        return;
+    }
+    for (int j = x0; j < x1; ++j) {
+        out.set(j, y, in[j] >= levels[j & columnMask]);
+    }
+}
+
+template <int N, typename Plane>
+void ditherWithLevels(const uint8_t* input, const Plane& output, int width, int height) {
+    const uint8_t* table = BAYER_LEVELS<N>.level;
+    forEachTile(width, height, 0, [&](const Tile& tile) {
+        for (int i = tile.y0; i < tile.y1; ++i) {
+            ditherRow(&input[i * width], output, i, table + (i & (N - 1)) * BAYER_ROW, tile.x0, tile.x1);
+        }
+    });
+}
+
+template <typename Plane>
+void ditherMatrix(const uint8_t* input, const Plane& output, int width, int height, int N) {
+    switch (N) {
+        case 2: ditherWithLevels<2>(input, output, width, height); break;
+        case 4: ditherWithLevels<4>(input, output, width, height); break;
+        case 8: ditherWithLevels<8>(input, output, width, height); break;
+        case 16: ditherWithLevels<16>(input, output, width, height); break;
+        case 32: ditherWithLevels<32>(input, output, width, height); break;
+        case 64: ditherWithLevels<64>(input, output, width, height); break;
+        default: ditherMatrixGeneric(input, output, width, height, N); break;
+    }
+}
+
+inline void ditherMatrix(const uint8_t* input, uint8_t* output, int width, int height, int N) {
+    ditherMatrix(input, BytePlane{output, width}, width, height, N);
+}
+
+#endif
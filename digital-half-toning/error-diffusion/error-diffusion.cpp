@@ -3,6 +3,16 @@
 #include <vector>
 #include <cstdint>
 #include <string>
+#include <thread>
+#include <algorithm>
+#include <chrono>
+#include <atomic>
+#include "error-diffusion.h"
+#include "../../common/raw-image.h"
+#include "../../common/bit-plane.h"
+#include "../../common/tone-levels.h"
+#include "../../common/instrumentation.h"
+#include "../../common/frame-stream.h"
 
 using namespace std;
 
@@ -10,92 +20,254 @@ const int WIDTH = 1280;
 const int HEIGHT = 852;
 const int IMAGE_SIZE = WIDTH * HEIGHT;
 
-bool readRawImage(const string& filename, vector<uint8_t>& buffer) {
-    ifstream file(filename, ios::binary);
-    file.read(reinterpret_cast<char*>(buffer.data()), IMAGE_SIZE);
-    return true;
+// error-diffusion <stream|stream-pbm> <fs|jjn|stucki> <width> <height> [input|-] [output|-]
+int runStream(int argc, char* argv[], bool packed) {
+    if (argc < 5) {
+        cerr << "usage: " << argv[0] << " <stream|stream-pbm> <fs|jjn|stucki> <width> <height> [input|-] [output|-]" << endl;
+        return -1;
+    }
+    string kernelName = argv[2];
+    int width = stoi(argv[3]);
+    int height = stoi(argv[4]);
+    string inputName = argc > 5 ? argv[5] : "-";
+    string outputName = argc > 6 ? argv[6] : "-";
+
+    ifstream inputFile;
+    ofstream outputFile;
+    if (inputName != "-") inputFile.open(inputName, ios::binary);
+    if (outputName != "-") outputFile.open(outputName, ios::binary);
+    istream& in = inputName == "-" ? cin : inputFile;
+    ostream& out = outputName == "-" ? cout : outputFile;
+
+    STAGE_TIMER("stream", static_cast<uint64_t>(width) * height);
+    bool ok;
+    if (kernelName == "fs") {
+        ok = streamErrorDiffusion<FloydSteinbergKernel, true>(in, out, width, height, packed);
+    } else if (kernelName == "jjn") {
+        ok = streamErrorDiffusion<JarvisJudiceNinkeKernel, false>(in, out, width, height, packed);
+    } else if (kernelName == "stucki") {
+        ok = streamErrorDiffusion<StuckiKernel, false>(in, out, width, height, packed);
+    } else {
+        cerr << "unknown kernel " << kernelName << endl;
+        return -1;
+    }
+    out.flush();
+    return ok ? 0 : -1;
 }
 
-bool writeRawImage(const string& filename, const vector<uint8_t>& buffer) {
-    ofstream file(filename, ios::binary);
-    file.write(reinterpret_cast<const char*>(buffer.data()), IMAGE_SIZE);
-    return true;
+// Frame sequences (see frame-stream.h). Plain mode diffuses each frame as one
+// band, which is the serial scan. With "banded" the frames are cut into bands
+// with priming rows, and with "reuse" a band none of whose input rows changed
+// keeps last frame's output. A local change then only re-renders the bands it
+// touches, while in a serial scan it would alter the pattern, and make it
+// flicker, everywhere below it.
+template <typename Kernel, bool Serpentine>
+int diffuseFrames(istream& in, ostream& out, const FrameFormat& format, bool packed, bool reuse, bool banded) {
+    return streamFrames(in, out, format, packed, reuse, [&](const Frame& frame, const auto& output) {
+        int bandHeight = banded ? DEFAULT_BAND_HEIGHT : frame.height;
+        int primingRows = banded ? DEFAULT_PRIMING_ROWS : 0;
+        atomic<int> rendered(0);
+        forEachBand(frame.height, bandHeight, primingRows, [&](const Band& band) {
+            if (!frame.changed(band.start, band.y1)) return;
+            diffuseBand<Kernel, Serpentine>(frame.pixels.data(), output, frame.width, band);
+            rendered += band.y1 - band.y0;
+        });
+        return rendered.load();
+    });
 }
 
-void applyErrorDiffusion(const vector<uint8_t>& input, vector<uint8_t>& output, 
-                         const vector<vector<float>>& kernel, int cx, int cy, float divisor, bool serpentine) {
-    vector<float> buffer(IMAGE_SIZE);
-    for (int i = 0; i < IMAGE_SIZE; ++i) {
-        buffer[i] = static_cast<float>(input[i]);
+// error-diffusion frames <fs|jjn|stucki> <WxH|y4m> [input|-] [output|-] [banded] [reuse] [pbm]
+int runFrames(int argc, char* argv[]) {
+    if (argc < 4) {
+        cerr << "usage: " << argv[0] << " frames <fs|jjn|stucki> <WxH|y4m> [input|-] [output|-] [banded] [reuse] [pbm]"
+             << endl;
+        return -1;
     }
-    
-    int kernel_h = kernel.size();
-    int kernel_w = kernel[0].size();
-
-    for (int y = 0; y < HEIGHT; ++y) {
-        bool rtl = serpentine && (y % 2 != 0); 
-        int start_x = rtl ? WIDTH - 1 : 0;
-        int end_x   = rtl ? -1 : WIDTH;
-        int step_x  = rtl ? -1 : 1;
-
-        for (int x = start_x; x != end_x; x += step_x) {
-            float old_pixel = buffer[y * WIDTH + x];
-            uint8_t new_pixel = (old_pixel < 128.0f) ? 0 : 255;
-            output[y * WIDTH + x] = new_pixel;
-            
-            float error = old_pixel - new_pixel;
-
-            for (int ky = 0; ky < kernel_h; ++ky) {
-                for (int kx = 0; kx < kernel_w; ++kx) {
-                    float weight = kernel[ky][kx] / divisor;
-                    if (weight == 0.0f) continue;
-                    int oy = ky - cy;
-                    int ox = kx - cx;
-                    
-                    if (rtl) ox = -ox; 
-                    int ny = y + oy;
-                    int nx = x + ox;
-                    if (ny >= 0 && ny < HEIGHT && nx >= 0 && nx < WIDTH) {
-                        buffer[ny * WIDTH + nx] += error * weight;
-                    }
-                }
-            }
+    string kernelName = argv[2];
+    bool banded = false, reuse = false, packed = false;
+    vector<string> files;
+    for (int i = 4; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "banded") banded = true;
+        else if (arg == "reuse") reuse = true;
+        else if (arg == "pbm") packed = true;
+        else files.push_back(arg);
+    }
+    string inputName = files.size() > 0 ? files[0] : "-";
+    string outputName = files.size() > 1 ? files[1] : "-";
+
+    try {
+        FrameFormat format = parseFrameFormat(argv[3]);
+        ifstream inputFile;
+        ofstream outputFile;
+        if (inputName != "-") inputFile.open(inputName, ios::binary);
+        if (outputName != "-") outputFile.open(outputName, ios::binary);
+        if (inputName != "-" && !inputFile) throw runtime_error("cannot open " + inputName);
+        if (outputName != "-" && !outputFile) throw runtime_error("cannot create " + outputName);
+        istream& in = inputName == "-" ? cin : inputFile;
+        ostream& out = outputName == "-" ? cout : outputFile;
+
+        if (kernelName == "fs") {
+            diffuseFrames<FloydSteinbergKernel, true>(in, out, format, packed, reuse, banded);
+        } else if (kernelName == "jjn") {
+            diffuseFrames<JarvisJudiceNinkeKernel, false>(in, out, format, packed, reuse, banded);
+        } else if (kernelName == "stucki") {
+            diffuseFrames<StuckiKernel, false>(in, out, format, packed, reuse, banded);
+        } else {
+            cerr << "unknown kernel " << kernelName << endl;
+            return -1;
+        }
+    } catch (const exception& e) {
+        cerr << e.what() << endl;
+        return -1;
+    }
+    return 0;
+}
+
+template <typename Fn>
+double bestSeconds(int runs, Fn fn) {
+    double best = 1e30;
+    for (int r = 0; r < runs; ++r) {
+        auto start = chrono::steady_clock::now();
+        fn();
+        best = min(best, chrono::duration<double>(chrono::steady_clock::now() - start).count());
+    }
+    return best;
+}
+
+template <typename Kernel, bool Serpentine>
+void benchKernel(const string& name, const uint8_t* input, int numThreads) {
+    const int runs = 5;
+    vector<vector<float>> kernel = runtimeKernel<Kernel>();
+    vector<uint8_t> reference(IMAGE_SIZE), output(IMAGE_SIZE);
+    double runtimeSec = bestSeconds(runs, [&] {
+        applyErrorDiffusion(input, reference.data(), WIDTH, HEIGHT, kernel, Kernel::CX, Kernel::CY, Kernel::DIVISOR, Serpentine);
+    });
+    double templSec = bestSeconds(runs, [&] {
+        applyErrorDiffusion<Kernel, Serpentine>(input, output.data(), WIDTH, HEIGHT);
+    });
+    bool same = output == reference;
+    double parallelSec = bestSeconds(runs, [&] {
+        applyErrorDiffusion<Kernel, Serpentine>(input, output.data(), WIDTH, HEIGHT, numThreads);
+    });
+    same = same && output == reference;
+
+    double mpix = IMAGE_SIZE / 1e6;
+    cout << name << ": runtime " << mpix / runtimeSec << " Mpix/s, compile-time " << mpix / templSec
+         << " Mpix/s (" << runtimeSec / templSec << "x), wavefront x" << numThreads << " "
+         << mpix / parallelSec << " Mpix/s" << (same ? "" : "  MISMATCH") << endl;
+}
+
+// Seam sweep of the banded mode against the serial scan (see banded-diffusion.h).
+template <typename Kernel, bool Serpentine>
+void seamSweep(const string& name, const uint8_t* input) {
+    printSeamSweep(name, WIDTH, HEIGHT, 1,
+                   [&](uint8_t* output) { applyErrorDiffusion<Kernel, Serpentine>(input, output, WIDTH, HEIGHT); },
+                   [&](uint8_t* output, int bandHeight, int primingRows) {
+                       applyErrorDiffusionBanded<Kernel, Serpentine>(input, output, WIDTH, HEIGHT, bandHeight,
+                                                                     primingRows);
+                   });
+}
+
+// "fixed" selects the fixed-point kernels and "banded" the band-parallel mode.
+// The fixed-point kernels are binary only.
+template <typename Kernel, bool Serpentine, typename Plane>
+void diffuseVariant(const uint8_t* input, const Plane& output, const string& variant, int numThreads) {
+    if constexpr (!is_same<Plane, LevelPlane>::value) {
+        if (variant == "fixed") {
+            applyErrorDiffusionFixed<Kernel, Serpentine>(input, output, WIDTH, HEIGHT, numThreads);
+            return;
         }
     }
+    if (variant == "banded") applyErrorDiffusionBanded<Kernel, Serpentine>(input, output, WIDTH, HEIGHT);
+    else applyErrorDiffusion<Kernel, Serpentine>(input, output, WIDTH, HEIGHT, numThreads);
 }
 
-int main() {
-    vector<uint8_t> inputImage(IMAGE_SIZE);
-    
-    if (!readRawImage("Reflection.raw", inputImage)) {
+int main(int argc, char* argv[]) {
+    INSTRUMENT_RUN("error-diffusion");
+    string mode = argc > 1 ? argv[1] : "";
+    if (mode == "stream" || mode == "stream-pbm") {
+        return runStream(argc, argv, mode == "stream-pbm");
+    }
+    if (mode == "frames") {
+        return runFrames(argc, argv);
+    }
+
+    MappedFile inputImage;
+    try {
+        STAGE_TIMER("read", IMAGE_SIZE);
+        inputImage = mapRawImage("Reflection.raw", WIDTH, HEIGHT, 1);
+    } catch (const exception& e) {
+        cerr << e.what() << endl;
         return -1;
     }
+    const uint8_t* input = inputImage.data();
 
-    vector<uint8_t> outputImage(IMAGE_SIZE);
-    vector<vector<float>> fs_kernel = {
-        {0, 0, 0},
-        {0, 0, 7},
-        {3, 5, 1}
-    };
-    applyErrorDiffusion(inputImage, outputImage, fs_kernel, 1, 1, 16.0f, true);
-    writeRawImage("4_error_diffusion_FS_serpentine.raw", outputImage);
-    vector<vector<float>> jjn_kernel = {
-        {0, 0, 0, 0, 0},
-        {0, 0, 0, 0, 0},
-        {0, 0, 0, 7, 5},
-        {3, 5, 7, 5, 3},
-        {1, 3, 5, 3, 1}
-    };
-    applyErrorDiffusion(inputImage, outputImage, jjn_kernel, 2, 2, 48.0f, false);
-    writeRawImage("5_error_diffusion_JJN.raw", outputImage);
-    vector<vector<float>> stucki_kernel = {
-        {0, 0, 0, 0, 0},
-        {0, 0, 0, 0, 0},
-        {0, 0, 0, 8, 4},
-        {2, 4, 8, 4, 2},
-        {1, 2, 4, 2, 1}
-    };
-    applyErrorDiffusion(inputImage, outputImage, stucki_kernel, 2, 2, 42.0f, false);
-    writeRawImage("6_error_diffusion_Stucki.raw", outputImage);
+    int numThreads = max(1u, thread::hardware_concurrency());
+    if (argc > 1 && string(argv[1]) == "bench") {
+        benchKernel<FloydSteinbergKernel, true>("FS serpentine", input, numThreads);
+        benchKernel<JarvisJudiceNinkeKernel, false>("JJN", input, numThreads);
+        benchKernel<StuckiKernel, false>("Stucki", input, numThreads);
+        return 0;
+    }
+    if (argc > 1 && string(argv[1]) == "seams") {
+        seamSweep<FloydSteinbergKernel, true>("FS serpentine", input);
+        seamSweep<JarvisJudiceNinkeKernel, false>("JJN", input);
+        seamSweep<StuckiKernel, false>("Stucki", input);
+        return 0;
+    }
+
+    // "fixed" or "banded" selects a variant (see diffuseVariant) and "pbm"
+    // writes 1-bit PBMs; each result is written straight into its mapped
+    // output file. "L<N>" quantizes to N levels (see tone-levels.h), written
+    // as tones, or with "packed" as headerless packed rows.
+    string variant;
+    bool pbm = false, packed = false;
+    int levelCount = 0;
+    try {
+        for (int i = 1; i < argc; ++i) {
+            string arg = argv[i];
+            if (arg == "fixed" || arg == "banded") variant = arg;
+            if (levelsArg(arg)) levelCount = levelsArg(arg);
+            pbm = pbm || arg == "pbm";
+            packed = packed || arg == "packed";
+        }
+        if (levelCount && variant == "fixed") throw invalid_argument("the fixed variant has no multi-level mode");
+        ToneLevels levels = makeToneLevels(levelCount ? levelCount : 2);
+        // Each stage covers creating, filling and unmapping one output.
+        auto writeOutput = [&](const string& name, auto kernel) {
+            STAGE_TIMER(name, IMAGE_SIZE);
+            string base = name + (variant.empty() ? "" : "_" + variant);
+            if (levelCount) {
+                base += "_L" + to_string(levelCount);
+                if (packed) {
+                    MappedFile output = createPackedLevelImage(base + "_packed.raw", WIDTH, HEIGHT, levels);
+                    kernel(packedLevelPlane(output.data(), WIDTH, HEIGHT, levels));
+                } else {
+                    MappedFile output = createRawImage(base + ".raw", WIDTH, HEIGHT, 1);
+                    kernel(LevelPlane{output.data(), WIDTH, &levels});
+                }
+            } else if (pbm) {
+                MappedFile output = createPbmImage(base + ".pbm", WIDTH, HEIGHT);
+                kernel(pbmPlane(output.data(), WIDTH, HEIGHT));
+            } else {
+                MappedFile output = createRawImage(base + ".raw", WIDTH, HEIGHT, 1);
+                kernel(BytePlane{output.data(), WIDTH});
+            }
+        };
+
+        writeOutput("4_error_diffusion_FS_serpentine", [&](const auto& output) {
+            diffuseVariant<FloydSteinbergKernel, true>(input, output, variant, numThreads);
+        });
+        writeOutput("5_error_diffusion_JJN", [&](const auto& output) {
+            diffuseVariant<JarvisJudiceNinkeKernel, false>(input, output, variant, numThreads);
+        });
+        writeOutput("6_error_diffusion_Stucki", [&](const auto& output) {
+            diffuseVariant<StuckiKernel, false>(input, output, variant, numThreads);
+        });
+    } catch (const exception& e) {
+        cerr << e.what() << endl;
+        return -1;
+    }
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,528 @@
+#ifndef ERROR_DIFFUSION_H
+#define ERROR_DIFFUSION_H
+
+#include <iostream>
+#include <istream>
+#include <ostream>
+#include <vector>
+#include <cstdint>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <functional>
+#include <algorithm>
+#include <utility>
+#include <type_traits>
+#include "../../common/bit-plane.h"
+#include "../../common/tone-levels.h"
+#include "../../common/banded-diffusion.h"
+#include "../../common/buffer-pool.h"
+
+using namespace std;
+
+inline void diffuseSpan(float* buffer, uint8_t* output, int width, int height,
+                        const vector<vector<float>>& kernel, int cx, int cy, float divisor,
+                        int y, bool rtl, int from, int to) {
+    int kernel_h = kernel.size();
+    int kernel_w = kernel[0].size();
+
+    for (int pos = from; pos < to; ++pos) {
+        int x = rtl ? width - 1 - pos : pos;
+        float old_pixel = buffer[y * width + x];
+        uint8_t new_pixel = (old_pixel < 128.0f) ? 0 : 255;
+        output[y * width + x] = new_pixel;
+
+        float error = old_pixel - new_pixel;
+
+        for (int ky = 0; ky < kernel_h; ++ky) {
+            for (int kx = 0; kx < kernel_w; ++kx) {
+                float weight = kernel[ky][kx] / divisor;
+                if (weight == 0.0f) continue;
+                int oy = ky - cy;
+                int ox = kx - cx;
+
+                if (rtl) ox = -ox;
+                int ny = y + oy;
+                int nx = x + ox;
+                if (ny >= 0 && ny < height && nx >= 0 && nx < width) {
+                    buffer[ny * width + nx] += error * weight;
+                }
+            }
+        }
+    }
+}
+
+inline void applyErrorDiffusion(const uint8_t* input, uint8_t* output, int width, int height,
+                                const vector<vector<float>>& kernel, int cx, int cy, float divisor, bool serpentine) {
+    ScratchBuffer<float> buffer(width * height);
+    for (int i = 0; i < width * height; ++i) {
+        buffer[i] = static_cast<float>(input[i]);
+    }
+
+    for (int y = 0; y < height; ++y) {
+        bool rtl = serpentine && (y % 2 != 0);
+        diffuseSpan(buffer.data(), output, width, height, kernel, cx, cy, divisor, y, rtl, 0, width);
+    }
+}
+
+// Skewed wavefront over rows: row y is owned by thread y % numThreads and may
+// process a span once row y - 1 has finished every column within 2 * reach of
+// it. Every buffer cell then sees its reads and writes in the serial order, so
+// the result is bit-identical to the single-threaded scan. Spans are in scan
+// order (pos 0 is the first pixel visited in that row). A serpentine row
+// starts where the row above ended, so it needs all of that row and nothing
+// could overlap; serpentine scans run serially. A thread waiting on the row
+// above sleeps until that row advances.
+const int WAVEFRONT_CHUNK = 64;
+
+inline void runWavefront(int height, int width, int reach, bool serpentine, int numThreads,
+                  const function<void(int y, bool rtl, int from, int to)>& processSpan) {
+    numThreads = serpentine ? 1 : max(1, min(numThreads, height));
+    if (numThreads == 1) {
+        for (int y = 0; y < height; ++y) {
+            processSpan(y, serpentine && y % 2 != 0, 0, width);
+        }
+        return;
+    }
+    unique_ptr<atomic<int>[]> progress(new atomic<int>[height]);
+    for (int y = 0; y < height; ++y) {
+        progress[y].store(0, memory_order_relaxed);
+    }
+    mutex waitMutex;
+    condition_variable advanced;
+    atomic<int> waiting(0);
+
+    auto worker = [&](int t) {
+        for (int y = t; y < height; y += numThreads) {
+            for (int from = 0; from < width; from += WAVEFRONT_CHUNK) {
+                int to = min(from + WAVEFRONT_CHUNK, width);
+                if (y > 0) {
+                    int needed = min(width, to + 2 * reach);
+                    if (progress[y - 1].load(memory_order_acquire) < needed) {
+                        unique_lock<mutex> lock(waitMutex);
+                        waiting.fetch_add(1);
+                        advanced.wait(lock, [&] { return progress[y - 1].load() >= needed; });
+                        waiting.fetch_sub(1);
+                    }
+                }
+                processSpan(y, false, from, to);
+                // Sequentially consistent with the waiter's count and check,
+                // so either it sees this progress or this sees it waiting.
+                progress[y].store(to);
+                if (waiting.load() > 0) {
+                    lock_guard<mutex> lock(waitMutex);
+                    advanced.notify_all();
+                }
+            }
+        }
+    };
+
+    vector<thread> threads;
+    for (int t = 1; t < numThreads; ++t) {
+        threads.emplace_back(worker, t);
+    }
+    worker(0);
+    for (thread& th : threads) {
+        th.join();
+    }
+}
+
+// Compile-time diffusion kernels. A kernel is a type with constexpr H, W, CX, CY,
+// DIVISOR and WEIGHTS[H][W]; zero taps, the scan direction and the interior
+// bounds checks are resolved at compile time. Taps above the current row are
+// not supported (use the runtime-kernel path for those).
+struct FloydSteinbergKernel {
+    static constexpr int H = 3, W = 3, CX = 1, CY = 1;
+    static constexpr float DIVISOR = 16.0f;
+    static constexpr float WEIGHTS[H][W] = {
+        {0, 0, 0},
+        {0, 0, 7},
+        {3, 5, 1}
+    };
+};
+
+struct JarvisJudiceNinkeKernel {
+    static constexpr int H = 5, W = 5, CX = 2, CY = 2;
+    static constexpr float DIVISOR = 48.0f;
+    static constexpr float WEIGHTS[H][W] = {
+        {0, 0, 0, 0, 0},
+        {0, 0, 0, 0, 0},
+        {0, 0, 0, 7, 5},
+        {3, 5, 7, 5, 3},
+        {1, 3, 5, 3, 1}
+    };
+};
+
+struct StuckiKernel {
+    static constexpr int H = 5, W = 5, CX = 2, CY = 2;
+    static constexpr float DIVISOR = 42.0f;
+    static constexpr float WEIGHTS[H][W] = {
+        {0, 0, 0, 0, 0},
+        {0, 0, 0, 0, 0},
+        {0, 0, 0, 8, 4},
+        {2, 4, 8, 4, 2},
+        {1, 2, 4, 2, 1}
+    };
+};
+
+template <typename Kernel>
+constexpr int kernelReach() {
+    int reach = 0;
+    for (int ky = 0; ky < Kernel::H; ++ky) {
+        for (int kx = 0; kx < Kernel::W; ++kx) {
+            if (Kernel::WEIGHTS[ky][kx] != 0.0f) {
+                reach = max(reach, kx > Kernel::CX ? kx - Kernel::CX : Kernel::CX - kx);
+            }
+        }
+    }
+    return reach;
+}
+
+template <typename Kernel>
+constexpr bool kernelWritesAbove() {
+    for (int ky = 0; ky < Kernel::CY; ++ky) {
+        for (int kx = 0; kx < Kernel::W; ++kx) {
+            if (Kernel::WEIGHTS[ky][kx] != 0.0f) return true;
+        }
+    }
+    return false;
+}
+
+template <typename Kernel>
+vector<vector<float>> runtimeKernel() {
+    vector<vector<float>> kernel(Kernel::H, vector<float>(Kernel::W));
+    for (int ky = 0; ky < Kernel::H; ++ky) {
+        for (int kx = 0; kx < Kernel::W; ++kx) {
+            kernel[ky][kx] = Kernel::WEIGHTS[ky][kx];
+        }
+    }
+    return kernel;
+}
+
+// rows[d] points at image row y + d; rows past the bottom point at discard rows.
+template <typename Kernel, bool Rtl, bool Checked, size_t I>
+inline void diffuseTap(float* const* rows, int x, int width, float error) {
+    constexpr int ky = I / Kernel::W;
+    constexpr int kx = I % Kernel::W;
+    constexpr float weight = Kernel::WEIGHTS[ky][kx] / Kernel::DIVISOR;
+    if constexpr (weight != 0.0f) {
+        constexpr int ox = Rtl ? Kernel::CX - kx : kx - Kernel::CX;
+        int nx = x + ox;
+        if (!Checked || (nx >= 0 && nx < width)) {
+            rows[ky - Kernel::CY][nx] += error * weight;
+        }
+    }
+}
+
+template <typename Kernel, bool Rtl, bool Checked, size_t... I>
+inline void diffuseTaps(float* const* rows, int x, int width, float error, index_sequence<I...>) {
+    (diffuseTap<Kernel, Rtl, Checked, I>(rows, x, width, error), ...);
+}
+
+// The compile-time and fixed-point paths write row y of any plane (see
+// bit-plane.h), so packed 1-bit output is produced without a packing pass.
+// The compile-time path also takes a LevelPlane and then quantizes to its
+// levels (see tone-levels.h); the fixed-point path is binary only.
+//
+// Offsets, if given, is a row of per-pixel shifts added to the value the
+// quantizer sees but not to the error passed on, which moves the threshold
+// of each pixel (see edge-guided-diffusion.h). NoOffsets compiles it away.
+struct NoOffsets {};
+
+template <typename Kernel, bool Rtl, bool Checked, typename Plane, typename Offsets = NoOffsets>
+inline void diffusePixels(float* const* rows, const Plane& out, int y, int width, int from, int to,
+                          Offsets offsets = {}) {
+    for (int pos = from; pos < to; ++pos) {
+        int x = Rtl ? width - 1 - pos : pos;
+        float old_pixel = rows[0][x];
+        float decided = old_pixel;
+        if constexpr (!is_same<Offsets, NoOffsets>::value) decided += offsets[x];
+        float new_pixel = quantizeTo(out, x, y, decided);
+
+        float error = old_pixel - new_pixel;
+        diffuseTaps<Kernel, Rtl, Checked>(rows, x, width, error, make_index_sequence<Kernel::H * Kernel::W>{});
+    }
+}
+
+template <typename Kernel, bool Rtl, typename Plane, typename Offsets = NoOffsets>
+void diffuseKernelSpan(float* const* rows, const Plane& out, int y, int width, int from, int to,
+                       Offsets offsets = {}) {
+    static_assert(!kernelWritesAbove<Kernel>(), "compile-time kernels may not diffuse upwards");
+    constexpr int reach = kernelReach<Kernel>();
+    int interiorBegin = min(to, max(from, reach));
+    int interiorEnd = max(interiorBegin, min(to, width - reach));
+    diffusePixels<Kernel, Rtl, true>(rows, out, y, width, from, interiorBegin, offsets);
+    diffusePixels<Kernel, Rtl, false>(rows, out, y, width, interiorBegin, interiorEnd, offsets);
+    diffusePixels<Kernel, Rtl, true>(rows, out, y, width, interiorEnd, to, offsets);
+}
+
+template <typename Kernel, bool Serpentine, typename Plane>
+void applyErrorDiffusion(const uint8_t* input, const Plane& output, int width, int height,
+                         int numThreads = 1) {
+    constexpr int rowsBelow = Kernel::H - 1 - Kernel::CY;
+    ScratchBuffer<float> buffer((height + rowsBelow) * width);
+    for (int i = 0; i < width * height; ++i) {
+        buffer[i] = static_cast<float>(input[i]);
+    }
+    fill(buffer.begin() + width * height, buffer.end(), 0.0f);
+
+    auto processSpan = [&](int y, bool rtl, int from, int to) {
+        float* rows[rowsBelow + 1];
+        for (int d = 0; d <= rowsBelow; ++d) {
+            rows[d] = &buffer[(y + d) * width];
+        }
+        if (Serpentine && rtl) {
+            diffuseKernelSpan<Kernel, true>(rows, output, y, width, from, to);
+        } else {
+            diffuseKernelSpan<Kernel, false>(rows, output, y, width, from, to);
+        }
+    };
+    if (numThreads > 1) {
+        runWavefront(height, width, kernelReach<Kernel>(), Serpentine, numThreads, processSpan);
+    } else {
+        for (int y = 0; y < height; ++y) {
+            processSpan(y, Serpentine && (y % 2 != 0), 0, width);
+        }
+    }
+}
+
+template <typename Kernel, bool Serpentine>
+void applyErrorDiffusion(const uint8_t* input, uint8_t* output, int width, int height,
+                         int numThreads = 1) {
+    applyErrorDiffusion<Kernel, Serpentine>(input, BytePlane{output, width}, width, height, numThreads);
+}
+
+// Diffuses one band (see banded-diffusion.h): rows [band.start, band.y1) of
+// input, writing rows from band.y0 on. The band keeps only a ring of the rows
+// the kernel reaches, and rows keep their image parity for the serpentine
+// direction. Its output depends on no input outside those rows.
+template <typename Kernel, bool Serpentine, typename Plane>
+void diffuseBand(const uint8_t* input, const Plane& output, int width, const Band& band) {
+    constexpr int ringRows = Kernel::H - Kernel::CY;
+    vector<float> ring(ringRows * width);
+    vector<uint8_t> discarded(width);
+    auto primingOutput = scratchPlane(output, discarded.data());
+    // Rows past the band end stay zero, as rows past the image do.
+    auto load = [&](int y) {
+        float* row = &ring[(y % ringRows) * width];
+        for (int x = 0; x < width; ++x) {
+            row[x] = y < band.y1 ? static_cast<float>(input[y * width + x]) : 0.0f;
+        }
+    };
+    auto diffuse = [&](float* const* rows, const auto& plane, int y) {
+        if (Serpentine && y % 2 != 0) {
+            diffuseKernelSpan<Kernel, true>(rows, plane, y, width, 0, width);
+        } else {
+            diffuseKernelSpan<Kernel, false>(rows, plane, y, width, 0, width);
+        }
+    };
+
+    for (int y = band.start; y < band.start + ringRows; ++y) {
+        load(y);
+    }
+    for (int y = band.start; y < band.y1; ++y) {
+        float* rows[ringRows];
+        for (int d = 0; d < ringRows; ++d) {
+            rows[d] = &ring[((y + d) % ringRows) * width];
+        }
+        if (y < band.y0) diffuse(rows, primingOutput, y);
+        else diffuse(rows, output, y);
+        load(y + ringRows);
+    }
+}
+
+// Band-parallel mode; not bit-identical to the serial scan.
+template <typename Kernel, bool Serpentine, typename Plane>
+void applyErrorDiffusionBanded(const uint8_t* input, const Plane& output, int width, int height,
+                               int bandHeight = DEFAULT_BAND_HEIGHT, int primingRows = DEFAULT_PRIMING_ROWS) {
+    forEachBand(height, bandHeight, primingRows, [&](const Band& band) {
+        diffuseBand<Kernel, Serpentine>(input, output, width, band);
+    });
+}
+
+template <typename Kernel, bool Serpentine>
+void applyErrorDiffusionBanded(const uint8_t* input, uint8_t* output, int width, int height,
+                               int bandHeight = DEFAULT_BAND_HEIGHT, int primingRows = DEFAULT_PRIMING_ROWS) {
+    applyErrorDiffusionBanded<Kernel, Serpentine>(input, BytePlane{output, width}, width, height,
+                                                  bandHeight, primingRows);
+}
+
+// Fixed-point mode: the buffer holds int16 values in 1/16 units, half the size
+// of the float buffer. A tap's share of the error is e * w / DIVISOR, done as
+// a rounding shift when DIVISOR is a power of two (FS) and otherwise as a
+// multiply by a 16-bit reciprocal (JJN, Stucki). The last tap takes whatever
+// the others left, so each pixel passes on exactly its error.
+const int FIXED_SHIFT = 4;
+const int RECIPROCAL_SHIFT = 16;
+
+struct FixedTap {
+    int ox, oy, weight;
+};
+
+template <typename Kernel>
+struct FixedTapList {
+    FixedTap taps[Kernel::H * Kernel::W];
+    int count;
+};
+
+template <typename Kernel>
+constexpr FixedTapList<Kernel> makeFixedTaps() {
+    FixedTapList<Kernel> list = {};
+    for (int ky = 0; ky < Kernel::H; ++ky) {
+        for (int kx = 0; kx < Kernel::W; ++kx) {
+            int weight = static_cast<int>(Kernel::WEIGHTS[ky][kx]);
+            if (weight != 0) {
+                list.taps[list.count++] = {kx - Kernel::CX, ky - Kernel::CY, weight};
+            }
+        }
+    }
+    return list;
+}
+
+template <typename Kernel>
+constexpr int divisorShift() {
+    int divisor = static_cast<int>(Kernel::DIVISOR);
+    int shift = 0;
+    while ((1 << shift) < divisor) ++shift;
+    return (1 << shift) == divisor ? shift : -1;
+}
+
+template <typename Kernel>
+inline int fixedShare(int error, int weight) {
+    constexpr int shift = divisorShift<Kernel>();
+    if constexpr (shift >= 0) {
+        return (error * weight + (1 << shift >> 1)) >> shift;
+    } else {
+        constexpr int reciprocal = static_cast<int>((1 << RECIPROCAL_SHIFT) / Kernel::DIVISOR + 0.5f);
+        return (error * weight * reciprocal + (1 << (RECIPROCAL_SHIFT - 1))) >> RECIPROCAL_SHIFT;
+    }
+}
+
+template <typename Kernel, bool Rtl, bool Checked, typename Plane>
+inline void diffusePixelsFixed(int16_t* const* rows, const Plane& out, int y, int width, int from, int to) {
+    static constexpr FixedTapList<Kernel> list = makeFixedTaps<Kernel>();
+    const int threshold = 128 << FIXED_SHIFT;
+    const int full = 255 << FIXED_SHIFT;
+    for (int pos = from; pos < to; ++pos) {
+        int x = Rtl ? width - 1 - pos : pos;
+        int old_pixel = rows[0][x];
+        bool on = old_pixel >= threshold;
+        out.set(x, y, on);
+
+        int error = old_pixel - (on ? full : 0);
+        int left = error;
+        for (int t = 0; t < list.count; ++t) {
+            const FixedTap& tap = list.taps[t];
+            int share = t + 1 < list.count ? fixedShare<Kernel>(error, tap.weight) : left;
+            left -= share;
+            int nx = x + (Rtl ? -tap.ox : tap.ox);
+            if (!Checked || (nx >= 0 && nx < width)) {
+                rows[tap.oy][nx] += share;
+            }
+        }
+    }
+}
+
+template <typename Kernel, bool Rtl, typename Plane>
+void diffuseKernelSpanFixed(int16_t* const* rows, const Plane& out, int y, int width, int from, int to) {
+    static_assert(!kernelWritesAbove<Kernel>(), "compile-time kernels may not diffuse upwards");
+    constexpr int reach = kernelReach<Kernel>();
+    int interiorBegin = min(to, max(from, reach));
+    int interiorEnd = max(interiorBegin, min(to, width - reach));
+    diffusePixelsFixed<Kernel, Rtl, true>(rows, out, y, width, from, interiorBegin);
+    diffusePixelsFixed<Kernel, Rtl, false>(rows, out, y, width, interiorBegin, interiorEnd);
+    diffusePixelsFixed<Kernel, Rtl, true>(rows, out, y, width, interiorEnd, to);
+}
+
+template <typename Kernel, bool Serpentine, typename Plane>
+void applyErrorDiffusionFixed(const uint8_t* input, const Plane& output, int width, int height,
+                              int numThreads = 1) {
+    constexpr int rowsBelow = Kernel::H - 1 - Kernel::CY;
+    ScratchBuffer<int16_t> buffer((height + rowsBelow) * width);
+    for (int i = 0; i < width * height; ++i) {
+        buffer[i] = static_cast<int16_t>(input[i] << FIXED_SHIFT);
+    }
+    fill(buffer.begin() + width * height, buffer.end(), 0);
+
+    auto processSpan = [&](int y, bool rtl, int from, int to) {
+        int16_t* rows[rowsBelow + 1];
+        for (int d = 0; d <= rowsBelow; ++d) {
+            rows[d] = &buffer[(y + d) * width];
+        }
+        if (Serpentine && rtl) {
+            diffuseKernelSpanFixed<Kernel, true>(rows, output, y, width, from, to);
+        } else {
+            diffuseKernelSpanFixed<Kernel, false>(rows, output, y, width, from, to);
+        }
+    };
+    if (numThreads > 1) {
+        runWavefront(height, width, kernelReach<Kernel>(), Serpentine, numThreads, processSpan);
+    } else {
+        for (int y = 0; y < height; ++y) {
+            processSpan(y, Serpentine && (y % 2 != 0), 0, width);
+        }
+    }
+}
+
+template <typename Kernel, bool Serpentine>
+void applyErrorDiffusionFixed(const uint8_t* input, uint8_t* output, int width, int height,
+                              int numThreads = 1) {
+    applyErrorDiffusionFixed<Kernel, Serpentine>(input, BytePlane{output, width}, width, height, numThreads);
+}
+
+// Streaming mode: input rows are read as they are needed and each row is
+// written as soon as it is final, so only a ring of H - CY float rows is kept
+// regardless of the image height. With packed set the output is a PBM:
+// its header, then each row as width / 8 bytes.
+template <typename Kernel, bool Serpentine>
+bool streamErrorDiffusion(istream& in, ostream& out, int width, int height, bool packed = false) {
+    constexpr int ringRows = Kernel::H - Kernel::CY;
+    vector<float> ring(ringRows * width);
+    size_t rowBytes = packed ? pbmRowBytes(width) : width;
+    vector<uint8_t> rowIn(width), rowOut(rowBytes);
+    if (packed) {
+        string header = pbmHeader(width, height);
+        out.write(header.data(), header.size());
+    }
+    // A zero row stride sends every row into rowOut.
+    BytePlane byteRow{rowOut.data(), 0};
+    BitPlane bitRow{rowOut.data(), 0};
+
+    auto loadRow = [&](int y) {
+        if (!in.read(reinterpret_cast<char*>(rowIn.data()), width)) {
+            cerr << "input ended before row " << y << endl;
+            return false;
+        }
+        float* dst = &ring[(y % ringRows) * width];
+        for (int x = 0; x < width; ++x) {
+            dst[x] = static_cast<float>(rowIn[x]);
+        }
+        return true;
+    };
+
+    for (int y = 0; y < min(ringRows, height); ++y) {
+        if (!loadRow(y)) return false;
+    }
+    for (int y = 0; y < height; ++y) {
+        // Slots of rows past the bottom are never loaded or written out.
+        float* rows[ringRows];
+        for (int d = 0; d < ringRows; ++d) {
+            rows[d] = &ring[((y + d) % ringRows) * width];
+        }
+        bool rtl = Serpentine && y % 2 != 0;
+        if (packed && rtl) diffuseKernelSpan<Kernel, true>(rows, bitRow, y, width, 0, width);
+        else if (packed) diffuseKernelSpan<Kernel, false>(rows, bitRow, y, width, 0, width);
+        else if (rtl) diffuseKernelSpan<Kernel, true>(rows, byteRow, y, width, 0, width);
+        else diffuseKernelSpan<Kernel, false>(rows, byteRow, y, width, 0, width);
+        if (!out.write(reinterpret_cast<const char*>(rowOut.data()), rowBytes)) {
+            cerr << "failed to write row " << y << endl;
+            return false;
+        }
+        if (y + ringRows < height && !loadRow(y + ringRows)) return false;
+    }
+    return true;
+}
+
+#endif
@@ -0,0 +1,164 @@
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <complex>
+#include <cmath>
+#include <cstdint>
+#include <string>
+#include <iomanip>
+#include <algorithm>
+
+using namespace std;
+
+// Compares a candidate halftone (e.g. the fixed-point output) against a
+// reference (the float output) of the same input. Error diffusion amplifies
+// any rounding difference, so a plain pixel mismatch count is reported but
+// not judged; the verdict rests on the mean tone and on the radially averaged
+// power spectrum, which for a good halftone is blue noise: little power at
+// low frequencies and a flat plateau above the principal frequency.
+
+const int SPECTRUM_TILE = 128;
+const int SPECTRUM_BANDS = 16;
+const double MAX_TONE_DIFF = 0.5;
+const double MAX_SPECTRUM_DEVIATION = 0.10;
+
+bool readRawImage(const string& filename, vector<uint8_t>& buffer) {
+    ifstream file(filename, ios::binary | ios::ate);
+    if (!file || static_cast<size_t>(file.tellg()) != buffer.size()) {
+        cerr << filename << ": expected " << buffer.size() << " bytes" << endl;
+        return false;
+    }
+    file.seekg(0);
+    file.read(reinterpret_cast<char*>(buffer.data()), buffer.size());
+    return true;
+}
+
+void fft(vector<complex<double>>& a) {
+    int n = a.size();
+    for (int i = 1, j = 0; i < n; ++i) {
+        int bit = n >> 1;
+        for (; j & bit; bit >>= 1) j ^= bit;
+        j ^= bit;
+        if (i < j) swap(a[i], a[j]);
+    }
+    for (int len = 2; len <= n; len <<= 1) {
+        complex<double> step = polar(1.0, -2.0 * M_PI / len);
+        for (int i = 0; i < n; i += len) {
+            complex<double> w = 1.0;
+            for (int k = 0; k < len / 2; ++k) {
+                complex<double> u = a[i + k];
+                complex<double> v = a[i + k + len / 2] * w;
+                a[i + k] = u + v;
+                a[i + k + len / 2] = u - v;
+                w *= step;
+            }
+        }
+    }
+}
+
+// Radially averaged power spectrum of one channel, averaged over all whole
+// SPECTRUM_TILE x SPECTRUM_TILE tiles and grouped into SPECTRUM_BANDS bands
+// from DC to 0.5 cycles/pixel. Each tile has its mean removed first.
+vector<double> radialSpectrum(const vector<uint8_t>& image, int width, int height, int channels, int channel) {
+    const int n = SPECTRUM_TILE;
+    vector<double> power(SPECTRUM_BANDS, 0.0);
+    vector<int> counts(SPECTRUM_BANDS, 0);
+    vector<complex<double>> tile(n * n), line(n);
+
+    for (int ty = 0; ty + n <= height; ty += n) {
+        for (int tx = 0; tx + n <= width; tx += n) {
+            double mean = 0.0;
+            for (int y = 0; y < n; ++y) {
+                for (int x = 0; x < n; ++x) {
+                    double v = image[((ty + y) * width + tx + x) * channels + channel] / 255.0;
+                    tile[y * n + x] = v;
+                    mean += v;
+                }
+            }
+            mean /= n * n;
+            for (complex<double>& v : tile) v -= mean;
+            for (int y = 0; y < n; ++y) {
+                copy(tile.begin() + y * n, tile.begin() + (y + 1) * n, line.begin());
+                fft(line);
+                copy(line.begin(), line.end(), tile.begin() + y * n);
+            }
+            for (int x = 0; x < n; ++x) {
+                for (int y = 0; y < n; ++y) line[y] = tile[y * n + x];
+                fft(line);
+                for (int y = 0; y < n; ++y) tile[y * n + x] = line[y];
+            }
+            for (int v = 0; v < n; ++v) {
+                for (int u = 0; u < n; ++u) {
+                    double fu = (u < n / 2 ? u : u - n) / static_cast<double>(n);
+                    double fv = (v < n / 2 ? v : v - n) / static_cast<double>(n);
+                    double radius = sqrt(fu * fu + fv * fv);
+                    if (radius == 0.0 || radius >= 0.5) continue;
+                    int band = static_cast<int>(radius / 0.5 * SPECTRUM_BANDS);
+                    power[band] += norm(tile[v * n + u]) / (n * n);
+                    ++counts[band];
+                }
+            }
+        }
+    }
+    for (int b = 0; b < SPECTRUM_BANDS; ++b) {
+        if (counts[b] > 0) power[b] /= counts[b];
+    }
+    return power;
+}
+
+double meanTone(const vector<uint8_t>& image, int channels, int channel) {
+    double sum = 0.0;
+    for (size_t i = channel; i < image.size(); i += channels) sum += image[i];
+    return sum / (image.size() / channels);
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 6) {
+        cerr << "usage: " << argv[0] << " <width> <height> <channels> <reference.raw> <candidate.raw>" << endl;
+        return -1;
+    }
+    int width = stoi(argv[1]);
+    int height = stoi(argv[2]);
+    int channels = stoi(argv[3]);
+    vector<uint8_t> reference(static_cast<size_t>(width) * height * channels);
+    vector<uint8_t> candidate(reference.size());
+    if (!readRawImage(argv[4], reference) || !readRawImage(argv[5], candidate)) {
+        return -1;
+    }
+
+    bool pass = true;
+    cout << fixed << setprecision(4);
+    for (int c = 0; c < channels; ++c) {
+        size_t mismatches = 0;
+        for (size_t i = c; i < reference.size(); i += channels) {
+            if (reference[i] != candidate[i]) ++mismatches;
+        }
+        double refTone = meanTone(reference, channels, c);
+        double candTone = meanTone(candidate, channels, c);
+        vector<double> refSpectrum = radialSpectrum(reference, width, height, channels, c);
+        vector<double> candSpectrum = radialSpectrum(candidate, width, height, channels, c);
+
+        // Deviation is measured relative to the reference's mean power so that
+        // near-empty low-frequency bands do not dominate.
+        double meanPower = 0.0;
+        for (double p : refSpectrum) meanPower += p / SPECTRUM_BANDS;
+        double deviation = 0.0;
+        for (int b = 0; b < SPECTRUM_BANDS; ++b) {
+            deviation = max(deviation, fabs(candSpectrum[b] - refSpectrum[b]) / meanPower);
+        }
+
+        bool channelPass = fabs(refTone - candTone) <= MAX_TONE_DIFF && deviation <= MAX_SPECTRUM_DEVIATION;
+        pass = pass && channelPass;
+        cout << "channel " << c << ": mismatches " << mismatches << " ("
+             << 100.0 * mismatches / (reference.size() / channels) << "%), mean tone "
+             << refTone << " vs " << candTone << ", spectrum deviation " << deviation
+             << (channelPass ? "" : "  FAIL") << endl;
+        cout << "  band   cycles/px  reference   candidate" << endl;
+        for (int b = 0; b < SPECTRUM_BANDS; ++b) {
+            cout << "  " << setw(4) << b << "   " << setw(8) << (b + 0.5) * 0.5 / SPECTRUM_BANDS
+                 << "  " << setw(9) << refSpectrum[b] << "   " << setw(9) << candSpectrum[b] << endl;
+        }
+    }
+    cout << (pass ? "PASS" : "FAIL") << endl;
+    return pass ? 0 : 1;
+}
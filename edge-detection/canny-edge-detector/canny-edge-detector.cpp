@@ -2,19 +2,28 @@
 #include <iostream>
 #include <string>
 #include <vector>
+#include "canny-edge-detector.h"
+#include "../../common/instrumentation.h"
 
 using namespace std;
 using namespace cv;
 
-void applyAndSaveCanny(const Mat& grayImage, const string& baseName, double lowThresh, double highThresh) {
-    Mat edges;
-    Canny(grayImage, edges, lowThresh, highThresh);
-    string filename = baseName + "_Canny_" + to_string((int)lowThresh) + "_" + to_string((int)highThresh) + ".jpg";
-    bitwise_not(edges, edges);
-    imwrite(filename, edges);
+// Gradients and NMS run once per image; each pair then only costs its
+// share of the combined hysteresis pass.
+void applyAndSaveCanny(const Mat& grayImage, const string& baseName, const vector<pair<double, double>>& thresholds) {
+    CannyCandidates candidates = cannyCandidates(grayImage.ptr<uint8_t>(), grayImage.cols, grayImage.rows, grayImage.step);
+    vector<vector<uint8_t>> edgeMaps = cannyHysteresis(candidates, thresholds);
+    for (size_t k = 0; k < thresholds.size(); ++k) {
+        STAGE_TIMER("write", grayImage.total());
+        Mat edges(grayImage.rows, grayImage.cols, CV_8UC1, edgeMaps[k].data());
+        string filename = baseName + "_Canny_" + to_string((int)thresholds[k].first) + "_" + to_string((int)thresholds[k].second) + ".jpg";
+        bitwise_not(edges, edges);
+        imwrite(filename, edges);
+    }
 }
 
 int main() {
+    INSTRUMENT_RUN("canny-edge-detector");
     vector<string> imageNames = {"Bird.jpg", "Deer.jpg"};
 
     vector<pair<double, double>> thresholds = {
@@ -24,17 +33,23 @@ int main() {
     };
 
     for (const string& imgName : imageNames) {
-        Mat colorImg = imread(imgName, IMREAD_COLOR);
-        Mat grayImg;
-        cvtColor(colorImg, grayImg, COLOR_BGR2GRAY);
-        Mat blurredImg;
-        GaussianBlur(grayImg, blurredImg, Size(5, 5), 1.4);
+        Mat colorImg, grayImg, blurredImg;
+        {
+            STAGE_TIMER("read", 0);
+            colorImg = imread(imgName, IMREAD_COLOR);
+        }
+        {
+            STAGE_TIMER("grayscale", colorImg.total());
+            cvtColor(colorImg, grayImg, COLOR_BGR2GRAY);
+        }
+        {
+            STAGE_TIMER("blur", grayImg.total());
+            GaussianBlur(grayImg, blurredImg, Size(5, 5), 1.4);
+        }
 
         string baseName = imgName.substr(0, imgName.find_last_of("."));
 
-        for (const auto& thresh : thresholds) {
-            applyAndSaveCanny(blurredImg, baseName, thresh.first, thresh.second);
-        }
+        applyAndSaveCanny(blurredImg, baseName, thresholds);
     }
 
     return 0;
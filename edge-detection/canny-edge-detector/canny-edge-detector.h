@@ -0,0 +1,172 @@
+#ifndef CANNY_EDGE_DETECTOR_H
+#define CANNY_EDGE_DETECTOR_H
+
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <cstddef>
+#include <cstdlib>
+#include <algorithm>
+#include <utility>
+#include "../../common/tile-scheduler.h"
+#include "../../common/instrumentation.h"
+#include "../../common/buffer-pool.h"
+
+using namespace std;
+
+// Canny split into its threshold-independent part, run once per image, and
+// a hysteresis pass that handles many (low, high) pairs together. The steps
+// follow cv::Canny with aperture 3 and the L1 gradient: 3x3 Sobel with
+// replicated borders, |dx| + |dy| magnitude, zero magnitude outside the
+// image, the same 22.5/67.5 degree sector test (tan 22.5 in Q15) and the
+// same strict/non-strict neighbour comparisons, so every map equals
+// cv::Canny(gray, edges, low, high) pixel for pixel.
+
+// NMS survivors keep their magnitude; every other pixel holds 0. A pixel is
+// a weak edge for a pair when its value exceeds low and strong when it
+// exceeds high, which is all hysteresis needs.
+struct CannyCandidates {
+    int width = 0;
+    int height = 0;
+    vector<int32_t> magnitude;
+};
+
+const int CANNY_TG22 = 13573;  // tan(22.5 degrees) in Q15, rounded as in OpenCV
+
+inline CannyCandidates cannyCandidates(const uint8_t* gray, int width, int height, ptrdiff_t stride) {
+    STAGE_TIMER("candidates", width * height);
+    // Gradients for every pixel, and magnitudes in a buffer with a zero
+    // border one pixel wide so NMS can read its neighbours unchecked.
+    int paddedWidth = width + 2;
+    ScratchBuffer<int16_t> dx(width * height), dy(width * height);
+    ScratchBuffer<int32_t> padded(paddedWidth * (height + 2), 0);
+    forEachTile(width, height, 0, [&](const Tile& tile) {
+        for (int y = tile.y0; y < tile.y1; ++y) {
+            const uint8_t* above = gray + max(y - 1, 0) * stride;
+            const uint8_t* row = gray + y * stride;
+            const uint8_t* below = gray + min(y + 1, height - 1) * stride;
+            for (int x = tile.x0; x < tile.x1; ++x) {
+                int left = max(x - 1, 0);
+                int right = min(x + 1, width - 1);
+                int gx = (above[right] - above[left]) + 2 * (row[right] - row[left]) + (below[right] - below[left]);
+                int gy = (below[left] + 2 * below[x] + below[right]) - (above[left] + 2 * above[x] + above[right]);
+                dx[y * width + x] = static_cast<int16_t>(gx);
+                dy[y * width + x] = static_cast<int16_t>(gy);
+                padded[(y + 1) * paddedWidth + x + 1] = abs(gx) + abs(gy);
+            }
+        }
+    });
+
+    CannyCandidates candidates;
+    candidates.width = width;
+    candidates.height = height;
+    candidates.magnitude.assign(width * height, 0);
+    forEachTile(width, height, 0, [&](const Tile& tile) {
+        for (int y = tile.y0; y < tile.y1; ++y) {
+            const int32_t* magAbove = &padded[y * paddedWidth + 1];
+            const int32_t* mag = magAbove + paddedWidth;
+            const int32_t* magBelow = mag + paddedWidth;
+            for (int x = tile.x0; x < tile.x1; ++x) {
+                int m = mag[x];
+                if (m == 0) continue;
+                int xs = dx[y * width + x];
+                int ys = dy[y * width + x];
+                int ax = abs(xs);
+                int ay = abs(ys) << 15;
+                int tg22x = ax * CANNY_TG22;
+                bool peak;
+                if (ay < tg22x) {
+                    peak = m > mag[x - 1] && m >= mag[x + 1];
+                } else if (ay > tg22x + (ax << 16)) {
+                    peak = m > magAbove[x] && m >= magBelow[x];
+                } else {
+                    int s = (xs ^ ys) < 0 ? -1 : 1;
+                    peak = m > magAbove[x - s] && m > magBelow[x + s];
+                }
+                if (peak) candidates.magnitude[y * width + x] = m;
+            }
+        }
+    });
+    return candidates;
+}
+
+// Hysteresis for up to 64 pairs at once: bit k of a pixel's mask stands for
+// pair k. Strong pixels seed the fill and each step hands a neighbour the
+// bits it is weak for and does not have yet, so one flood fill answers every
+// pair and a pixel is revisited only when it gains new bits.
+inline void cannyHysteresisLanes(const CannyCandidates& candidates, const vector<pair<int, int>>& thresholds,
+                                 vector<vector<uint8_t>>& edges) {
+    int width = candidates.width;
+    int height = candidates.height;
+    int lanes = thresholds.size();
+    ScratchBuffer<uint64_t> weak(width * height, 0), edge(width * height, 0);
+    vector<int> stack;
+    for (int i = 0; i < width * height; ++i) {
+        int m = candidates.magnitude[i];
+        if (m == 0) continue;
+        uint64_t weakBits = 0, strongBits = 0;
+        for (int k = 0; k < lanes; ++k) {
+            if (m > thresholds[k].first) weakBits |= uint64_t(1) << k;
+            if (m > thresholds[k].second) strongBits |= uint64_t(1) << k;
+        }
+        weak[i] = weakBits;
+        if (strongBits) {
+            edge[i] = strongBits;
+            stack.push_back(i);
+        }
+    }
+
+    while (!stack.empty()) {
+        int i = stack.back();
+        stack.pop_back();
+        int x = i % width;
+        int y = i / width;
+        uint64_t bits = edge[i];
+        for (int ny = max(y - 1, 0); ny <= min(y + 1, height - 1); ++ny) {
+            for (int nx = max(x - 1, 0); nx <= min(x + 1, width - 1); ++nx) {
+                int n = ny * width + nx;
+                uint64_t gained = bits & weak[n] & ~edge[n];
+                if (gained) {
+                    edge[n] |= gained;
+                    stack.push_back(n);
+                }
+            }
+        }
+    }
+
+    for (int k = 0; k < lanes; ++k) {
+        edges[k].resize(width * height);
+        for (int i = 0; i < width * height; ++i) {
+            edges[k][i] = (edge[i] >> k) & 1 ? 255 : 0;
+        }
+    }
+}
+
+// Returns one edge map (255 = edge) per (low, high) pair. Thresholds are
+// ordered and floored as cv::Canny does for the L1 gradient.
+inline vector<vector<uint8_t>> cannyHysteresis(const CannyCandidates& candidates,
+                                               const vector<pair<double, double>>& thresholds) {
+    STAGE_TIMER("hysteresis", static_cast<uint64_t>(candidates.width) * candidates.height * thresholds.size());
+    vector<pair<int, int>> integer;
+    for (const auto& thresh : thresholds) {
+        double low = min(thresh.first, thresh.second);
+        double high = max(thresh.first, thresh.second);
+        integer.push_back({static_cast<int>(floor(low)), static_cast<int>(floor(high))});
+    }
+
+    const int LANES = 64;
+    int numGroups = (integer.size() + LANES - 1) / LANES;
+    vector<vector<uint8_t>> edges(integer.size());
+    sharedPool().run(numGroups, [&](int group) {
+        int begin = group * LANES;
+        int end = min<int>(begin + LANES, integer.size());
+        vector<vector<uint8_t>> groupEdges(end - begin);
+        cannyHysteresisLanes(candidates, vector<pair<int, int>>(integer.begin() + begin, integer.begin() + end), groupEdges);
+        for (int k = begin; k < end; ++k) {
+            edges[k] = move(groupEdges[k - begin]);
+        }
+    });
+    return edges;
+}
+
+#endif
@@ -0,0 +1,554 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <algorithm>
+#include <stdexcept>
+#include <zlib.h>
+#include "../../common/tile-scheduler.h"
+#include "../../common/raw-image.h"
+#include "../../common/instrumentation.h"
+#ifdef HAVE_OPENCV
+#include <opencv2/opencv.hpp>
+#endif
+
+using namespace std;
+
+// Native port of performanceevaluation.m. For every image, each detector's
+// edge map is scored against every ground-truth annotation at 50 thresholds
+// and the threshold with the best F of the mean precision and recall wins.
+// Instead of re-thresholding the whole image per threshold and annotation,
+// one pass histograms the 8-bit edge strength over all pixels and over each
+// annotation's boundary pixels; every threshold then reads TP, FP and FN off
+// prefix sums of those histograms.
+//
+//   boundary-evaluation convert <name>_GT.mat <name>_GT.gtb
+//   boundary-evaluation [--curves] <name> [<name> ...]
+//
+// evaluate reads <name>_GT.gtb and the maps <name>_Sobel_prob.png,
+// <name>_Canny_binary.jpg and <name>_SE_prob.png (or .raw files with the GT
+// geometry in their place), images in parallel.
+
+const double MATLAB_EPS = 2.220446049250313e-16;
+const int NUM_THRESHOLDS = 50;
+
+// ---- Compact ground truth: "GTB1", uint32 width, height, count, then count
+// row-major boundary masks packed 8 pixels per byte, LSB first.
+
+struct GroundTruth {
+    int width = 0;
+    int height = 0;
+    vector<vector<uint8_t>> boundaries;  // one 0/1 mask per annotation
+};
+
+void writeGroundTruth(const string& filename, const GroundTruth& gt) {
+    ofstream file(filename, ios::binary);
+    uint32_t header[3] = {static_cast<uint32_t>(gt.width), static_cast<uint32_t>(gt.height),
+                          static_cast<uint32_t>(gt.boundaries.size())};
+    file.write("GTB1", 4);
+    file.write(reinterpret_cast<const char*>(header), sizeof(header));
+    size_t pixels = static_cast<size_t>(gt.width) * gt.height;
+    for (const vector<uint8_t>& mask : gt.boundaries) {
+        vector<uint8_t> packed((pixels + 7) / 8, 0);
+        for (size_t i = 0; i < pixels; ++i) {
+            if (mask[i]) packed[i / 8] |= 1 << (i % 8);
+        }
+        file.write(reinterpret_cast<const char*>(packed.data()), packed.size());
+    }
+    if (!file) throw runtime_error("failed to write " + filename);
+}
+
+GroundTruth readGroundTruth(const string& filename) {
+    STAGE_TIMER("read-gt", 0);
+    MappedFile file = MappedFile::openRead(filename);
+    const uint8_t* data = file.data();
+    uint32_t header[3];
+    if (file.size() < 16 || memcmp(data, "GTB1", 4) != 0) throw runtime_error(filename + " is not a GTB1 file");
+    memcpy(header, data + 4, sizeof(header));
+
+    GroundTruth gt;
+    gt.width = header[0];
+    gt.height = header[1];
+    size_t pixels = static_cast<size_t>(gt.width) * gt.height;
+    size_t packedSize = (pixels + 7) / 8;
+    if (file.size() != 16 + packedSize * header[2]) throw runtime_error(filename + " is truncated");
+    for (uint32_t g = 0; g < header[2]; ++g) {
+        const uint8_t* packed = data + 16 + g * packedSize;
+        vector<uint8_t> mask(pixels);
+        for (size_t i = 0; i < pixels; ++i) {
+            mask[i] = (packed[i / 8] >> (i % 8)) & 1;
+        }
+        gt.boundaries.push_back(move(mask));
+    }
+    return gt;
+}
+
+// ---- Minimal MAT v5 reader, enough for the BSDS groundTruth layout: a cell
+// (or struct array) of structs whose Boundaries field is a numeric matrix.
+
+enum MatType { MI_INT8 = 1, MI_UINT8 = 2, MI_INT16 = 3, MI_UINT16 = 4, MI_INT32 = 5, MI_UINT32 = 6,
+               MI_SINGLE = 7, MI_DOUBLE = 9, MI_INT64 = 12, MI_UINT64 = 13, MI_MATRIX = 14, MI_COMPRESSED = 15 };
+enum MatClass { MX_CELL = 1, MX_STRUCT = 2 };
+
+struct MatArray {
+    int mxClass = 0;
+    vector<int> dims;
+    string name;
+    vector<double> real;
+    vector<string> fieldNames;
+    vector<MatArray> children;  // cell elements, or struct fields element by element
+};
+
+struct MatElement {
+    uint32_t type;
+    const uint8_t* data;
+    size_t size;
+};
+
+class MatReader {
+public:
+    MatReader(const uint8_t* begin, const uint8_t* end) : pos(begin), end(end) {}
+
+    bool atEnd() const { return pos >= end; }
+
+    MatElement next() {
+        if (end - pos < 8) throw runtime_error("truncated MAT element");
+        uint32_t word0, word1;
+        memcpy(&word0, pos, 4);
+        memcpy(&word1, pos + 4, 4);
+        MatElement element;
+        if (word0 >> 16) {
+            // Small data element: type, size and up to 4 bytes share 8 bytes.
+            element = {word0 & 0xFFFF, pos + 4, word0 >> 16};
+            pos += 8;
+            return element;
+        }
+        element = {word0, pos + 8, word1};
+        if (static_cast<size_t>(end - element.data) < element.size) throw runtime_error("truncated MAT element");
+        // Compressed elements are not padded to 8 bytes.
+        size_t padded = word0 == MI_COMPRESSED ? element.size : (element.size + 7) / 8 * 8;
+        pos = element.data + min(padded, static_cast<size_t>(end - element.data));
+        return element;
+    }
+
+private:
+    const uint8_t* pos;
+    const uint8_t* end;
+};
+
+vector<uint8_t> inflateElement(const MatElement& element) {
+    vector<uint8_t> out(max<size_t>(element.size * 4, 1024));
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if (inflateInit(&stream) != Z_OK) throw runtime_error("inflateInit failed");
+    stream.next_in = const_cast<Bytef*>(element.data);
+    stream.avail_in = element.size;
+    int status = Z_OK;
+    while (status != Z_STREAM_END) {
+        if (stream.total_out == out.size()) out.resize(out.size() * 2);
+        stream.next_out = out.data() + stream.total_out;
+        stream.avail_out = out.size() - stream.total_out;
+        status = inflate(&stream, Z_NO_FLUSH);
+        if (status != Z_OK && status != Z_STREAM_END) {
+            inflateEnd(&stream);
+            throw runtime_error("corrupt compressed MAT element");
+        }
+    }
+    out.resize(stream.total_out);
+    inflateEnd(&stream);
+    return out;
+}
+
+template <typename T>
+void appendValues(const MatElement& element, vector<double>& values) {
+    for (size_t i = 0; i + sizeof(T) <= element.size; i += sizeof(T)) {
+        T value;
+        memcpy(&value, element.data + i, sizeof(T));
+        values.push_back(static_cast<double>(value));
+    }
+}
+
+void readValues(const MatElement& element, vector<double>& values) {
+    switch (element.type) {
+        case MI_INT8: appendValues<int8_t>(element, values); break;
+        case MI_UINT8: appendValues<uint8_t>(element, values); break;
+        case MI_INT16: appendValues<int16_t>(element, values); break;
+        case MI_UINT16: appendValues<uint16_t>(element, values); break;
+        case MI_INT32: appendValues<int32_t>(element, values); break;
+        case MI_UINT32: appendValues<uint32_t>(element, values); break;
+        case MI_SINGLE: appendValues<float>(element, values); break;
+        case MI_DOUBLE: appendValues<double>(element, values); break;
+        case MI_INT64: appendValues<int64_t>(element, values); break;
+        case MI_UINT64: appendValues<uint64_t>(element, values); break;
+        default: throw runtime_error("unsupported MAT data type " + to_string(element.type));
+    }
+}
+
+MatArray parseMatrix(const MatElement& element) {
+    MatArray array;
+    if (element.size == 0) return array;
+    MatReader reader(element.data, element.data + element.size);
+    MatElement flags = reader.next();
+    array.mxClass = flags.data[0];
+    MatElement dims = reader.next();
+    for (size_t i = 0; i + 4 <= dims.size; i += 4) {
+        int32_t dim;
+        memcpy(&dim, dims.data + i, 4);
+        array.dims.push_back(dim);
+    }
+    MatElement name = reader.next();
+    array.name.assign(reinterpret_cast<const char*>(name.data), name.size);
+
+    size_t count = 1;
+    for (int dim : array.dims) {
+        count *= dim;
+    }
+    if (array.mxClass == MX_CELL) {
+        for (size_t i = 0; i < count; ++i) {
+            array.children.push_back(parseMatrix(reader.next()));
+        }
+    } else if (array.mxClass == MX_STRUCT) {
+        MatElement nameLength = reader.next();
+        int32_t length;
+        memcpy(&length, nameLength.data, 4);
+        MatElement names = reader.next();
+        for (size_t offset = 0; offset + length <= names.size; offset += length) {
+            const char* field = reinterpret_cast<const char*>(names.data + offset);
+            array.fieldNames.push_back(string(field, strnlen(field, length)));
+        }
+        for (size_t i = 0; i < count * array.fieldNames.size(); ++i) {
+            array.children.push_back(parseMatrix(reader.next()));
+        }
+    } else if (!reader.atEnd()) {
+        readValues(reader.next(), array.real);  // imaginary parts are ignored
+    }
+    return array;
+}
+
+// Reads the Boundaries of every annotation in a BSDS-style <name>_GT.mat.
+GroundTruth readGroundTruthMat(const string& filename) {
+    MappedFile file = MappedFile::openRead(filename);
+    if (file.size() < 128 || file.data()[126] != 'I' || file.data()[127] != 'M') {
+        throw runtime_error(filename + " is not a little-endian MAT v5 file");
+    }
+
+    vector<MatArray> variables;
+    MatReader reader(file.data() + 128, file.data() + file.size());
+    while (!reader.atEnd()) {
+        MatElement element = reader.next();
+        if (element.type == MI_COMPRESSED) {
+            vector<uint8_t> inflated = inflateElement(element);
+            MatReader inner(inflated.data(), inflated.data() + inflated.size());
+            while (!inner.atEnd()) {
+                MatElement matrix = inner.next();
+                if (matrix.type == MI_MATRIX) variables.push_back(parseMatrix(matrix));
+            }
+        } else if (element.type == MI_MATRIX) {
+            variables.push_back(parseMatrix(element));
+        }
+    }
+
+    auto found = find_if(variables.begin(), variables.end(), [](const MatArray& v) { return v.name == "groundTruth"; });
+    if (found == variables.end()) throw runtime_error(filename + " has no groundTruth variable");
+
+    vector<const MatArray*> structs;
+    if (found->mxClass == MX_CELL) {
+        for (const MatArray& cell : found->children) {
+            structs.push_back(&cell);
+        }
+    } else {
+        structs.push_back(&*found);
+    }
+
+    GroundTruth gt;
+    for (const MatArray* s : structs) {
+        size_t numFields = s->fieldNames.size();
+        size_t field = find(s->fieldNames.begin(), s->fieldNames.end(), "Boundaries") - s->fieldNames.begin();
+        if (s->mxClass != MX_STRUCT || field == numFields) throw runtime_error(filename + ": annotation without Boundaries");
+        for (size_t e = 0; e * numFields < s->children.size(); ++e) {
+            const MatArray& boundaries = s->children[e * numFields + field];
+            if (boundaries.dims.size() != 2) throw runtime_error(filename + ": Boundaries must be 2-D");
+            int rows = boundaries.dims[0];
+            int cols = boundaries.dims[1];
+            if (gt.boundaries.empty()) {
+                gt.width = cols;
+                gt.height = rows;
+            } else if (cols != gt.width || rows != gt.height) {
+                throw runtime_error(filename + ": annotations differ in size");
+            }
+            // MATLAB stores column-major.
+            vector<uint8_t> mask(static_cast<size_t>(rows) * cols);
+            for (int x = 0; x < cols; ++x) {
+                for (int y = 0; y < rows; ++y) {
+                    mask[y * cols + x] = boundaries.real[x * rows + y] != 0.0;
+                }
+            }
+            gt.boundaries.push_back(move(mask));
+        }
+    }
+    return gt;
+}
+
+// ---- Evaluation
+
+struct Detector {
+    string name;
+    string suffix;  // file name after "<image>_", without extension
+    string extension;
+    bool binary;
+};
+
+const vector<Detector> DETECTORS = {
+    {"Sobel", "Sobel_prob", ".png", false},
+    {"Canny", "Canny_binary", ".jpg", true},
+    {"SE", "SE_prob", ".png", false},
+};
+
+struct CurvePoint {
+    double threshold;
+    double meanPrecision;
+    double meanRecall;
+    double f;
+};
+
+struct DetectorResult {
+    vector<CurvePoint> curve;
+    int best = 0;
+    vector<double> bestPrecision;
+    vector<double> bestRecall;
+};
+
+struct ImageResult {
+    string name;
+    string report;
+    string error;
+    vector<DetectorResult> detectors;
+};
+
+// Stored maps are inverted (white background, black edges); the strength is
+// E = 1 - v / 255, so every threshold t selects a prefix v <= vmax(t) of the
+// 8-bit values. No value of E can equal a threshold 0.01 + 0.02k, so the
+// prefix is the same however t is rounded.
+vector<uint8_t> readEdgeMap(const string& base, const Detector& detector, int width, int height) {
+    STAGE_TIMER("read", width * height);
+    string rawName = base + ".raw";
+    if (ifstream(rawName).good()) {
+        MappedFile raw = mapRawImage(rawName, width, height, 1);
+        return vector<uint8_t>(raw.data(), raw.data() + raw.size());
+    }
+#ifdef HAVE_OPENCV
+    string imageName = base + detector.extension;
+    cv::Mat image = cv::imread(imageName, cv::IMREAD_GRAYSCALE);
+    if (image.empty()) throw runtime_error("cannot read " + imageName);
+    if (image.cols != width || image.rows != height) throw runtime_error(imageName + " does not match the GT size");
+    vector<uint8_t> pixels;
+    for (int y = 0; y < height; ++y) {
+        pixels.insert(pixels.end(), image.ptr<uint8_t>(y), image.ptr<uint8_t>(y) + width);
+    }
+    return pixels;
+#else
+    throw runtime_error("cannot read " + rawName + " (" + detector.extension + " input needs -DHAVE_OPENCV)");
+#endif
+}
+
+DetectorResult evaluateDetector(const vector<uint8_t>& edgeMap, const GroundTruth& gt, bool binary) {
+    STAGE_TIMER("evaluate", edgeMap.size());
+    // Prefix sums over v of all pixels and of each annotation's boundary pixels.
+    int numGTs = gt.boundaries.size();
+    vector<int64_t> all(257, 0);
+    vector<vector<int64_t>> onBoundary(numGTs, vector<int64_t>(257, 0));
+    for (size_t i = 0; i < edgeMap.size(); ++i) {
+        ++all[edgeMap[i] + 1];
+        for (int g = 0; g < numGTs; ++g) {
+            onBoundary[g][edgeMap[i] + 1] += gt.boundaries[g][i];
+        }
+    }
+    for (int v = 1; v <= 256; ++v) {
+        all[v] += all[v - 1];
+        for (int g = 0; g < numGTs; ++g) {
+            onBoundary[g][v] += onBoundary[g][v - 1];
+        }
+    }
+
+    // Binary maps are read as E > 0.5 and reported at t = 0.5.
+    vector<double> thresholds;
+    if (binary) {
+        thresholds.push_back(0.5);
+    } else {
+        for (int k = 0; k < NUM_THRESHOLDS; ++k) {
+            thresholds.push_back(0.01 + 0.02 * k);
+        }
+    }
+
+    DetectorResult result;
+    double bestF = 0.0;
+    for (size_t k = 0; k < thresholds.size(); ++k) {
+        double t = thresholds[k];
+        int selected = 0;  // number of leading v values with E selected
+        while (selected < 256 && (binary ? 1.0 - selected / 255.0 > 0.5 : 1.0 - selected / 255.0 >= t)) {
+            ++selected;
+        }
+        vector<double> precision(numGTs), recall(numGTs);
+        double meanP = 0.0, meanR = 0.0;
+        for (int g = 0; g < numGTs; ++g) {
+            double tp = onBoundary[g][selected];
+            double fp = all[selected] - tp;
+            double fn = onBoundary[g][256] - tp;
+            precision[g] = tp / max(MATLAB_EPS, tp + fp);
+            recall[g] = tp / max(MATLAB_EPS, tp + fn);
+            meanP += precision[g] / numGTs;
+            meanR += recall[g] / numGTs;
+        }
+        double f = 2 * (meanP * meanR) / max(MATLAB_EPS, meanP + meanR);
+        result.curve.push_back({t, meanP, meanR, f});
+        if (f >= bestF) {
+            bestF = f;
+            result.best = k;
+            result.bestPrecision = precision;
+            result.bestRecall = recall;
+        }
+    }
+    return result;
+}
+
+string formatReport(const string& imageName, const vector<DetectorResult>& results) {
+    ostringstream out;
+    char line[128];
+    out << "=== Evaluation for " << imageName << " ===\n\n";
+    for (size_t d = 0; d < DETECTORS.size(); ++d) {
+        const DetectorResult& r = results[d];
+        snprintf(line, sizeof(line), "--- %s Detector (threshold %.2f) ---\n", DETECTORS[d].name.c_str(),
+                 r.curve[r.best].threshold);
+        out << line;
+        snprintf(line, sizeof(line), "%-8s | %-12s | %-12s | %-12s\n", "GT Index", "Precision", "Recall", "F-Measure");
+        out << line;
+        double meanP = 0.0, meanR = 0.0;
+        for (size_t g = 0; g < r.bestPrecision.size(); ++g) {
+            double p = r.bestPrecision[g];
+            double rc = r.bestRecall[g];
+            double f = 2 * (p * rc) / max(MATLAB_EPS, p + rc);
+            snprintf(line, sizeof(line), "GT %-5d | %-12.4f | %-12.4f | %-12.4f\n", static_cast<int>(g + 1), p, rc, f);
+            out << line;
+            meanP += p / r.bestPrecision.size();
+            meanR += rc / r.bestPrecision.size();
+        }
+        snprintf(line, sizeof(line), "Overall Mean P: %.4f, Mean R: %.4f, F: %.4f\n\n", meanP, meanR, r.curve[r.best].f);
+        out << line;
+    }
+    return out.str();
+}
+
+void writeCurves(const string& imageName, const vector<DetectorResult>& results) {
+    ofstream file(imageName + "_FCurve.csv");
+    file << "detector,threshold,precision,recall,f\n";
+    for (size_t d = 0; d < DETECTORS.size(); ++d) {
+        for (const CurvePoint& point : results[d].curve) {
+            file << DETECTORS[d].name << "," << point.threshold << "," << point.meanPrecision << ","
+                 << point.meanRecall << "," << point.f << "\n";
+        }
+    }
+}
+
+// ODS: one threshold for all images, chosen on the F of the precision and
+// recall averaged over images. OIS: each image at its own best threshold.
+void printSummary(const vector<ImageResult>& images) {
+    cout << "=== Summary over " << images.size() << " images ===\n";
+    for (size_t d = 0; d < DETECTORS.size(); ++d) {
+        size_t numThresholds = images[0].detectors[d].curve.size();
+        double odsF = 0.0, odsT = 0.0, oisF = 0.0;
+        for (size_t k = 0; k < numThresholds; ++k) {
+            double p = 0.0, r = 0.0;
+            for (const ImageResult& image : images) {
+                p += image.detectors[d].curve[k].meanPrecision / images.size();
+                r += image.detectors[d].curve[k].meanRecall / images.size();
+            }
+            double f = 2 * (p * r) / max(MATLAB_EPS, p + r);
+            if (f >= odsF) {
+                odsF = f;
+                odsT = images[0].detectors[d].curve[k].threshold;
+            }
+        }
+        for (const ImageResult& image : images) {
+            const DetectorResult& r = image.detectors[d];
+            oisF += r.curve[r.best].f / images.size();
+        }
+        char line[128];
+        snprintf(line, sizeof(line), "%-6s ODS F: %.4f (t = %.2f), OIS F: %.4f\n", DETECTORS[d].name.c_str(), odsF, odsT, oisF);
+        cout << line;
+    }
+}
+
+void printUsage(const char* program) {
+    cerr << "usage: " << program << " convert <name>_GT.mat <name>_GT.gtb\n"
+         << "       " << program << " [--curves] <name> [<name> ...]" << endl;
+}
+
+int main(int argc, char* argv[]) {
+    INSTRUMENT_RUN("boundary-evaluation");
+    if (argc < 2) {
+        printUsage(argv[0]);
+        return -1;
+    }
+
+    if (string(argv[1]) == "convert") {
+        if (argc != 4) {
+            cerr << "usage: " << argv[0] << " convert <name>_GT.mat <name>_GT.gtb" << endl;
+            return -1;
+        }
+        try {
+            GroundTruth gt = readGroundTruthMat(argv[2]);
+            writeGroundTruth(argv[3], gt);
+            cout << argv[3] << ": " << gt.boundaries.size() << " annotations, " << gt.width << "x" << gt.height << endl;
+        } catch (const exception& e) {
+            cerr << e.what() << endl;
+            return -1;
+        }
+        return 0;
+    }
+
+    bool curves = false;
+    vector<ImageResult> images;
+    for (int i = 1; i < argc; ++i) {
+        if (string(argv[i]) == "--curves") {
+            curves = true;
+        } else {
+            images.push_back(ImageResult{argv[i], "", "", {}});
+        }
+    }
+    if (images.empty()) {
+        printUsage(argv[0]);
+        return -1;
+    }
+
+    sharedPool().run(images.size(), [&](int i) {
+        ImageResult& image = images[i];
+        try {
+            GroundTruth gt = readGroundTruth(image.name + "_GT.gtb");
+            if (gt.boundaries.empty()) throw runtime_error(image.name + "_GT.gtb has no annotations");
+            for (const Detector& detector : DETECTORS) {
+                vector<uint8_t> edgeMap = readEdgeMap(image.name + "_" + detector.suffix, detector, gt.width, gt.height);
+                image.detectors.push_back(evaluateDetector(edgeMap, gt, detector.binary));
+            }
+            image.report = formatReport(image.name, image.detectors);
+            if (curves) writeCurves(image.name, image.detectors);
+        } catch (const exception& e) {
+            image.error = e.what();
+        }
+    });
+
+    vector<ImageResult> evaluated;
+    for (ImageResult& image : images) {
+        if (!image.error.empty()) {
+            cerr << image.error << endl;
+            continue;
+        }
+        cout << image.report;
+        evaluated.push_back(move(image));
+    }
+    if (!evaluated.empty()) printSummary(evaluated);
+    return evaluated.size() == images.size() ? 0 : -1;
+}
@@ -1,114 +1,73 @@
 #include <iostream>
 #include <fstream>
 #include <vector>
-#include <cmath>
-#include <algorithm>
 #include <string>
+#include "sober-edge-detector.h"
+#include "../../common/raw-image.h"
+#include "../../common/instrumentation.h"
 
 using namespace std;
 
 const int WIDTH = 481;
 const int HEIGHT = 321;
 const int BYTES_PER_PIXEL = 3;
+// The map at this threshold is also written under the plain _EdgeMap name.
+const double DEFAULT_THRESHOLD_PERCENT = 15;
 
-vector<unsigned char> readRawImage(const string& filename, int width, int height, int bpp) {
-    vector<unsigned char> imageData(width * height * bpp);
-    ifstream file(filename, ios::binary);
-    file.read(reinterpret_cast<char*>(imageData.data()), imageData.size());
-    file.close();
-    return imageData;
-}
-void writeRawImage(const string& filename, const vector<unsigned char>& imageData) {
+void writeRawImage(const string& filename, const ScratchBuffer<unsigned char>& imageData) {
     ofstream file(filename, ios::binary);
     file.write(reinterpret_cast<const char*>(imageData.data()), imageData.size());
     file.close();
 }
 
-vector<double> convertToGrayscale(const vector<unsigned char>& rgbImage) {
-    vector<double> grayImage(WIDTH * HEIGHT);
-    for (int i = 0; i < WIDTH * HEIGHT; ++i) {
-        double r = rgbImage[i * 3];
-        double g = rgbImage[i * 3 + 1];
-        double b = rgbImage[i * 3 + 2];
-        grayImage[i] = 0.2989 * r + 0.5870 * g + 0.1140 * b;
+void writeSobelMaps(const SobelMaps& maps, const string& baseFilename, const vector<double>& percentages,
+                    const string& edgeMapExtension) {
+    STAGE_TIMER("write", maps.magnitude.size());
+    writeRawImage(baseFilename + "_GradX.raw", maps.gradX);
+    writeRawImage(baseFilename + "_GradY.raw", maps.gradY);
+    writeRawImage(baseFilename + "_Magnitude.raw", maps.magnitude);
+    for (size_t k = 0; k < percentages.size(); ++k) {
+        writeRawImage(baseFilename + edgeMapSuffix(percentages[k]) + edgeMapExtension, maps.edgeMaps[k]);
+        if (percentages[k] == DEFAULT_THRESHOLD_PERCENT) {
+            writeRawImage(baseFilename + "_EdgeMap" + edgeMapExtension, maps.edgeMaps[k]);
+        }
     }
-    return grayImage;
 }
 
-vector<unsigned char> normalizeTo255(const vector<double>& input) {
-    double minVal = input[0];
-    double maxVal = input[0];
-    for (double val : input) {
-        if (val < minVal) minVal = val;
-        if (val > maxVal) maxVal = val;
+int main(int argc, char* argv[]) {
+    INSTRUMENT_RUN("sober-edge-detector");
+    // The default is the fused double path in two passes; "deferred" makes it
+    // one pass over float frames and "int16" selects the integer SIMD path.
+    // "pbm" writes the edge maps as 1-bit PBMs.
+    bool useInt16 = false, deferred = false, pbm = false;
+    for (int i = 1; i < argc; ++i) {
+        useInt16 = useInt16 || string(argv[i]) == "int16";
+        deferred = deferred || string(argv[i]) == "deferred";
+        pbm = pbm || string(argv[i]) == "pbm";
     }
-    vector<unsigned char> output(input.size());
-    for (size_t i = 0; i < input.size(); ++i) {
-        output[i] = static_cast<unsigned char>(((input[i] - minVal) / (maxVal - minVal)) * 255.0);
-    }
-    return output;
-}
-
-void applySobel(const vector<double>& grayImage, string baseFilename, double thresholdPercentage) {
-    vector<double> gradX(WIDTH * HEIGHT, 0.0);
-    vector<double> gradY(WIDTH * HEIGHT, 0.0);
-    vector<double> magnitude(WIDTH * HEIGHT, 0.0);
-
-    int Gx[3][3] = {{-1, 0, 1}, {-2, 0, 2}, {-1, 0, 1}};
-    int Gy[3][3] = {{1, 2, 1}, {0, 0, 0}, {-1, -2, -1}};
-    for (int y = 1; y < HEIGHT - 1; ++y) {
-        for (int x = 1; x < WIDTH - 1; ++x) {
-            double sumX = 0.0;
-            double sumY = 0.0;
-
-            for (int j = -1; j <= 1; ++j) {
-                for (int i = -1; i <= 1; ++i) {
-                    double pixelVal = grayImage[(y + j) * WIDTH + (x + i)];
-                    sumX += pixelVal * Gx[j + 1][i + 1];
-                    sumY += pixelVal * Gy[j + 1][i + 1];
-                }
+    string edgeMapExtension = pbm ? ".pbm" : ".raw";
+    vector<double> thresholdPercents = {5, DEFAULT_THRESHOLD_PERCENT, 30};
+    try {
+        for (string name : {"Bird", "Deer"}) {
+            MappedFile rgbImage;
+            {
+                STAGE_TIMER("read", WIDTH * HEIGHT);
+                rgbImage = mapRawImage(name + ".raw", WIDTH, HEIGHT, BYTES_PER_PIXEL);
+            }
+            ImageView<const unsigned char> rgbView =
+                ImageView<const unsigned char>::interleaved(rgbImage.data(), WIDTH, HEIGHT, BYTES_PER_PIXEL);
+            if (useInt16) {
+                writeSobelMaps(applySobelInt16(convertToGray8(rgbView), WIDTH, HEIGHT, thresholdPercents, pbm),
+                               name, thresholdPercents, edgeMapExtension);
+            } else {
+                SobelRescale rescale = deferred ? SobelRescale::Deferred : SobelRescale::TwoPass;
+                writeSobelMaps(applySobelFused(rgbView, thresholdPercents, pbm, rescale),
+                               name, thresholdPercents, edgeMapExtension);
             }
-
-            int index = y * WIDTH + x;
-            gradX[index] = sumX;
-            gradY[index] = sumY;
-            magnitude[index] = sqrt(sumX * sumX + sumY * sumY);
-        }
-    }
-    writeRawImage(baseFilename + "_GradX.raw", normalizeTo255(gradX));
-    writeRawImage(baseFilename + "_GradY.raw", normalizeTo255(gradY));
-    writeRawImage(baseFilename + "_Magnitude.raw", normalizeTo255(magnitude));
-
-    vector<double> sortedMag = magnitude;
-    sort(sortedMag.begin(), sortedMag.end());
-    
-    int thresholdIndex = static_cast<int>((1.0 - (thresholdPercentage / 100.0)) * sortedMag.size());
-    if (thresholdIndex >= sortedMag.size()) thresholdIndex = sortedMag.size() - 1;
-    if (thresholdIndex < 0) thresholdIndex = 0;
-    
-    double thresholdValue = sortedMag[thresholdIndex];
-    vector<unsigned char> edgeMap(WIDTH * HEIGHT);
-
-    for (int i = 0; i < WIDTH * HEIGHT; ++i) {
-        if (magnitude[i] >= thresholdValue) {
-            edgeMap[i] = 0;
-        } else {
-            edgeMap[i] = 255;
         }
+    } catch (const exception& e) {
+        cerr << e.what() << endl;
+        return -1;
     }
-
-    writeRawImage(baseFilename + "_EdgeMap.raw", edgeMap);
-}
-
-int main() {
-    double thresholdPercent = 15; 
-    vector<unsigned char> birdRGB = readRawImage("Bird.raw", WIDTH, HEIGHT, BYTES_PER_PIXEL);
-    vector<double> birdGray = convertToGrayscale(birdRGB);
-    applySobel(birdGray, "Bird", thresholdPercent);
-
-    vector<unsigned char> deerRGB = readRawImage("Deer.raw", WIDTH, HEIGHT, BYTES_PER_PIXEL);
-    vector<double> deerGray = convertToGrayscale(deerRGB);
-    applySobel(deerGray, "Deer", thresholdPercent);
-
     return 0;
-}
+}
\ No newline at end of file
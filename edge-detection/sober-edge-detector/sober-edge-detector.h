@@ -0,0 +1,570 @@
+#ifndef SOBER_EDGE_DETECTOR_H
+#define SOBER_EDGE_DETECTOR_H
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <string>
+#include <sstream>
+#include <cstdint>
+#include <functional>
+#include "../../common/tile-scheduler.h"
+#include "../../common/raw-image.h"
+#include "../../common/bit-plane.h"
+#include "../../common/instrumentation.h"
+#include "../../common/buffer-pool.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SOBEL_X86 1
+#endif
+
+using namespace std;
+
+// Both gray conversions read through a strided view, so packed and planar
+// RGB inputs are handled without a copy.
+inline void grayRow(ImageView<const unsigned char> rgbImage, int y, double* gray) {
+    for (int x = 0; x < rgbImage.width; ++x) {
+        double r = rgbImage.at(x, y, 0);
+        double g = rgbImage.at(x, y, 1);
+        double b = rgbImage.at(x, y, 2);
+        gray[x] = 0.2989 * r + 0.5870 * g + 0.1140 * b;
+    }
+}
+
+inline vector<double> convertToGrayscale(ImageView<const unsigned char> rgbImage) {
+    STAGE_TIMER("grayscale", rgbImage.width * rgbImage.height);
+    int width = rgbImage.width;
+    vector<double> grayImage(width * rgbImage.height);
+    for (int y = 0; y < rgbImage.height; ++y) {
+        grayRow(rgbImage, y, &grayImage[y * width]);
+    }
+    return grayImage;
+}
+
+// Buffer is a vector or a ScratchBuffer (see buffer-pool.h).
+template <typename Buffer>
+ScratchBuffer<unsigned char> normalizeTo255(const Buffer& input) {
+    STAGE_TIMER("normalize", input.size());
+    double minVal = input[0];
+    double maxVal = input[0];
+    for (double val : input) {
+        if (val < minVal) minVal = val;
+        if (val > maxVal) maxVal = val;
+    }
+    ScratchBuffer<unsigned char> output(input.size());
+    for (size_t i = 0; i < input.size(); ++i) {
+        output[i] = static_cast<unsigned char>(((input[i] - minVal) / (maxVal - minVal)) * 255.0);
+    }
+    return output;
+}
+
+// Sobel magnitudes of 8-bit gray never exceed sqrt(2) * 4 * 255.
+const double MAX_SOBEL_MAGNITUDE = 1442.5;
+const int MAGNITUDE_BINS = 4096;
+
+template <typename T>
+inline int magnitudeBin(T val) {
+    const double scale = MAGNITUDE_BINS / MAX_SOBEL_MAGNITUDE;
+    return min(MAGNITUDE_BINS - 1, max(0, static_cast<int>(val * scale)));
+}
+
+// For every percentage, the histogram bin holding its rank and the rank's
+// offset within that bin; slot numbers the distinct bins (-1 elsewhere).
+struct PercentileRanks {
+    vector<int> bins;
+    vector<int> offsets;
+    vector<int> slot;
+    int numSlots = 0;
+};
+
+inline PercentileRanks percentileRanks(const vector<int>& histogram, int n, const vector<double>& percentages) {
+    PercentileRanks ranks;
+    ranks.slot.assign(MAGNITUDE_BINS, -1);
+    for (double percentage : percentages) {
+        int thresholdIndex = static_cast<int>((1.0 - (percentage / 100.0)) * n);
+        if (thresholdIndex >= n) thresholdIndex = n - 1;
+        if (thresholdIndex < 0) thresholdIndex = 0;
+        int bin = 0;
+        int below = 0;
+        while (below + histogram[bin] <= thresholdIndex) {
+            below += histogram[bin++];
+        }
+        ranks.bins.push_back(bin);
+        ranks.offsets.push_back(thresholdIndex - below);
+        if (ranks.slot[bin] < 0) ranks.slot[bin] = ranks.numSlots++;
+    }
+    return ranks;
+}
+
+// Returns, for every percentage p, the value the sorted magnitudes hold at
+// index (1 - p / 100) * n, without sorting. One pass builds a fixed-bin
+// histogram, then only the bins holding a requested rank are gathered and
+// resolved with nth_element, so the thresholds equal the sort-based ones.
+template <typename Buffer, typename T = typename Buffer::value_type>
+vector<T> percentileThresholds(const Buffer& magnitude, const vector<double>& percentages) {
+    STAGE_TIMER("percentile", magnitude.size());
+    vector<int> histogram(MAGNITUDE_BINS, 0);
+    for (T val : magnitude) {
+        ++histogram[magnitudeBin(val)];
+    }
+
+    PercentileRanks ranks = percentileRanks(histogram, magnitude.size(), percentages);
+    vector<vector<T>> candidates(ranks.numSlots);
+    for (int bin = 0; bin < MAGNITUDE_BINS; ++bin) {
+        if (ranks.slot[bin] >= 0) candidates[ranks.slot[bin]].reserve(histogram[bin]);
+    }
+    for (T val : magnitude) {
+        int s = ranks.slot[magnitudeBin(val)];
+        if (s >= 0) candidates[s].push_back(val);
+    }
+
+    vector<T> thresholds;
+    for (size_t k = 0; k < ranks.bins.size(); ++k) {
+        vector<T>& bin = candidates[ranks.slot[ranks.bins[k]]];
+        nth_element(bin.begin(), bin.begin() + ranks.offsets[k], bin.end());
+        thresholds.push_back(bin[ranks.offsets[k]]);
+    }
+    return thresholds;
+}
+
+// Allocates count edge maps, as byte images or (packed) as whole PBM files
+// (see bit-plane.h), and hands fill a vector of their planes. Fill sets every
+// pixel, so byte maps are not cleared.
+template <typename Fill>
+vector<ScratchBuffer<unsigned char>> makeEdgeMaps(int width, int height, size_t count, bool packed, Fill fill) {
+    vector<ScratchBuffer<unsigned char>> edgeMaps;
+    if (packed) {
+        vector<BitPlane> planes;
+        for (size_t k = 0; k < count; ++k) {
+            edgeMaps.emplace_back(pbmImageSize(width, height), 0);
+            writePbmHeaders(edgeMaps.back().data(), width, height, 1);
+            planes.push_back(pbmPlane(edgeMaps.back().data(), width, height));
+        }
+        fill(planes);
+    } else {
+        vector<BytePlane> planes;
+        for (size_t k = 0; k < count; ++k) {
+            edgeMaps.emplace_back(static_cast<size_t>(width) * height);
+            planes.push_back(BytePlane{edgeMaps.back().data(), width});
+        }
+        fill(planes);
+    }
+    return edgeMaps;
+}
+
+// Builds every edge map (0 = edge) in a single pass over the magnitudes,
+// writing packed bits directly when packed is set.
+template <typename Buffer, typename T = typename Buffer::value_type>
+vector<ScratchBuffer<unsigned char>> thresholdEdgeMaps(const Buffer& magnitude, int width, const vector<double>& percentages,
+                                                       bool packed = false) {
+    vector<T> thresholds = percentileThresholds(magnitude, percentages);
+    STAGE_TIMER("threshold", magnitude.size());
+    int height = magnitude.size() / width;
+    return makeEdgeMaps(width, height, thresholds.size(), packed, [&](const auto& planes) {
+        for (int y = 0; y < height; ++y) {
+            for (int x = 0; x < width; ++x) {
+                T value = magnitude[y * width + x];
+                for (size_t k = 0; k < thresholds.size(); ++k) {
+                    planes[k].set(x, y, !(value >= thresholds[k]));
+                }
+            }
+        }
+    });
+}
+
+// Borrowed from the scratch pool, so the frames go back to it once written.
+struct SobelMaps {
+    ScratchBuffer<unsigned char> gradX;
+    ScratchBuffer<unsigned char> gradY;
+    ScratchBuffer<unsigned char> magnitude;
+    vector<ScratchBuffer<unsigned char>> edgeMaps;
+};
+
+inline string edgeMapSuffix(double percentage) {
+    ostringstream name;
+    name << "_EdgeMap_" << percentage;
+    return name.str();
+}
+
+// Fills columns [x0, x1) of one gradient row from the gray rows above, at
+// and below it.
+inline void sobelRowDouble(const double* above, const double* row, const double* below,
+                           double* gx, double* gy, double* mag, int x0, int x1) {
+    static const int Gx[3][3] = {{-1, 0, 1}, {-2, 0, 2}, {-1, 0, 1}};
+    static const int Gy[3][3] = {{1, 2, 1}, {0, 0, 0}, {-1, -2, -1}};
+    const double* rows[3] = {above, row, below};
+    for (int x = x0; x < x1; ++x) {
+        double sumX = 0.0;
+        double sumY = 0.0;
+
+        for (int j = -1; j <= 1; ++j) {
+            for (int i = -1; i <= 1; ++i) {
+                double pixelVal = rows[j + 1][x + i];
+                sumX += pixelVal * Gx[j + 1][i + 1];
+                sumY += pixelVal * Gy[j + 1][i + 1];
+            }
+        }
+
+        gx[x] = sumX;
+        gy[x] = sumY;
+        mag[x] = sqrt(sumX * sumX + sumY * sumY);
+    }
+}
+
+inline SobelMaps applySobel(const vector<double>& grayImage, int width, int height, const vector<double>& thresholdPercentages,
+                            bool packedEdgeMaps = false) {
+    vector<double> gradX(width * height, 0.0);
+    vector<double> gradY(width * height, 0.0);
+    vector<double> magnitude(width * height, 0.0);
+
+    {
+        STAGE_TIMER("gradient", width * height);
+        forEachTile(width, height, 1, [&](const Tile& tile) {
+            for (int y = tile.y0; y < tile.y1; ++y) {
+                int index = y * width;
+                sobelRowDouble(&grayImage[index - width], &grayImage[index], &grayImage[index + width],
+                               &gradX[index], &gradY[index], &magnitude[index], tile.x0, tile.x1);
+            }
+        });
+    }
+    return SobelMaps{normalizeTo255(gradX), normalizeTo255(gradY), normalizeTo255(magnitude),
+                     thresholdEdgeMaps(magnitude, width, thresholdPercentages, packedEdgeMaps)};
+}
+
+// Fused path: RGB goes to gray a strip of rows at a time, keeping three gray
+// rows and one row of each gradient per strip, so no full-frame temporaries
+// are built. TwoPass runs the strips twice: the first pass only collects the
+// min/max of each map and the magnitude histogram, the second writes the
+// normalized rows and the edge maps. Pixels in the histogram bin holding a
+// percentile wait in a list (24 bytes each) until that bin's threshold is
+// known. On flat or low-contrast frames that bin can hold most of the image,
+// so a bin over 1 / SOBEL_PENDING_SHARE of the pixels keeps only its values
+// (8 bytes each) and a third pass sets its pixels once the threshold is
+// known. At worst the lists take 8 bytes per pixel plus 1.5 per percentile.
+// The output equals applySobel(convertToGrayscale(...)) byte for byte.
+// Deferred computes the gradients once into float frames (12 bytes per
+// pixel) and rescales at the end, trading memory for the second pass; the
+// rounding to float can move a normalized value by one level.
+enum class SobelRescale { TwoPass, Deferred };
+
+const int SOBEL_STRIP_ROWS = 64;
+const int SOBEL_PENDING_SHARE = 16;
+
+// Calls fn(strip, y, gx, gy, mag) for every row of the gradient maps, border
+// rows and columns zero as in applySobel. Strips run in parallel; the rows of
+// one strip arrive in order.
+inline void forEachSobelRow(ImageView<const unsigned char> rgbImage,
+                            const function<void(int, int, const double*, const double*, const double*)>& fn) {
+    int width = rgbImage.width;
+    int height = rgbImage.height;
+    forEachTile(width, height, 0, [&](const Tile& strip) {
+        vector<double> gray(3 * width);
+        vector<double> gx(width, 0.0), gy(width, 0.0), mag(width, 0.0), zero(width, 0.0);
+        auto grayOf = [&](int y) { return &gray[(y % 3) * width]; };
+        for (int y = max(0, strip.y0 - 1); y <= strip.y0; ++y) {
+            grayRow(rgbImage, y, grayOf(y));
+        }
+        for (int y = strip.y0; y < strip.y1; ++y) {
+            if (y + 1 < height) grayRow(rgbImage, y + 1, grayOf(y + 1));
+            if (y > 0 && y + 1 < height) {
+                sobelRowDouble(grayOf(y - 1), grayOf(y), grayOf(y + 1), gx.data(), gy.data(), mag.data(), 1, width - 1);
+                fn(strip.index, y, gx.data(), gy.data(), mag.data());
+            } else {
+                fn(strip.index, y, zero.data(), zero.data(), zero.data());
+            }
+        }
+    }, sharedPool(), width, SOBEL_STRIP_ROWS);
+}
+
+struct SobelRange {
+    double minVal = HUGE_VAL;
+    double maxVal = -HUGE_VAL;
+
+    void add(const double* row, int width) {
+        for (int x = 0; x < width; ++x) {
+            minVal = min(minVal, row[x]);
+            maxVal = max(maxVal, row[x]);
+        }
+    }
+
+    void merge(const SobelRange& other) {
+        minVal = min(minVal, other.minVal);
+        maxVal = max(maxVal, other.maxVal);
+    }
+
+    // As normalizeTo255 maps a value.
+    unsigned char normalize(double value) const {
+        return static_cast<unsigned char>(((value - minVal) / (maxVal - minVal)) * 255.0);
+    }
+};
+
+inline SobelMaps applySobelFusedTwoPass(ImageView<const unsigned char> rgbImage, const vector<double>& thresholdPercentages,
+                                        bool packedEdgeMaps) {
+    int width = rgbImage.width;
+    int height = rgbImage.height;
+    int numStrips = (height + SOBEL_STRIP_ROWS - 1) / SOBEL_STRIP_ROWS;
+
+    struct StripStats {
+        SobelRange gradX, gradY, magnitude;
+        vector<int> histogram = vector<int>(MAGNITUDE_BINS, 0);
+    };
+    vector<StripStats> strips(numStrips);
+    {
+        STAGE_TIMER("statistics", width * height);
+        forEachSobelRow(rgbImage, [&](int strip, int, const double* gx, const double* gy, const double* mag) {
+            StripStats& stats = strips[strip];
+            stats.gradX.add(gx, width);
+            stats.gradY.add(gy, width);
+            stats.magnitude.add(mag, width);
+            for (int x = 0; x < width; ++x) {
+                ++stats.histogram[magnitudeBin(mag[x])];
+            }
+        });
+    }
+    StripStats total;
+    for (const StripStats& stats : strips) {
+        total.gradX.merge(stats.gradX);
+        total.gradY.merge(stats.gradY);
+        total.magnitude.merge(stats.magnitude);
+        for (int bin = 0; bin < MAGNITUDE_BINS; ++bin) {
+            total.histogram[bin] += stats.histogram[bin];
+        }
+    }
+    PercentileRanks ranks = percentileRanks(total.histogram, width * height, thresholdPercentages);
+
+    // One list per distinct percentile bin, each strip filling its own range
+    // of it (known from the strip histograms). Bins too large to queue only
+    // collect their values.
+    struct Pending {
+        int x, y;
+        double value;
+    };
+    int pendingLimit = width * height / SOBEL_PENDING_SHARE;
+    vector<bool> queued(ranks.numSlots);
+    vector<vector<Pending>> pending(ranks.numSlots);
+    vector<vector<double>> values(ranks.numSlots);
+    vector<vector<int>> fillAt(numStrips, vector<int>(ranks.numSlots));
+    bool thirdPass = false;
+    for (int bin = 0; bin < MAGNITUDE_BINS; ++bin) {
+        int s = ranks.slot[bin];
+        if (s < 0) continue;
+        queued[s] = total.histogram[bin] <= pendingLimit;
+        if (queued[s]) pending[s].resize(total.histogram[bin]);
+        else values[s].resize(total.histogram[bin]);
+        thirdPass = thirdPass || !queued[s];
+        for (int strip = 0, at = 0; strip < numStrips; ++strip) {
+            fillAt[strip][s] = at;
+            at += strips[strip].histogram[bin];
+        }
+    }
+    SobelMaps maps;
+    maps.gradX = ScratchBuffer<unsigned char>(width * height);
+    maps.gradY = ScratchBuffer<unsigned char>(width * height);
+    maps.magnitude = ScratchBuffer<unsigned char>(width * height);
+    STAGE_TIMER("emit", width * height);
+    maps.edgeMaps = makeEdgeMaps(width, height, thresholdPercentages.size(), packedEdgeMaps, [&](const auto& planes) {
+        forEachSobelRow(rgbImage, [&](int strip, int y, const double* gx, const double* gy, const double* mag) {
+            unsigned char* outX = &maps.gradX[y * width];
+            unsigned char* outY = &maps.gradY[y * width];
+            unsigned char* outMag = &maps.magnitude[y * width];
+            vector<int>& at = fillAt[strip];
+            for (int x = 0; x < width; ++x) {
+                outX[x] = total.gradX.normalize(gx[x]);
+                outY[x] = total.gradY.normalize(gy[x]);
+                outMag[x] = total.magnitude.normalize(mag[x]);
+                int bin = magnitudeBin(mag[x]);
+                for (size_t k = 0; k < ranks.bins.size(); ++k) {
+                    if (bin != ranks.bins[k]) planes[k].set(x, y, bin < ranks.bins[k]);
+                }
+                int s = ranks.slot[bin];
+                if (s < 0) continue;
+                if (queued[s]) pending[s][at[s]++] = {x, y, mag[x]};
+                else values[s][at[s]++] = mag[x];
+            }
+        });
+
+        // Thresholds from the collected values, then the pixels that waited.
+        vector<double> thresholds(ranks.bins.size());
+        for (size_t k = 0; k < ranks.bins.size(); ++k) {
+            int s = ranks.slot[ranks.bins[k]];
+            int offset = ranks.offsets[k];
+            if (queued[s]) {
+                nth_element(pending[s].begin(), pending[s].begin() + offset, pending[s].end(),
+                            [](const Pending& a, const Pending& b) { return a.value < b.value; });
+                thresholds[k] = pending[s][offset].value;
+                for (const Pending& p : pending[s]) planes[k].set(p.x, p.y, !(p.value >= thresholds[k]));
+            } else {
+                nth_element(values[s].begin(), values[s].begin() + offset, values[s].end());
+                thresholds[k] = values[s][offset];
+            }
+        }
+        if (!thirdPass) return;
+        values.clear();
+        forEachSobelRow(rgbImage, [&](int, int y, const double*, const double*, const double* mag) {
+            for (int x = 0; x < width; ++x) {
+                int bin = magnitudeBin(mag[x]);
+                int s = ranks.slot[bin];
+                if (s < 0 || queued[s]) continue;
+                for (size_t k = 0; k < ranks.bins.size(); ++k) {
+                    if (bin == ranks.bins[k]) planes[k].set(x, y, !(mag[x] >= thresholds[k]));
+                }
+            }
+        });
+    });
+    return maps;
+}
+
+inline SobelMaps applySobelFused(ImageView<const unsigned char> rgbImage, const vector<double>& thresholdPercentages,
+                                 bool packedEdgeMaps = false, SobelRescale rescale = SobelRescale::TwoPass) {
+    if (rescale == SobelRescale::TwoPass) {
+        return applySobelFusedTwoPass(rgbImage, thresholdPercentages, packedEdgeMaps);
+    }
+    int width = rgbImage.width;
+    ScratchBuffer<float> gradX(width * rgbImage.height), gradY(width * rgbImage.height), magnitude(width * rgbImage.height);
+    {
+        STAGE_TIMER("gradient", width * rgbImage.height);
+        forEachSobelRow(rgbImage, [&](int, int y, const double* gx, const double* gy, const double* mag) {
+            for (int x = 0; x < width; ++x) {
+                gradX[y * width + x] = static_cast<float>(gx[x]);
+                gradY[y * width + x] = static_cast<float>(gy[x]);
+                magnitude[y * width + x] = static_cast<float>(mag[x]);
+            }
+        });
+    }
+    return SobelMaps{normalizeTo255(gradX), normalizeTo255(gradY), normalizeTo255(magnitude),
+                     thresholdEdgeMaps(magnitude, width, thresholdPercentages, packedEdgeMaps)};
+}
+
+// Integer Sobel path. Gray is rounded to uint8 with 16-bit fixed-point BT.601
+// weights, GradX/GradY are exact int16 sums over that gray image and the
+// magnitude is a float sqrt, all produced in one pass. Against the double path
+// the rounding of gray shifts each gradient by at most 4 (of +-1020), so after
+// normalizeTo255 GradX/GradY/Magnitude stay within +-2 levels (+-1 measured on
+// Bird/Deer); the percentile edge map only flips pixels sitting right at the
+// threshold (under 0.2% on Bird/Deer).
+inline ScratchBuffer<uint8_t> convertToGray8(ImageView<const unsigned char> rgbImage) {
+    STAGE_TIMER("grayscale", rgbImage.width * rgbImage.height);
+    int width = rgbImage.width;
+    ScratchBuffer<uint8_t> grayImage(width * rgbImage.height);
+    for (int y = 0; y < rgbImage.height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            uint32_t r = rgbImage.at(x, y, 0);
+            uint32_t g = rgbImage.at(x, y, 1);
+            uint32_t b = rgbImage.at(x, y, 2);
+            grayImage[y * width + x] = static_cast<uint8_t>((19589 * r + 38470 * g + 7471 * b + 32768) >> 16);
+        }
+    }
+    return grayImage;
+}
+
+// Each row function fills columns [1, width - 1) of one output row from the
+// gray rows above, at and below it.
+typedef void (*SobelRowFn)(const uint8_t* above, const uint8_t* row, const uint8_t* below,
+                           int16_t* gx, int16_t* gy, float* mag, int width);
+
+inline void sobelRowScalar(const uint8_t* above, const uint8_t* row, const uint8_t* below,
+                    int16_t* gx, int16_t* gy, float* mag, int width) {
+    for (int x = 1; x < width - 1; ++x) {
+        int sumX = (above[x + 1] - above[x - 1]) + 2 * (row[x + 1] - row[x - 1]) + (below[x + 1] - below[x - 1]);
+        int sumY = (above[x - 1] + 2 * above[x] + above[x + 1]) - (below[x - 1] + 2 * below[x] + below[x + 1]);
+        gx[x] = static_cast<int16_t>(sumX);
+        gy[x] = static_cast<int16_t>(sumY);
+        mag[x] = sqrtf(static_cast<float>(sumX * sumX + sumY * sumY));
+    }
+}
+
+#ifdef SOBEL_X86
+inline void sobelRowSSE2(const uint8_t* above, const uint8_t* row, const uint8_t* below,
+                  int16_t* gx, int16_t* gy, float* mag, int width) {
+    const __m128i zero = _mm_setzero_si128();
+    auto load8 = [&](const uint8_t* p) {
+        return _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(p)), zero);
+    };
+    int x = 1;
+    for (; x + 8 <= width - 1; x += 8) {
+        __m128i aL = load8(above + x - 1), aC = load8(above + x), aR = load8(above + x + 1);
+        __m128i rL = load8(row + x - 1), rR = load8(row + x + 1);
+        __m128i bL = load8(below + x - 1), bC = load8(below + x), bR = load8(below + x + 1);
+
+        __m128i dRow = _mm_sub_epi16(rR, rL);
+        __m128i sumX = _mm_add_epi16(_mm_add_epi16(_mm_sub_epi16(aR, aL), _mm_sub_epi16(bR, bL)), _mm_add_epi16(dRow, dRow));
+        __m128i top = _mm_add_epi16(_mm_add_epi16(aL, aR), _mm_add_epi16(aC, aC));
+        __m128i bottom = _mm_add_epi16(_mm_add_epi16(bL, bR), _mm_add_epi16(bC, bC));
+        __m128i sumY = _mm_sub_epi16(top, bottom);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(gx + x), sumX);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(gy + x), sumY);
+
+        __m128i sqLo = _mm_madd_epi16(_mm_unpacklo_epi16(sumX, sumY), _mm_unpacklo_epi16(sumX, sumY));
+        __m128i sqHi = _mm_madd_epi16(_mm_unpackhi_epi16(sumX, sumY), _mm_unpackhi_epi16(sumX, sumY));
+        _mm_storeu_ps(mag + x, _mm_sqrt_ps(_mm_cvtepi32_ps(sqLo)));
+        _mm_storeu_ps(mag + x + 4, _mm_sqrt_ps(_mm_cvtepi32_ps(sqHi)));
+    }
+    sobelRowScalar(above + x - 1, row + x - 1, below + x - 1, gx + x - 1, gy + x - 1, mag + x - 1, width - x + 1);
+}
+
+__attribute__((target("avx2"))) static inline __m256i load16(const uint8_t* p) {
+    return _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)));
+}
+
+__attribute__((target("avx2")))
+inline void sobelRowAVX2(const uint8_t* above, const uint8_t* row, const uint8_t* below,
+                  int16_t* gx, int16_t* gy, float* mag, int width) {
+    int x = 1;
+    for (; x + 16 <= width - 1; x += 16) {
+        __m256i aL = load16(above + x - 1), aC = load16(above + x), aR = load16(above + x + 1);
+        __m256i rL = load16(row + x - 1), rR = load16(row + x + 1);
+        __m256i bL = load16(below + x - 1), bC = load16(below + x), bR = load16(below + x + 1);
+
+        __m256i dRow = _mm256_sub_epi16(rR, rL);
+        __m256i sumX = _mm256_add_epi16(_mm256_add_epi16(_mm256_sub_epi16(aR, aL), _mm256_sub_epi16(bR, bL)), _mm256_add_epi16(dRow, dRow));
+        __m256i top = _mm256_add_epi16(_mm256_add_epi16(aL, aR), _mm256_add_epi16(aC, aC));
+        __m256i bottom = _mm256_add_epi16(_mm256_add_epi16(bL, bR), _mm256_add_epi16(bC, bC));
+        __m256i sumY = _mm256_sub_epi16(top, bottom);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(gx + x), sumX);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(gy + x), sumY);
+
+        // unpack works per 128-bit lane: lo holds pixels 0-3 and 8-11, hi holds 4-7 and 12-15.
+        __m256i xyLo = _mm256_unpacklo_epi16(sumX, sumY);
+        __m256i xyHi = _mm256_unpackhi_epi16(sumX, sumY);
+        __m256 magLo = _mm256_sqrt_ps(_mm256_cvtepi32_ps(_mm256_madd_epi16(xyLo, xyLo)));
+        __m256 magHi = _mm256_sqrt_ps(_mm256_cvtepi32_ps(_mm256_madd_epi16(xyHi, xyHi)));
+        _mm256_storeu_ps(mag + x, _mm256_permute2f128_ps(magLo, magHi, 0x20));
+        _mm256_storeu_ps(mag + x + 8, _mm256_permute2f128_ps(magLo, magHi, 0x31));
+    }
+    sobelRowScalar(above + x - 1, row + x - 1, below + x - 1, gx + x - 1, gy + x - 1, mag + x - 1, width - x + 1);
+}
+#endif
+
+inline SobelRowFn selectSobelRow() {
+#ifdef SOBEL_X86
+    if (__builtin_cpu_supports("avx2")) return sobelRowAVX2;
+    return sobelRowSSE2;
+#else
+    return sobelRowScalar;
+#endif
+}
+
+inline SobelMaps applySobelInt16(const ScratchBuffer<uint8_t>& grayImage, int width, int height,
+                                 const vector<double>& thresholdPercentages, bool packedEdgeMaps = false,
+                                 SobelRowFn sobelRow = selectSobelRow()) {
+    ScratchBuffer<int16_t> gradX(width * height, 0);
+    ScratchBuffer<int16_t> gradY(width * height, 0);
+    ScratchBuffer<float> magnitude(width * height, 0.0f);
+
+    // The row functions fill [1, width - 1), so a tile hands them its columns
+    // plus one halo column on each side.
+    {
+        STAGE_TIMER("gradient", width * height);
+        forEachTile(width, height, 1, [&](const Tile& tile) {
+            for (int y = tile.y0; y < tile.y1; ++y) {
+                int index = y * width + tile.x0 - 1;
+                sobelRow(&grayImage[index - width], &grayImage[index], &grayImage[index + width],
+                         &gradX[index], &gradY[index], &magnitude[index], tile.x1 - tile.x0 + 2);
+            }
+        });
+    }
+    return SobelMaps{normalizeTo255(gradX), normalizeTo255(gradY), normalizeTo255(magnitude),
+                     thresholdEdgeMaps(magnitude, width, thresholdPercentages, packedEdgeMaps)};
+}
+
+#endif
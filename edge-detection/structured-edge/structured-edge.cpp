@@ -1,9 +1,12 @@
 #include <opencv2/opencv.hpp>
 #include <opencv2/ximgproc.hpp>
 #include <iostream>
-#include <fstream>
 #include <vector>
 #include <string>
+#include <thread>
+#include "structured-edge.h"
+#include "../../common/raw-image.h"
+#include "../../common/instrumentation.h"
 
 using namespace std;
 using namespace cv;
@@ -12,45 +15,29 @@ const int WIDTH = 481;
 const int HEIGHT = 321;
 const int CHANNELS = 3;
 
-Mat readRawRGB(const string& filename, int width, int height, int channels) {
-    ifstream file(filename, ios::binary);
-    vector<unsigned char> buffer(width * height * channels);
-    file.read(reinterpret_cast<char*>(buffer.data()), buffer.size());
-    file.close();
-
-    Mat img(height, width, CV_8UC3, buffer.data());
-    return img.clone(); 
-}
-
-void processSE(Ptr<StructuredEdgeDetection> detector, const string& imgName, float thresholdValue) {
-    Mat imageRGB = readRawRGB(imgName, WIDTH, HEIGHT, CHANNELS);
-    Mat imageFloat;
-    imageRGB.convertTo(imageFloat, CV_32FC3, 1.0 / 255.0);
-
-    Mat probEdgeMap;
-    detector->detectEdges(imageFloat, probEdgeMap);
-    normalize(probEdgeMap, probEdgeMap, 0.0, 1.0, NORM_MINMAX);
-
-    Mat orientationMap, nmsEdgeMap;
-    detector->computeOrientation(probEdgeMap, orientationMap);
-    detector->edgesNms(probEdgeMap, orientationMap, nmsEdgeMap, 2, 0, 1, true);
-
-    Mat binaryEdgeMap;
-    threshold(nmsEdgeMap, binaryEdgeMap, thresholdValue, 1.0, THRESH_BINARY);
-
-    Mat probEdgeMap8U, binaryEdgeMap8U;
-    probEdgeMap.convertTo(probEdgeMap8U, CV_8UC1, 255.0);
-    binaryEdgeMap.convertTo(binaryEdgeMap8U, CV_8UC1, 255.0);
-
-    bitwise_not(probEdgeMap8U, probEdgeMap8U);
-    bitwise_not(binaryEdgeMap8U, binaryEdgeMap8U);
+// Runs the forest and NMS once for the image, then writes the probability
+// map and one binary map per threshold from the cached results.
+void sweepSE(const StructuredEdgeDetection& detector, const string& imgName, const vector<float>& thresholds) {
+    // The Mat wraps the read-only mapping; convertTo never writes to it.
+    MappedFile raw;
+    {
+        STAGE_TIMER("read", WIDTH * HEIGHT);
+        raw = mapRawImage(imgName, WIDTH, HEIGHT, CHANNELS);
+    }
+    Mat imageRGB(HEIGHT, WIDTH, CV_8UC3, const_cast<uint8_t*>(raw.data()));
+    StructuredEdgeMaps maps = detectStructuredEdges(detector, imageRGB);
 
     string baseName = imgName.substr(0, imgName.find_last_of("."));
-    imwrite(baseName + "_SE_prob.png", probEdgeMap8U);
-    imwrite(baseName + "_SE_binary_" + to_string(thresholdValue).substr(0, 4) + ".png", binaryEdgeMap8U);
+    vector<Mat> binaryMaps = binaryEdgeImages(maps, thresholds);
+    STAGE_TIMER("write", WIDTH * HEIGHT * (thresholds.size() + 1));
+    imwrite(baseName + "_SE_prob.png", probabilityImage(maps));
+    for (size_t k = 0; k < thresholds.size(); ++k) {
+        imwrite(baseName + "_SE_binary_" + to_string(thresholds[k]).substr(0, 4) + ".png", binaryMaps[k]);
+    }
 }
 
 int main() {
+    INSTRUMENT_RUN("structured-edge");
     string modelFilename = "model.yml.gz"; 
     
     Ptr<StructuredEdgeDetection> pDollar;
@@ -58,9 +45,25 @@ int main() {
     vector<float> thresholds = {0.05f, 0.1f, 0.15f, 0.2f, 0.3f, 0.4f, 0.5f, 0.6f, 0.7f, 0.8f}; 
     vector<string> images = {"Bird.raw", "Deer.raw"};
 
-    for (const float& thresh : thresholds) {
-        for (const string& imgName : images) {
-            processSE(pDollar, imgName, thresh);
+    // One thread per image, all sharing the detector.
+    vector<string> errors(images.size());
+    vector<thread> workers;
+    for (size_t i = 0; i < images.size(); ++i) {
+        workers.emplace_back([&, i] {
+            try {
+                sweepSE(*pDollar, images[i], thresholds);
+            } catch (const std::exception& e) {
+                errors[i] = e.what();
+            }
+        });
+    }
+    for (thread& worker : workers) {
+        worker.join();
+    }
+    for (const string& error : errors) {
+        if (!error.empty()) {
+            cerr << error << endl;
+            return -1;
         }
     }
 
@@ -0,0 +1,61 @@
+#ifndef STRUCTURED_EDGE_H
+#define STRUCTURED_EDGE_H
+
+#include <opencv2/opencv.hpp>
+#include <opencv2/ximgproc.hpp>
+#include <vector>
+#include "../../common/instrumentation.h"
+
+using namespace std;
+
+// Everything a threshold sweep needs from one image: the forest's
+// probability map, normalized to [0, 1], and its non-maximum-suppressed
+// edges. Computing these is the expensive part; thresholding them is cheap.
+struct StructuredEdgeMaps {
+    cv::Mat probability;
+    cv::Mat nms;
+};
+
+// detectEdges, computeOrientation and edgesNms are const and only read the
+// model, so one detector can serve several threads at once.
+inline StructuredEdgeMaps detectStructuredEdges(const cv::ximgproc::StructuredEdgeDetection& detector,
+                                                const cv::Mat& imageRGB) {
+    StructuredEdgeMaps maps;
+    {
+        STAGE_TIMER("detect", imageRGB.total());
+        cv::Mat imageFloat;
+        imageRGB.convertTo(imageFloat, CV_32FC3, 1.0 / 255.0);
+        detector.detectEdges(imageFloat, maps.probability);
+        cv::normalize(maps.probability, maps.probability, 0.0, 1.0, cv::NORM_MINMAX);
+    }
+
+    STAGE_TIMER("nms", imageRGB.total());
+    cv::Mat orientationMap;
+    detector.computeOrientation(maps.probability, orientationMap);
+    detector.edgesNms(maps.probability, orientationMap, maps.nms, 2, 0, 1, true);
+    return maps;
+}
+
+// Inverted 8-bit probability map (edges dark).
+inline cv::Mat probabilityImage(const StructuredEdgeMaps& maps) {
+    cv::Mat probability8U;
+    maps.probability.convertTo(probability8U, CV_8UC1, 255.0);
+    cv::bitwise_not(probability8U, probability8U);
+    return probability8U;
+}
+
+// Inverted 8-bit binary map for every threshold, all cut from the cached NMS map.
+inline vector<cv::Mat> binaryEdgeImages(const StructuredEdgeMaps& maps, const vector<float>& thresholds) {
+    STAGE_TIMER("threshold", maps.nms.total() * thresholds.size());
+    vector<cv::Mat> binaryMaps;
+    for (float thresholdValue : thresholds) {
+        cv::Mat binaryEdgeMap, binaryEdgeMap8U;
+        cv::threshold(maps.nms, binaryEdgeMap, thresholdValue, 1.0, cv::THRESH_BINARY);
+        binaryEdgeMap.convertTo(binaryEdgeMap8U, CV_8UC1, 255.0);
+        cv::bitwise_not(binaryEdgeMap8U, binaryEdgeMap8U);
+        binaryMaps.push_back(binaryEdgeMap8U);
+    }
+    return binaryMaps;
+}
+
+#endif
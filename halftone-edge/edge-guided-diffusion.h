@@ -0,0 +1,153 @@
+#ifndef EDGE_GUIDED_DIFFUSION_H
+#define EDGE_GUIDED_DIFFUSION_H
+
+#include <vector>
+#include <thread>
+#include <cstdint>
+#include <cstddef>
+#include <algorithm>
+#include <exception>
+#include "../common/bounded-queue.h"
+#include "../common/buffer-pool.h"
+#include "../digital-half-toning/error-diffusion/error-diffusion.h"
+#include "../edge-detection/sober-edge-detector/sober-edge-detector.h"
+
+using namespace std;
+
+// Edge-guided error diffusion of a gray image: the Sobel magnitude of the
+// input steers the threshold of every pixel, so edges print sharper while
+// flat areas keep the plain error-diffusion texture. A pixel of input I and
+// edge weight w = min(1, magnitude / EDGE_FULL_MAGNITUDE) is quantized as if
+// its value were u + gain * w * (I - 128), u being the input plus the error
+// diffused into it. The error passed on is still u minus the printed tone,
+// so every area keeps its mean tone. This is the threshold modulation of
+// Eschbach and Knox with the strength taken from the edge map; a gain of 0
+// gives the plain error diffusion bit for bit.
+//
+// No magnitude frame is built and nothing goes through a file: bands of
+// EDGE_BAND_ROWS rows pass through a Sobel stage, which turns each row of
+// magnitudes into a row of offsets, and on into the diffusion stage. With
+// pipelined set the Sobel stage runs on its own thread, up to
+// EDGE_PIPELINE_DEPTH bands ahead, so band k + 1 gets its edges while band k
+// is diffused. The result does not depend on pipelined.
+
+const int EDGE_BAND_ROWS = SOBEL_STRIP_ROWS;
+const int EDGE_PIPELINE_DEPTH = 3;
+const float EDGE_FULL_MAGNITUDE = 256.0f;  // a step of 64 levels
+const float DEFAULT_EDGE_GAIN = 2.0f;
+
+template <typename Kernel, bool Serpentine, typename Plane>
+void edgeGuidedDiffusion(const uint8_t* input, const Plane& output, int width, int height,
+                         float gain = DEFAULT_EDGE_GAIN, bool pipelined = true) {
+    int numBands = (height + EDGE_BAND_ROWS - 1) / EDGE_BAND_ROWS;
+    int depth = pipelined ? EDGE_PIPELINE_DEPTH : 1;
+    size_t bandSize = static_cast<size_t>(EDGE_BAND_ROWS) * width;
+    ScratchBuffer<float> offsets(depth * bandSize);
+
+    // Sobel stage, on the integer row functions of applySobelInt16 (exact
+    // gradients, as the input is already 8-bit gray), reading the input rows
+    // in place. Border rows and columns have no magnitude, as in applySobel,
+    // and so no offset.
+    SobelRowFn sobelRow = selectSobelRow();
+    vector<int16_t> gx(width), gy(width);
+    vector<float> mag(width);
+    auto edgeBand = [&](int band, float* bandOffsets) {
+        int y0 = band * EDGE_BAND_ROWS;
+        int y1 = min(height, y0 + EDGE_BAND_ROWS);
+        for (int y = y0; y < y1; ++y) {
+            float* row = bandOffsets + static_cast<size_t>(y - y0) * width;
+            fill(row, row + width, 0.0f);
+            if (y == 0 || y + 1 == height) continue;
+            const uint8_t* tone = input + static_cast<size_t>(y) * width;
+            sobelRow(tone - width, tone, tone + width, gx.data(), gy.data(), mag.data(), width);
+            for (int x = 1; x < width - 1; ++x) {
+                float weight = min(1.0f, mag[x] * (1.0f / EDGE_FULL_MAGNITUDE));
+                row[x] = gain * weight * (tone[x] - 128.0f);
+            }
+        }
+    };
+
+    // Diffusion stage, keeping a ring of the rows the kernel reaches.
+    constexpr int ringRows = Kernel::H - Kernel::CY;
+    vector<float> ring(ringRows * width);
+    auto load = [&](int y) {
+        float* row = &ring[(y % ringRows) * width];
+        for (int x = 0; x < width; ++x) {
+            row[x] = y < height ? static_cast<float>(input[static_cast<size_t>(y) * width + x]) : 0.0f;
+        }
+    };
+    for (int y = 0; y < ringRows; ++y) {
+        load(y);
+    }
+    auto diffuseBand = [&](int band, const float* bandOffsets) {
+        int y0 = band * EDGE_BAND_ROWS;
+        int y1 = min(height, y0 + EDGE_BAND_ROWS);
+        for (int y = y0; y < y1; ++y) {
+            float* rows[ringRows];
+            for (int d = 0; d < ringRows; ++d) {
+                rows[d] = &ring[((y + d) % ringRows) * width];
+            }
+            const float* rowOffsets = bandOffsets + static_cast<size_t>(y - y0) * width;
+            if (Serpentine && y % 2 != 0) {
+                diffuseKernelSpan<Kernel, true>(rows, output, y, width, 0, width, rowOffsets);
+            } else {
+                diffuseKernelSpan<Kernel, false>(rows, output, y, width, 0, width, rowOffsets);
+            }
+            load(y + ringRows);
+        }
+    };
+
+    if (!pipelined) {
+        for (int band = 0; band < numBands; ++band) {
+            edgeBand(band, offsets.data());
+            diffuseBand(band, offsets.data());
+        }
+        return;
+    }
+    // Slots of offsets go round: empty -> Sobel stage -> filled -> diffusion.
+    BoundedQueue<int> emptySlots(depth), filledSlots(depth);
+    for (int slot = 0; slot < depth; ++slot) {
+        emptySlots.push(slot);
+    }
+    // A failure in either stage closes both queues, so the other one stops
+    // waiting; the Sobel stage's error is rethrown once its thread is joined.
+    auto stop = [&] {
+        emptySlots.close();
+        filledSlots.close();
+    };
+    exception_ptr edgeError;
+    thread edges([&] {
+        try {
+            int slot = 0;
+            for (int band = 0; band < numBands && emptySlots.pop(slot); ++band) {
+                edgeBand(band, &offsets[slot * bandSize]);
+                if (!filledSlots.push(slot)) break;
+            }
+        } catch (...) {
+            edgeError = current_exception();
+            stop();
+        }
+    });
+    try {
+        for (int band = 0; band < numBands; ++band) {
+            int slot = 0;
+            if (!filledSlots.pop(slot)) break;
+            diffuseBand(band, &offsets[slot * bandSize]);
+            emptySlots.push(slot);
+        }
+    } catch (...) {
+        stop();
+        edges.join();
+        throw;
+    }
+    edges.join();
+    if (edgeError) rethrow_exception(edgeError);
+}
+
+template <typename Kernel, bool Serpentine>
+void edgeGuidedDiffusion(const uint8_t* input, uint8_t* output, int width, int height,
+                         float gain = DEFAULT_EDGE_GAIN, bool pipelined = true) {
+    edgeGuidedDiffusion<Kernel, Serpentine>(input, BytePlane{output, width}, width, height, gain, pipelined);
+}
+
+#endif
@@ -0,0 +1,580 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <functional>
+#include <random>
+#include <thread>
+#include <atomic>
+#include <stdexcept>
+#include "../common/bounded-queue.h"
+#include "../common/raw-image.h"
+#include "../common/bit-plane.h"
+#include "../common/tone-levels.h"
+#include "../common/buffer-pool.h"
+#include "../common/instrumentation.h"
+#include "../digital-half-toning/dithering/dithering.h"
+#include "../digital-half-toning/dithering/blue-noise.h"
+#include "../digital-half-toning/error-diffusion/error-diffusion.h"
+#include "../color-half-toning-with-error-diffusion/separable-error-diffusion/separable-error-diffusion.h"
+#include "../color-half-toning-with-error-diffusion/mbvq-based-error-diffusion/mbvq-based-error-diffusion.h"
+#include "../edge-detection/sober-edge-detector/sober-edge-detector.h"
+#include "edge-guided-diffusion.h"
+#ifdef HAVE_OPENCV
+#include <opencv2/opencv.hpp>
+#include <opencv2/ximgproc.hpp>
+#include "../edge-detection/structured-edge/structured-edge.h"
+#include "../edge-detection/canny-edge-detector/canny-edge-detector.h"
+#endif
+
+using namespace std;
+
+// One binary for every operator in the repo. A single image is
+//   halftone-edge <command> --width W --height H [options] <input.raw> <output-prefix>
+// and a batch is
+//   halftone-edge <command> --width W --height H [options] --manifest list.txt [--jobs N]
+// where each manifest line is "<input.raw> [output-prefix]". Batches run as a
+// reader -> workers -> writer pipeline over bounded queues, so reading,
+// processing and writing of different images overlap.
+
+struct Options {
+    string command;
+    int width = 0;
+    int height = 0;
+    int jobs = max(1u, thread::hardware_concurrency());
+    int queueDepth = 0;
+    string manifest;
+    vector<string> positional;
+
+    // sobel
+    vector<double> percentages = {5, 15, 30};
+    bool int16 = false;
+    // canny
+    vector<pair<double, double>> cannyThresholds = {{10, 30}, {60, 180}, {120, 360}};
+    // structured-edge
+    string model = "model.yml.gz";
+    vector<float> seThresholds = {0.05f, 0.1f, 0.15f, 0.2f, 0.3f, 0.4f, 0.5f, 0.6f, 0.7f, 0.8f};
+    // dither
+    string method = "bayer";
+    int threshold = 128;
+    int matrixSize = 0;  // 0: 8 for bayer, 64 for blue-noise
+    uint64_t seed = random_device()();
+    // error-diffusion, edge-guided
+    string kernel = "fs";
+    string scan;
+    // edge-guided
+    float edgeGain = DEFAULT_EDGE_GAIN;
+    // error-diffusion, separable, mbvq
+    bool fixed = false;
+    ToneLevels levels = makeToneLevels(2);
+    // sobel edge maps, dither, error-diffusion, separable, mbvq
+    bool pbm = false;
+};
+
+// Kernels that produce a single image write straight into a mapped output
+// file; the rest return bytes for the writer stage, in a frame borrowed from
+// the scratch pool that goes back once written.
+struct Output {
+    string filename;
+    ScratchBuffer<unsigned char> data;
+    MappedFile mapped;
+};
+
+struct Job {
+    size_t index;
+    string input;
+    string prefix;
+    MappedFile pixels;
+    string error;
+    vector<Output> outputs;
+};
+
+Output bytesOutput(const string& filename, ScratchBuffer<unsigned char> data) {
+    Output output;
+    output.filename = filename;
+    output.data = move(data);
+    return output;
+}
+
+Output bytesOutput(const string& filename, const unsigned char* begin, const unsigned char* end) {
+    ScratchBuffer<unsigned char> data(end - begin);
+    copy(begin, end, data.begin());
+    return bytesOutput(filename, move(data));
+}
+
+Output mappedOutput(const string& filename, int width, int height, int channels) {
+    Output output;
+    output.filename = filename;
+    output.mapped = createRawImage(filename, width, height, channels);
+    return output;
+}
+
+Output mappedPbmOutput(const string& filename, int width, int height, int planes) {
+    Output output;
+    output.filename = filename;
+    output.mapped = createPbmImage(filename, width, height, planes);
+    return output;
+}
+
+Output mappedPackedOutput(const string& filename, int width, int height, const ToneLevels& levels, int planes) {
+    Output output;
+    output.filename = filename;
+    output.mapped = createPackedLevelImage(filename, width, height, levels, planes);
+    return output;
+}
+
+typedef function<vector<Output>(const uint8_t* pixels, const string& prefix)> Processor;
+
+void printUsage(const char* program) {
+    cerr << "usage: " << program << " <command> --width W --height H [options] <input.raw> <output-prefix>\n"
+         << "       " << program << " <command> --width W --height H [options] --manifest <list> [--jobs N] [--queue N]\n"
+         << "commands and options:\n"
+         << "  sobel            [--percentages 5,15,30] [--int16]\n"
+         << "  canny            [--thresholds 10:30,60:180,120:360]\n"
+         << "  structured-edge  [--model model.yml.gz] [--thresholds 0.05,0.1,...]\n"
+         << "  dither           [--method fixed|random|bayer|blue-noise] [--threshold 128] [--seed S]\n"
+         << "                   [--size 8 for bayer, 16..256 for blue-noise (default 64)]\n"
+         << "  error-diffusion  [--kernel fs|jjn|stucki] [--scan serpentine|raster] [--fixed | --levels N]\n"
+         << "  edge-guided      [--kernel fs|jjn|stucki] [--scan serpentine|raster] [--gain 2] [--levels N]\n"
+         << "  separable        [--fixed | --levels N]\n"
+         << "  mbvq             [--fixed | --levels N]\n"
+         << "sobel, canny, structured-edge, separable and mbvq read RGB; dither, error-diffusion and\n"
+         << "edge-guided read gray. edge-guided is error diffusion with its threshold steered by the Sobel\n"
+         << "edges of the input, computed in the same pass; --gain 0 gives plain error diffusion.\n"
+         << "--pbm writes binary outputs (sobel edge maps, dither, error-diffusion, edge-guided, and the\n"
+         << "C/M/Y planes of separable and mbvq) as 1-bit PBM files instead of one byte per pixel.\n"
+         << "--levels N (2 to 256) quantizes to N tones per channel; with --pbm the result is written as\n"
+         << "headerless rows of 2, 4 or 8 bits per pixel, the C/M/Y planes in turn, to <prefix>_packed.raw." << endl;
+}
+
+vector<string> splitList(const string& text, char separator) {
+    vector<string> items;
+    string item;
+    istringstream stream(text);
+    while (getline(stream, item, separator)) {
+        if (!item.empty()) items.push_back(item);
+    }
+    return items;
+}
+
+vector<double> parseDoubles(const string& text) {
+    vector<double> values;
+    for (const string& item : splitList(text, ',')) {
+        values.push_back(stod(item));
+    }
+    return values;
+}
+
+// Throws invalid_argument on unknown options or malformed values.
+Options parseOptions(int argc, char* argv[]) {
+    Options options;
+    options.command = argv[1];
+    bool levelsSet = false;
+    for (int i = 2; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg.rfind("--", 0) != 0) {
+            options.positional.push_back(arg);
+            continue;
+        }
+        if (arg == "--int16") { options.int16 = true; continue; }
+        if (arg == "--fixed") { options.fixed = true; continue; }
+        if (arg == "--pbm") { options.pbm = true; continue; }
+        if (i + 1 >= argc) throw invalid_argument("missing value for " + arg);
+        string value = argv[++i];
+        if (arg == "--width") options.width = stoi(value);
+        else if (arg == "--height") options.height = stoi(value);
+        else if (arg == "--jobs") options.jobs = max(1, stoi(value));
+        else if (arg == "--queue") options.queueDepth = stoi(value);
+        else if (arg == "--manifest") options.manifest = value;
+        else if (arg == "--percentages") options.percentages = parseDoubles(value);
+        else if (arg == "--model") options.model = value;
+        else if (arg == "--method") options.method = value;
+        else if (arg == "--threshold") options.threshold = stoi(value);
+        else if (arg == "--size") options.matrixSize = stoi(value);
+        else if (arg == "--seed") options.seed = stoull(value);
+        else if (arg == "--kernel") options.kernel = value;
+        else if (arg == "--scan") options.scan = value;
+        else if (arg == "--levels") {
+            options.levels = makeToneLevels(stoi(value));
+            levelsSet = true;
+        }
+        else if (arg == "--gain") options.edgeGain = stof(value);
+        else if (arg == "--thresholds") {
+            if (options.command == "canny") {
+                options.cannyThresholds.clear();
+                for (const string& pair : splitList(value, ',')) {
+                    size_t colon = pair.find(':');
+                    if (colon == string::npos) throw invalid_argument("canny thresholds are low:high pairs");
+                    options.cannyThresholds.push_back({stod(pair.substr(0, colon)), stod(pair.substr(colon + 1))});
+                }
+            } else {
+                vector<double> thresholds = parseDoubles(value);
+                options.seThresholds.assign(thresholds.begin(), thresholds.end());
+            }
+        } else {
+            throw invalid_argument("unknown option " + arg);
+        }
+    }
+    if (options.width <= 0 || options.height <= 0) throw invalid_argument("--width and --height are required");
+    if (options.fixed && options.levels.count > 2) throw invalid_argument("--fixed has no multi-level mode");
+    const string& command = options.command;
+    if (command == "sobel" || command == "canny" || command == "structured-edge" || command == "dither") {
+        if (options.fixed) throw invalid_argument(command + " has no --fixed mode");
+        if (levelsSet) throw invalid_argument(command + " has no --levels mode");
+    }
+    return options;
+}
+
+int inputChannels(const string& command) {
+    return (command == "dither" || command == "error-diffusion" || command == "edge-guided") ? 1 : 3;
+}
+
+// The fixed-point kernels are binary only.
+template <typename Kernel, typename Plane>
+void diffuseWith(const uint8_t* input, const Plane& output, int width, int height,
+                 bool serpentine, bool fixed, int numThreads) {
+    if constexpr (!is_same<Plane, LevelPlane>::value) {
+        if (fixed) {
+            if (serpentine) applyErrorDiffusionFixed<Kernel, true>(input, output, width, height, numThreads);
+            else applyErrorDiffusionFixed<Kernel, false>(input, output, width, height, numThreads);
+            return;
+        }
+    }
+    if (serpentine) applyErrorDiffusion<Kernel, true>(input, output, width, height, numThreads);
+    else applyErrorDiffusion<Kernel, false>(input, output, width, height, numThreads);
+}
+
+template <typename Kernel, typename Plane>
+void edgeGuidedWith(const uint8_t* input, const Plane& output, int width, int height,
+                    bool serpentine, float gain, bool pipelined) {
+    if (serpentine) edgeGuidedDiffusion<Kernel, true>(input, output, width, height, gain, pipelined);
+    else edgeGuidedDiffusion<Kernel, false>(input, output, width, height, gain, pipelined);
+}
+
+// Creates the mapped output for a binary image and runs kernel on its
+// planes: bytes in a .raw or bits in a .pbm. Planes is 1 for gray, or 3 for
+// the R, G and B (in a .pbm the C, M and Y) of a colour halftone.
+template <int Planes, typename Kernel>
+Output binaryOutput(const Options& options, const string& prefix, Kernel kernel) {
+    int width = options.width;
+    int height = options.height;
+    Output result = options.pbm ? mappedPbmOutput(prefix + ".pbm", width, height, Planes)
+                                : mappedOutput(prefix + ".raw", width, height, Planes);
+    uint8_t* data = result.mapped.data();
+    if constexpr (Planes == 1) {
+        if (options.pbm) kernel(pbmPlane(data, width, height));
+        else kernel(BytePlane{data, width});
+    } else {
+        if (options.pbm) kernel(pbmPlanes(data, width, height));
+        else kernel(interleavedPlanes(data, width));
+    }
+    return result;
+}
+
+// The same for a multi-level halftone (--levels, see tone-levels.h): tones in
+// a .raw, or with --pbm packed rows in a headerless _packed.raw.
+template <int Planes, typename Kernel>
+Output levelOutput(const Options& options, const string& prefix, Kernel kernel) {
+    int width = options.width;
+    int height = options.height;
+    const ToneLevels& levels = options.levels;
+    Output result = options.pbm ? mappedPackedOutput(prefix + "_packed.raw", width, height, levels, Planes)
+                                : mappedOutput(prefix + ".raw", width, height, Planes);
+    uint8_t* data = result.mapped.data();
+    if constexpr (Planes == 1) {
+        if (options.pbm) kernel(packedLevelPlane(data, width, height, levels));
+        else kernel(LevelPlane{data, width, &levels});
+    } else {
+        if (options.pbm) kernel(packedLevelPlanes(data, width, height, levels));
+        else kernel(interleavedLevelPlanes(data, width, levels));
+    }
+    return result;
+}
+
+// Builds the per-image function for the command. One function serves every
+// worker, so it must be safe to call concurrently; the structured-edge model
+// is loaded once and shared.
+Processor makeProcessor(const Options& options) {
+    int width = options.width;
+    int height = options.height;
+    const string& command = options.command;
+
+    if (command == "sobel") {
+        return [=](const uint8_t* rgb, const string& prefix) {
+            ImageView<const uint8_t> view = ImageView<const uint8_t>::interleaved(rgb, width, height, 3);
+            SobelMaps maps = options.int16
+                ? applySobelInt16(convertToGray8(view), width, height, options.percentages, options.pbm)
+                : applySobelFused(view, options.percentages, options.pbm);
+            vector<Output> outputs;
+            outputs.push_back(bytesOutput(prefix + "_GradX.raw", move(maps.gradX)));
+            outputs.push_back(bytesOutput(prefix + "_GradY.raw", move(maps.gradY)));
+            outputs.push_back(bytesOutput(prefix + "_Magnitude.raw", move(maps.magnitude)));
+            for (size_t k = 0; k < options.percentages.size(); ++k) {
+                string name = prefix + edgeMapSuffix(options.percentages[k]) + (options.pbm ? ".pbm" : ".raw");
+                outputs.push_back(bytesOutput(name, move(maps.edgeMaps[k])));
+            }
+            return outputs;
+        };
+    }
+#ifdef HAVE_OPENCV
+    if (command == "canny") {
+        return [=](const uint8_t* rgb, const string& prefix) {
+            cv::Mat color(height, width, CV_8UC3, const_cast<uint8_t*>(rgb));
+            cv::Mat gray, blurred;
+            cv::cvtColor(color, gray, cv::COLOR_RGB2GRAY);
+            cv::GaussianBlur(gray, blurred, cv::Size(5, 5), 1.4);
+            CannyCandidates candidates = cannyCandidates(blurred.ptr<uint8_t>(), width, height, blurred.step);
+            vector<vector<uint8_t>> edgeMaps = cannyHysteresis(candidates, options.cannyThresholds);
+            vector<Output> outputs;
+            for (size_t k = 0; k < edgeMaps.size(); ++k) {
+                for (uint8_t& value : edgeMaps[k]) {
+                    value = 255 - value;
+                }
+                const auto& thresh = options.cannyThresholds[k];
+                string name = prefix + "_Canny_" + to_string((int)thresh.first) + "_" + to_string((int)thresh.second) + ".raw";
+                outputs.push_back(bytesOutput(name, edgeMaps[k].data(), edgeMaps[k].data() + edgeMaps[k].size()));
+            }
+            return outputs;
+        };
+    }
+    if (command == "structured-edge") {
+        cv::Ptr<cv::ximgproc::StructuredEdgeDetection> detector = cv::ximgproc::createStructuredEdgeDetection(options.model);
+        return [=](const uint8_t* rgb, const string& prefix) {
+            cv::Mat image(height, width, CV_8UC3, const_cast<uint8_t*>(rgb));
+            StructuredEdgeMaps maps = detectStructuredEdges(*detector, image);
+            cv::Mat probability = probabilityImage(maps);
+            vector<cv::Mat> binaryMaps = binaryEdgeImages(maps, options.seThresholds);
+            vector<Output> outputs;
+            outputs.push_back(bytesOutput(prefix + "_SE_prob.raw", probability.datastart, probability.dataend));
+            for (size_t k = 0; k < binaryMaps.size(); ++k) {
+                string name = prefix + "_SE_binary_" + to_string(options.seThresholds[k]).substr(0, 4) + ".raw";
+                outputs.push_back(bytesOutput(name, binaryMaps[k].datastart, binaryMaps[k].dataend));
+            }
+            return outputs;
+        };
+    }
+#else
+    if (command == "canny" || command == "structured-edge") {
+        throw invalid_argument(command + " needs a build with -DHAVE_OPENCV");
+    }
+#endif
+    if (command == "dither") {
+        if (options.method != "fixed" && options.method != "random" && options.method != "bayer" &&
+            options.method != "blue-noise") {
+            throw invalid_argument("unknown dither method " + options.method);
+        }
+        int size = options.matrixSize > 0 ? options.matrixSize : options.method == "blue-noise" ? 64 : 8;
+        // Loaded (or generated and cached) here, once for every worker.
+        const BlueNoise* noise = options.method == "blue-noise" ? &blueNoise(size) : nullptr;
+        return [=](const uint8_t* gray, const string& prefix) {
+            vector<Output> outputs;
+            outputs.push_back(binaryOutput<1>(options, prefix, [&](const auto& output) {
+                if (options.method == "fixed") fixedThresholding(gray, output, width, height, options.threshold);
+                else if (options.method == "random") randomThresholding(gray, output, width, height, options.seed);
+                else if (noise) ditherBlueNoise(gray, output, width, height, *noise);
+                else ditherMatrix(gray, output, width, height, size);
+            }));
+            return outputs;
+        };
+    }
+    if (command == "error-diffusion" || command == "edge-guided") {
+        if (options.kernel != "fs" && options.kernel != "jjn" && options.kernel != "stucki") {
+            throw invalid_argument("unknown kernel " + options.kernel);
+        }
+        bool edgeGuided = command == "edge-guided";
+        if (edgeGuided && options.fixed) throw invalid_argument("edge-guided has no --fixed mode");
+        // Same defaults as the error-diffusion tool: FS serpentine, JJN and Stucki raster.
+        bool serpentine = options.scan.empty() ? options.kernel == "fs" : options.scan == "serpentine";
+        // Jobs already occupy the cores, so each wavefront (or edge-guided
+        // pipeline) gets its share of them.
+        int numThreads = max(1, static_cast<int>(thread::hardware_concurrency()) / options.jobs);
+        return [=](const uint8_t* gray, const string& prefix) {
+            auto diffuseWithKernel = [&](auto kernel, const auto& output) {
+                typedef decltype(kernel) Kernel;
+                if (edgeGuided) {
+                    edgeGuidedWith<Kernel>(gray, output, width, height, serpentine, options.edgeGain, numThreads > 1);
+                } else {
+                    diffuseWith<Kernel>(gray, output, width, height, serpentine, options.fixed, numThreads);
+                }
+            };
+            auto diffuse = [&](const auto& output) {
+                if (options.kernel == "fs") diffuseWithKernel(FloydSteinbergKernel(), output);
+                else if (options.kernel == "jjn") diffuseWithKernel(JarvisJudiceNinkeKernel(), output);
+                else diffuseWithKernel(StuckiKernel(), output);
+            };
+            vector<Output> outputs;
+            if (options.levels.count > 2) outputs.push_back(levelOutput<1>(options, prefix, diffuse));
+            else outputs.push_back(binaryOutput<1>(options, prefix, diffuse));
+            return outputs;
+        };
+    }
+    if (command == "separable") {
+        return [=](const uint8_t* rgb, const string& prefix) {
+            ImageView<const uint8_t> view = ImageView<const uint8_t>::interleaved(rgb, width, height, 3);
+            vector<Output> outputs;
+            if (options.levels.count > 2) {
+                outputs.push_back(levelOutput<3>(options, prefix, [&](const auto& planes) {
+                    separableErrorDiffusion(view, planes);
+                }));
+            } else {
+                outputs.push_back(binaryOutput<3>(options, prefix, [&](const auto& planes) {
+                    if (options.fixed) separableErrorDiffusionFused(view, planes);
+                    else separableErrorDiffusion(view, planes);
+                }));
+            }
+            return outputs;
+        };
+    }
+    if (command == "mbvq") {
+        return [=](const uint8_t* rgb, const string& prefix) {
+            ImageView<const uint8_t> view = ImageView<const uint8_t>::interleaved(rgb, width, height, 3);
+            vector<Output> outputs;
+            if (options.levels.count > 2) {
+                outputs.push_back(levelOutput<3>(options, prefix, [&](const auto& planes) {
+                    mbvqErrorDiffusion(view, planes);
+                }));
+            } else {
+                outputs.push_back(binaryOutput<3>(options, prefix, [&](const auto& planes) {
+                    if (options.fixed) mbvqErrorDiffusionFixed(view, planes);
+                    else mbvqErrorDiffusion(view, planes);
+                }));
+            }
+            return outputs;
+        };
+    }
+    throw invalid_argument("unknown command " + command);
+}
+
+// Manifest lines are "<input> [output-prefix]"; blank lines and lines starting
+// with '#' are skipped. Without a prefix the input name minus its extension is used.
+bool readManifest(const string& filename, vector<pair<string, string>>& entries) {
+    ifstream file(filename);
+    if (!file) return false;
+    string line;
+    while (getline(file, line)) {
+        istringstream fields(line);
+        string input, prefix;
+        if (!(fields >> input) || input[0] == '#') continue;
+        if (!(fields >> prefix)) prefix = input.substr(0, input.find_last_of('.'));
+        entries.push_back({input, prefix});
+    }
+    return true;
+}
+
+string writeOutputs(const vector<Output>& outputs) {
+    for (const Output& output : outputs) {
+        if (output.mapped.size() > 0) continue;
+        ofstream file(output.filename, ios::binary);
+        if (!file.write(reinterpret_cast<const char*>(output.data.data()), output.data.size())) {
+            return "failed to write " + output.filename;
+        }
+    }
+    return "";
+}
+
+// Returns the number of images that failed.
+int runPipeline(const Options& options, const vector<pair<string, string>>& entries) {
+    int jobs = min<int>(options.jobs, max<size_t>(1, entries.size()));
+    size_t depth = options.queueDepth > 0 ? options.queueDepth : 2 * jobs;
+    int channels = inputChannels(options.command);
+
+    // Build the processor up front so a bad option fails before any I/O.
+    Processor process = makeProcessor(options);
+
+    BoundedQueue<Job> toProcess(depth), toWrite(depth);
+    thread reader([&] {
+        for (size_t i = 0; i < entries.size(); ++i) {
+            Job job;
+            job.index = i;
+            job.input = entries[i].first;
+            job.prefix = entries[i].second;
+            try {
+                STAGE_TIMER("read", options.width * options.height);
+                job.pixels = mapRawImage(job.input, options.width, options.height, channels);
+            } catch (const exception& e) {
+                job.error = e.what();
+            }
+            if (!toProcess.push(move(job))) break;
+        }
+        toProcess.close();
+    });
+
+    atomic<int> running(jobs);
+    vector<thread> workers;
+    for (int w = 0; w < jobs; ++w) {
+        workers.emplace_back([&] {
+            Job job;
+            while (toProcess.pop(job)) {
+                if (job.error.empty()) {
+                    try {
+                        STAGE_TIMER(options.command, options.width * options.height);
+                        job.outputs = process(job.pixels.data(), job.prefix);
+                    } catch (const exception& e) {
+                        job.error = job.input + ": " + e.what();
+                    }
+                }
+                job.pixels = MappedFile();
+                toWrite.push(move(job));
+            }
+            if (--running == 0) toWrite.close();
+        });
+    }
+
+    int failures = 0;
+    Job job;
+    while (toWrite.pop(job)) {
+        if (job.error.empty()) {
+            STAGE_TIMER("write", options.width * options.height);
+            job.error = writeOutputs(job.outputs);
+        }
+        if (!job.error.empty()) {
+            cerr << job.error << endl;
+            ++failures;
+        }
+    }
+    reader.join();
+    for (thread& worker : workers) {
+        worker.join();
+    }
+    return failures;
+}
+
+int main(int argc, char* argv[]) {
+    INSTRUMENT_RUN("halftone-edge");
+    if (argc < 2 || string(argv[1]) == "--help") {
+        printUsage(argv[0]);
+        return argc < 2 ? -1 : 0;
+    }
+
+    Options options;
+    vector<pair<string, string>> entries;
+    try {
+        options = parseOptions(argc, argv);
+        if (!options.manifest.empty()) {
+            if (!readManifest(options.manifest, entries)) throw invalid_argument("cannot read manifest " + options.manifest);
+        } else if (options.positional.size() == 2) {
+            entries.push_back({options.positional[0], options.positional[1]});
+        } else {
+            throw invalid_argument("expected <input.raw> <output-prefix> or --manifest");
+        }
+    } catch (const exception& e) {
+        cerr << e.what() << endl;
+        printUsage(argv[0]);
+        return -1;
+    }
+
+    int failures;
+    try {
+        failures = runPipeline(options, entries);
+    } catch (const exception& e) {
+        cerr << e.what() << endl;
+        return -1;
+    }
+    if (failures > 0) {
+        cerr << failures << " of " << entries.size() << " images failed" << endl;
+        return -1;
+    }
+    return 0;
+}
\ No newline at end of file